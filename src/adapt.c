@@ -0,0 +1,374 @@
+/*
+ * Copyright (C) 2001  Till Adam
+ * Authors: Till Adam <till@adam-lilienthal.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, a copy can be downloaded from
+ * http://www.gnu.org/licenses/gpl.html, or obtained by writing to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * adapt.c - adaptive choice of encodings, quality and compression.
+ *
+ * With --adaptive, every framebuffer update is measured: the bytes that came
+ * in, the time spent waiting for them, the time between an update request
+ * and the start of the answer (the smallest of which is about the round trip
+ * time) and the time the decoders took per encoding. Every couple of seconds
+ * the profiles, from plain hextile/raw up to tight with low JPEG quality, are
+ * costed for the pixels of the last window: the bytes per pixel each has
+ * been seen to take at the measured rate, plus the time per pixel its
+ * encoding has been seen to take to decode. The best looking profile that
+ * would have kept the client from being busy all the time is picked, or the
+ * cheapest one if none would have. A new profile is sent as a SetEncodings
+ * message, but only after several windows agreed on it and never more than
+ * one step at a time, so the choice does not flap on a link near a
+ * threshold.
+ */
+
+#include "directvnc.h"
+#include "adapt.h"
+
+/* length of a measuring window */
+#define ADAPT_WINDOW_USEC 2000000
+/* a window with less data than this says nothing about the link */
+#define ADAPT_MIN_BYTES (16 * 1024)
+/* consecutive windows that have to agree before the profile changes */
+#define ADAPT_AGREE 3
+/* minimum time between two changes */
+#define ADAPT_HOLD_USEC 6000000
+/* encodings whose decoding time is kept track of */
+#define ADAPT_MAX_ENCODINGS 16
+/* percentage of a window a profile may keep the client busy */
+#define ADAPT_MAX_LOAD 80
+
+struct adapt_profile
+{
+   char *name;
+   char *encodings;
+   int compresslevel;   /* -1 to leave it to the server */
+   int quality;         /* -1 for no JPEG */
+   CARD32 encoding;     /* the one doing most of the work */
+   int decode_guess;    /* ms per Mpixel, until its encoding was measured */
+   int size_guess;      /* percent of the raw pixel size, until measured */
+   int max_rtt;         /* in milliseconds, 0 for any */
+};
+
+static struct adapt_profile profiles[] = {
+   { "raw/hextile", "copyrect hextile raw", -1, -1,
+      rfbEncodingHextile, 4, 60, 10 },
+   { "tight lossless", "copyrect tight hextile", 1, -1,
+      rfbEncodingTight, 25, 15, 0 },
+   { "tight quality 8", "copyrect tight hextile", 6, 8,
+      rfbEncodingTight, 20, 5, 0 },
+   { "tight quality 5", "copyrect tight hextile", 9, 5,
+      rfbEncodingTight, 18, 2, 0 },
+   { "tight quality 2", "copyrect tight hextile", 9, 2,
+      rfbEncodingTight, 15, 1, 0 },
+};
+#define ADAPT_PROFILES (sizeof(profiles) / sizeof(profiles[0]))
+
+/* bytes per pixel seen with each profile, 0 before it was used */
+static double profile_bytes[ADAPT_PROFILES];
+
+struct adapt_decoder
+{
+   CARD32 encoding;
+   long usec;
+   long pixels;
+};
+
+unsigned long adapt_bytes = 0;
+unsigned long adapt_consumed = 0;
+long adapt_wait_usec = 0;
+
+static int current = -1;        /* profile in use, -1 before the first choice */
+static int proposed = -1;
+static int agreed = 0;
+static long last_change = 0;
+
+static long request_time = 0;   /* outstanding update request or 0 */
+static long window_start = 0;
+static unsigned long window_bytes, window_pixels;
+static long window_wait, window_busy, window_rtt;
+/* decoding times of the session, older windows counting less and less */
+static struct adapt_decoder decoders[ADAPT_MAX_ENCODINGS];
+static int num_decoders;
+
+/* at the start of the update and the rect being decoded */
+static long update_start, update_wait;
+static unsigned long update_bytes;
+static long rect_start, rect_wait;
+
+long
+adapt_now(void)
+{
+   struct timeval tv;
+
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+static void
+_adapt_reset_window(long now)
+{
+   int i;
+
+   window_start = now;
+   window_bytes = 0;
+   window_pixels = 0;
+   window_wait = 0;
+   window_busy = 0;
+   window_rtt = -1;
+   for (i = 0; i < num_decoders; i++)
+   {
+      decoders[i].usec /= 2;
+      decoders[i].pixels /= 2;
+   }
+}
+
+void
+adapt_request_sent(void)
+{
+   if (!opt.adaptive || request_time)
+      return;
+   request_time = adapt_now();
+}
+
+void
+adapt_update_begin(void)
+{
+   long now;
+
+   if (!opt.adaptive)
+      return;
+   now = adapt_now();
+   if (!window_start)
+      _adapt_reset_window(now);
+   if (request_time && (window_rtt < 0 || now - request_time < window_rtt))
+      window_rtt = now - request_time;
+   request_time = 0;
+
+   update_start = now;
+   update_wait = adapt_wait_usec;
+   /* most of the update may have been read already, count what it uses */
+   update_bytes = adapt_consumed;
+}
+
+void
+adapt_rect_begin(void)
+{
+   if (!opt.adaptive)
+      return;
+   rect_start = adapt_now();
+   rect_wait = adapt_wait_usec;
+}
+
+void
+adapt_rect_end(CARD32 encoding, int pixels)
+{
+   struct adapt_decoder *d;
+   int i;
+
+   if (!opt.adaptive)
+      return;
+   for (i = 0; i < num_decoders; i++)
+      if (decoders[i].encoding == encoding)
+	 break;
+   if (i == num_decoders)
+   {
+      if (num_decoders == ADAPT_MAX_ENCODINGS)
+	 return;
+      decoders[i].encoding = encoding;
+      decoders[i].usec = 0;
+      decoders[i].pixels = 0;
+      num_decoders++;
+   }
+   d = &decoders[i];
+   /* whatever was not spent waiting for the server was spent decoding */
+   d->usec += adapt_now() - rect_start - (adapt_wait_usec - rect_wait);
+   d->pixels += pixels;
+   window_pixels += pixels;
+}
+
+/*
+ * Like adapt_rect_end() for a rect that is decoded in parts, all but the last
+ * of which end here. The pixels are counted with the last part.
+ */
+void
+adapt_rect_part(CARD32 encoding)
+{
+   adapt_rect_end(encoding, 0);
+}
+
+static char *
+_adapt_encoding_name(CARD32 encoding)
+{
+   switch (encoding)
+   {
+      case rfbEncodingRaw: return "raw";
+      case rfbEncodingCopyRect: return "copyrect";
+      case rfbEncodingRRE: return "rre";
+      case rfbEncodingCoRRE: return "corre";
+      case rfbEncodingHextile: return "hextile";
+      case rfbEncodingZlib: return "zlib";
+      case rfbEncodingTight: return "tight";
+      case rfbEncodingZlibHex: return "zlibhex";
+      case rfbEncodingJPEG: return "jpeg";
+      case rfbEncodingH264: return "h264";
+   }
+   return NULL;
+}
+
+/*
+ * Microseconds a pixel would take with a profile: its bytes coming in at
+ * the rate of the link plus decoding them.
+ */
+static double
+_adapt_cost(int profile, long rate)
+{
+   struct adapt_profile *p = &profiles[profile];
+   double bytes, decode;
+   int i;
+
+   bytes = profile_bytes[profile];
+   if (!bytes)
+      bytes = p->size_guess / 100.0 * (opt.client.bpp / 8);
+   decode = p->decode_guess / 1000.0;
+   for (i = 0; i < num_decoders; i++)
+      if (decoders[i].encoding == p->encoding && decoders[i].pixels)
+	 decode = (double)decoders[i].usec / decoders[i].pixels;
+   return bytes * 1000000.0 / rate + decode;
+}
+
+/*
+ * Picks the best looking profile that could have carried the pixels of the
+ * last window, which lasted window microseconds, or the cheapest.
+ */
+static int
+_adapt_choose(long rate, long rtt, long window)
+{
+   double cost, cheapest_cost = 0;
+   int i, cheapest = -1;
+
+   for (i = 0; i < ADAPT_PROFILES; i++)
+   {
+      if (profiles[i].max_rtt && rtt > profiles[i].max_rtt * 1000L)
+	 continue;
+      cost = window_pixels * _adapt_cost(i, rate);
+      if (cost <= window / 100.0 * ADAPT_MAX_LOAD)
+	 return i;
+      if (cheapest < 0 || cost < cheapest_cost)
+      {
+	 cheapest = i;
+	 cheapest_cost = cost;
+      }
+   }
+   return cheapest;
+}
+
+static void
+_adapt_log(int from, int to, long rate, long rtt, int decode_share)
+{
+   char *name;
+   int i;
+
+   fprintf(stderr, "adaptive: %ld KB/s, rtt %ld ms, decoding %d%%",
+	 rate / 1024, rtt / 1000, decode_share);
+   for (i = 0; i < num_decoders; i++)
+   {
+      name = _adapt_encoding_name(decoders[i].encoding);
+      if (name && decoders[i].pixels)
+	 fprintf(stderr, ", %s %.1f ms/Mpixel", name,
+	       decoders[i].usec / 1000.0 * 1000000.0 / decoders[i].pixels);
+   }
+   if (from < 0)
+      fprintf(stderr, ": using %s\n", profiles[to].name);
+   else
+      fprintf(stderr, ": %s -> %s\n", profiles[from].name, profiles[to].name);
+}
+
+void
+adapt_update_end(void)
+{
+   long now, rate, rtt, waited;
+   int choice, decode_share;
+   double bytes;
+
+   if (!opt.adaptive)
+      return;
+   now = adapt_now();
+   waited = adapt_wait_usec - update_wait;
+   window_bytes += adapt_consumed - update_bytes;
+   window_wait += waited;
+   window_busy += now - update_start;
+
+   if (now - window_start < ADAPT_WINDOW_USEC)
+      return;
+   if (window_bytes < ADAPT_MIN_BYTES || window_busy <= 0)
+   {
+      /* the screen was mostly idle */
+      _adapt_reset_window(now);
+      return;
+   }
+
+   /* with no waiting at all the link was faster than we could tell */
+   rate = window_bytes * 1000000.0 / (window_wait > 1000 ? window_wait : 1000);
+   rtt = window_rtt < 0 ? 0 : window_rtt;
+   decode_share = 100 * (window_busy - window_wait) / window_busy;
+   if (current >= 0 && window_pixels)
+   {
+      bytes = (double)window_bytes / window_pixels;
+      profile_bytes[current] = profile_bytes[current]
+	 ? (profile_bytes[current] + bytes) / 2 : bytes;
+   }
+   choice = _adapt_choose(rate, rtt, now - window_start);
+
+   if (current >= 0)
+   {
+      if (choice == current)
+      {
+	 proposed = -1;
+	 agreed = 0;
+      }
+      else
+      {
+	 /* one step at a time */
+	 choice = choice > current ? current + 1 : current - 1;
+	 if (choice == proposed)
+	    agreed++;
+	 else
+	 {
+	    proposed = choice;
+	    agreed = 1;
+	 }
+	 if (agreed < ADAPT_AGREE || now - last_change < ADAPT_HOLD_USEC)
+	    choice = current;
+      }
+   }
+
+   if (choice != current)
+   {
+      _adapt_log(current, choice, rate, rtt, decode_share);
+      if (rfb_send_encodings(profiles[choice].encodings,
+	       profiles[choice].compresslevel, profiles[choice].quality))
+      {
+	 current = choice;
+	 last_change = now;
+      }
+      proposed = -1;
+      agreed = 0;
+   }
+   _adapt_reset_window(now);
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2001  Till Adam
+ * Authors: Till Adam <till@adam-lilienthal.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, a copy can be downloaded from
+ * http://www.gnu.org/licenses/gpl.html, or obtained by writing to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Prototypes for the adaptive encoding controller */
+
+/* kept up to date by read_from_rfb_server() */
+extern unsigned long adapt_bytes;
+/* bytes handed out to the decoders, kept up to date by sockets.c */
+extern unsigned long adapt_consumed;
+extern long adapt_wait_usec;
+
+long adapt_now(void);
+void adapt_request_sent(void);
+void adapt_update_begin(void);
+void adapt_rect_begin(void);
+void adapt_rect_end(CARD32 encoding, int pixels);
+void adapt_rect_part(CARD32 encoding);
+void adapt_update_end(void);
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2001  Till Adam
+ * Authors: Till Adam <till@adam-lilienthal.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, a copy can be downloaded from
+ * http://www.gnu.org/licenses/gpl.html, or obtained by writing to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * arena.c - memory for decoding.
+ *
+ * Everything a rect needs only until the end of its framebuffer update (raw
+ * pixels, JPEG and H.264 payloads, cursor mask bits, cut text) comes from a
+ * bump arena that is reset when the update is done. Whatever does not fit
+ * the arena block gets a block of its own, and at the reset the arena grows
+ * to what the update used, so once updates look alike no more heap
+ * allocations happen while decoding and the memory used stays at the size of
+ * the largest update.
+ *
+ * Buffers that live longer than an update are scratch buffers: one per
+ * purpose, owned here, grown when a caller needs more and never shrunk.
+ */
+
+#include <stdlib.h>
+#include "directvnc.h"
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_SIZE (64 * 1024)
+
+struct arena_overflow
+{
+   struct arena_overflow *next;
+   /* the allocation follows, aligned by the union */
+   union
+   {
+      long double ld;
+      void *p;
+   } align;
+};
+
+static char *arena = NULL;
+static size_t arena_size = 0;
+static size_t arena_used = 0;
+static struct arena_overflow *overflow = NULL;
+static size_t overflow_bytes = 0;
+
+static struct
+{
+   char *data;
+   size_t size;
+} scratch[SCRATCH_BUFFERS];
+
+/*
+ * Returns n bytes that stay valid until the next arena_reset(), or NULL if
+ * there is no memory left.
+ */
+void *
+arena_alloc(size_t n)
+{
+   struct arena_overflow *o;
+   void *p;
+
+   /* never hand out NULL for an empty rect */
+   if (!n)
+      n = 1;
+   n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+   if (arena_used + n <= arena_size)
+   {
+      p = arena + arena_used;
+      arena_used += n;
+      return p;
+   }
+
+   o = malloc(sizeof(*o) + n);
+   if (!o)
+   {
+      fprintf(stderr, "Memory allocation error.\n");
+      return NULL;
+   }
+   o->next = overflow;
+   overflow = o;
+   overflow_bytes += n;
+   return &o->align;
+}
+
+/*
+ * Gives back everything allocated since the last reset. Called at the end of
+ * every framebuffer update, after the decoder threads are done with it.
+ */
+void
+arena_reset(void)
+{
+   struct arena_overflow *o;
+   size_t size;
+
+   if (overflow)
+   {
+      while ((o = overflow))
+      {
+	 overflow = o->next;
+	 free(o);
+      }
+      size = arena_size ? arena_size : ARENA_MIN_SIZE;
+      while (size < arena_used + overflow_bytes)
+	 size *= 2;
+      /* nothing in the arena is in use anymore, no need to copy it */
+      free(arena);
+      arena = malloc(size);
+      arena_size = arena ? size : 0;
+      overflow_bytes = 0;
+   }
+   arena_used = 0;
+}
+
+/*
+ * Returns the scratch buffer id with room for at least n bytes, with what was
+ * in it before. NULL if there is no memory left.
+ */
+char *
+scratch_get(int id, size_t n)
+{
+   char *grown;
+
+   if (!n)
+      n = 1;
+   if (n <= scratch[id].size)
+      return scratch[id].data;
+   grown = realloc(scratch[id].data, n);
+   if (!grown)
+   {
+      fprintf(stderr, "Memory allocation error.\n");
+      return NULL;
+   }
+   scratch[id].data = grown;
+   scratch[id].size = n;
+   return grown;
+}
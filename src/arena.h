@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2001  Till Adam
+ * Authors: Till Adam <till@adam-lilienthal.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, a copy can be downloaded from
+ * http://www.gnu.org/licenses/gpl.html, or obtained by writing to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Prototypes for the update arena and the scratch buffers */
+
+/* memory for the rects of one framebuffer update, gone after arena_reset() */
+void *arena_alloc(size_t n);
+void arena_reset(void);
+
+/* scratch buffers, kept for the whole session */
+#define SCRATCH_DECODE 0        /* Tight band of inflated and filtered rows, raw band */
+#define SCRATCH_ZLIB 1          /* Zlib band of inflated rows */
+#define SCRATCH_CURSOR_SOURCE 2 /* pixels of the cursor shape */
+#define SCRATCH_CURSOR_MASK 3   /* one byte per pixel of the cursor shape */
+#define SCRATCH_TIGHT_ROWS 4    /* previous and current row of the gradient filter */
+#define SCRATCH_BUFFERS 5
+
+char *scratch_get(int id, size_t n);
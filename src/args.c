@@ -68,6 +68,12 @@ args_parse(int argc, char **argv)
    opt.shared = 1;
    opt.localcursor = 1;
    opt.poll_freq = 50;
+   opt.jpeg_cache_size = 8192;
+   opt.scale = 1;
+   opt.server_scale = 1;
+   opt.prefetch = 64;
+   opt.pointer_interval = 20;
+   opt.recv_buffer = 256;
 
    opt.h_ratio = 1;
    opt.v_ratio = 1;
@@ -105,6 +111,18 @@ _parse_options_array(int argc, char **argv)
        'l',
        'f', ':',
        'm', ':',
+       'j', ':',
+       'S', ':',
+       'A',
+       'M', ':',
+       'C',
+       'G',
+       'i', ':',
+       'R', ':',
+       'U',
+       'H',
+       'D', ':',
+       'r', ':',
 
        0
    };
@@ -126,6 +144,18 @@ _parse_options_array(int argc, char **argv)
       {"nolocalcursor",  0, NULL, 'l'},
       {"pollfrequency",  1, NULL, 'f'},
       {"modmap",         1, NULL, 'm'},
+      {"jpegcache",      1, NULL, 'j'},
+      {"scale",          1, NULL, 'S'},
+      {"adaptive",       0, NULL, 'A'},
+      {"prefetch",       1, NULL, 'M'},
+      {"colourmap",      0, NULL, 'C'},
+      {"bgr233",         0, NULL, 'G'},
+      {"pointerinterval",1, NULL, 'i'},
+      {"recvbuffer",     1, NULL, 'R'},
+      {"iouring",        0, NULL, 'U'},
+      {"headless",       0, NULL, 'H'},
+      {"dump",           1, NULL, 'D'},
+      {"record",         1, NULL, 'r'},
 
       {0, 0, 0, 0}
    };
@@ -151,9 +181,21 @@ _parse_options_array(int argc, char **argv)
 	 case 'b':
 	    intarg = atoi(optarg);
 	    switch (intarg) {
+	       case 8:
+		  opt.client.bpp = intarg;
+		  opt.client.depth = intarg;
+		  opt.client.truecolour = 1;
+		  opt.client.redmax = 7;
+		  opt.client.greenmax = 7;
+		  opt.client.bluemax = 3;
+		  opt.client.redshift = 5;
+		  opt.client.greenshift = 2;
+		  opt.client.blueshift = 0;
+		  break;
 	       case 24:
+	       case 32:
 	          opt.client.bpp=32;
-                  opt.client.depth=intarg;
+                  opt.client.depth=24;
 		  opt.client.redmax=255;
 		  opt.client.bluemax=255;
 		  opt.client.greenmax=255;
@@ -164,16 +206,60 @@ _parse_options_array(int argc, char **argv)
 	       case 16:
 		  opt.client.bpp = intarg;
 		  break;
-	       case 8:
-	       case 32:
 	       default:
 		  fprintf(stderr, "Depth currently not supported!\n");
 		  exit(-1);
 	    }
 	    break;
+	 case 'C':
+	    opt.client.bpp = 8;
+	    opt.client.depth = 8;
+	    opt.client.truecolour = 0;
+	    break;
+	 case 'G':
+	    opt.client.bpp = 8;
+	    opt.client.depth = 8;
+	    opt.client.truecolour = 1;
+	    opt.client.redmax = 7;
+	    opt.client.greenmax = 7;
+	    opt.client.bluemax = 3;
+	    opt.client.redshift = 0;
+	    opt.client.greenshift = 3;
+	    opt.client.blueshift = 6;
+	    break;
 	 case 'f':
 	    opt.poll_freq = atoi(optarg);
 	    break;
+	 case 'U':
+	    opt.io_uring = 1;
+	    break;
+	 case 'H':
+	    opt.headless = 1;
+	    break;
+	 case 'D':
+	    opt.dump_file = strdup(optarg);
+	    break;
+	 case 'r':
+	    opt.record_file = strdup(optarg);
+	    break;
+	 case 'R':
+	    intarg = atoi(optarg);
+	    if (intarg >= 16) {
+	       opt.recv_buffer = intarg;
+	    } else {
+	       fprintf(stderr, "Invalid receive buffer size: %s (at least 16)\n", optarg);
+	       exit(-2);
+	    }
+	    break;
+	 case 'i':
+	    intarg = atoi(optarg);
+	    if (intarg >= 0) {
+	       opt.pointer_interval = intarg;
+	    } else {
+	       fprintf(stderr, "Invalid pointer interval: %s\n", optarg);
+	       exit(-2);
+	    }
+	    break;
 	 case 'p':
 	    opt.password = strdup(optarg);
 	    break;
@@ -186,6 +272,36 @@ _parse_options_array(int argc, char **argv)
 	 case 'm':
 	    opt.modmapfile = strdup(optarg);
 	    break;
+	 case 'j':
+	    intarg = atoi(optarg);
+	    if (intarg >= 0) {
+	       opt.jpeg_cache_size = intarg;
+	    } else {
+	       fprintf(stderr, "Invalid JPEG cache size: %s\n", optarg);
+	       exit(-2);
+	    }
+	    break;
+	 case 'S':
+	    intarg = atoi(optarg);
+	    if (intarg == 1 || intarg == 2 || intarg == 4 || intarg == 8) {
+	       opt.scale = intarg;
+	    } else {
+	       fprintf(stderr, "Invalid scale: %s (use 1, 2, 4 or 8)\n", optarg);
+	       exit(-2);
+	    }
+	    break;
+	 case 'A':
+	    opt.adaptive = 1;
+	    break;
+	 case 'M':
+	    intarg = atoi(optarg);
+	    if (intarg >= 0) {
+	       opt.prefetch = intarg;
+	    } else {
+	       fprintf(stderr, "Invalid prefetch margin: %s\n", optarg);
+	       exit(-2);
+	    }
+	    break;
 	 case 's':
 	    opt.shared = 1;
 	    break;
@@ -237,7 +353,17 @@ show_usage_and_exit()
       "  -p, --password STRING      "   "Password for the server.\n"
       "  -P, --passwordfile FILENAME"   "Password file for the server.\n"
       "  -b, --bpp NUM              "   "Set the clients bit per pixel to NUM.\n"
+      "  -C, --colourmap            "   "Use 8 bit pixels with a colour map.\n"
+      "  -G, --bgr233               "   "Use 8 bit pixels in the BGR233 format.\n"
       "  -f, --pollfrequency MS     "   "Time between checks for events in milliseconds.\n"
+      "  -R, --recvbuffer KB        "   "Size of the receive buffer (default 256).\n"
+      "  -U, --iouring              "   "Use io_uring for the server connection.\n"
+      "  -H, --headless             "   "Draw into memory instead of on the console.\n"
+      "  -D, --dump FILENAME        "   "With --headless, write the screen as a PPM file\n"
+      "                             "   "after every update.\n"
+      "  -r, --record FILENAME      "   "Record everything the server sends in an FBS file.\n"
+      "  -i, --pointerinterval MS   "   "Minimum time between pointer motion events\n"
+      "                             "   "sent to the server (default 20).\n"
       "  -l, --nolocalcursor        "   "Disable local cursor handling.\n"
       "  -s, --shared               "   "Don't disonnect already connected clients.\n"
       "  -n, --noshared             "   "Disconnect already connected clients.\n"
@@ -247,6 +373,12 @@ show_usage_and_exit()
       "  -q, --quality LEVEL        "   "Quality level (0..9) to be used by jpeg\n"
       "                             "   "compression in tight encoding.\n"
       "  -m, --modmap STRING        "   "Path to the modmap (subset of X-style) file to load\n"
+      "  -j, --jpegcache KB         "   "Size of the decoded JPEG cache (0 disables it).\n"
+      "  -S, --scale N              "   "Show the server at 1/N of its size (N = 1, 2, 4, 8).\n"
+      "  -A, --adaptive             "   "Switch encodings, quality and compression to\n"
+      "                             "   "suit the link and the decoding speed.\n"
+      "  -M, --prefetch PIXELS      "   "Margin fetched around the visible part of a server\n"
+      "                             "   "larger than the screen (default 64).\n"
       "  -h, --help                 "   "Show this text and exit.\n"
       "  -v, --version              "   "Show version information and exit.\n"
       "\n"
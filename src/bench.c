@@ -0,0 +1,521 @@
+/*
+ * Copyright (C) 2001  Till Adam
+ * Authors: Till Adam <till@adam-lilienthal.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, a copy can be downloaded from
+ * http://www.gnu.org/licenses/gpl.html, or obtained by writing to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * bench.c - replays a recorded session through the decoders.
+ *
+ * directvnc-bench [--paced] [--directfb] FILE [directvnc options]
+ *
+ * FILE is a session recorded with --record (or any other FBS file), or the
+ * raw byte stream a server sent. A child process plays the server: it sends
+ * the recording over a socket pair, as fast as the client takes it or, with
+ * --paced, at the pace it was recorded, and throws away whatever the client
+ * sends. The client side is the real thing, from the handshake on: rfb.c
+ * and all decoders draw into the headless backend, or with --directfb on the
+ * console. The options after FILE are those of directvnc and have to match
+ * the ones the session was recorded with, -b in particular, as the pixel
+ * format the server used is not in the recording.
+ *
+ * This file stands in for adapt.c: rfb.c reports every update and rect to
+ * it, which here is used for the statistics printed at the end.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include "directvnc.h"
+#include "adapt.h"
+
+#define BENCH_MAX_ENCODINGS 32
+
+#define FBS_HEADER "FBS 001.000\n"
+#define FBS_HEADER_SIZE 12
+
+struct bench_encoding
+{
+   CARD32 encoding;
+   long rects;
+   long usec;
+   unsigned long pixels;
+   unsigned long bytes;
+};
+
+/* where everything is drawn, see directvnc.h */
+struct display_backend *display;
+
+/* kept up to date by sockets.c */
+unsigned long adapt_bytes = 0;
+unsigned long adapt_consumed = 0;
+long adapt_wait_usec = 0;
+
+static struct bench_encoding encodings[BENCH_MAX_ENCODINGS];
+static int num_encodings = 0;
+
+/* decoding time of every update */
+static long *update_usec = NULL;
+static int num_updates = 0, max_updates = 0;
+
+static long bench_start;
+static long update_start, update_wait;
+static long rect_start, rect_wait;
+static unsigned long rect_consumed;
+
+static struct display_backend backend;
+static void (*backend_deinit)(void);
+static int exit_status = 0;
+
+/* sockets.c */
+extern int errorMessageOnReadFailure;
+
+long
+adapt_now(void)
+{
+   struct timeval tv;
+
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+void
+adapt_request_sent(void)
+{
+}
+
+void
+adapt_update_begin(void)
+{
+   update_start = adapt_now();
+   update_wait = adapt_wait_usec;
+}
+
+void
+adapt_rect_begin(void)
+{
+   rect_start = adapt_now();
+   rect_wait = adapt_wait_usec;
+   rect_consumed = adapt_consumed;
+}
+
+static void
+_bench_rect_end(CARD32 encoding, int pixels, int rects)
+{
+   struct bench_encoding *e;
+   int i;
+
+   for (i = 0; i < num_encodings; i++)
+      if (encodings[i].encoding == encoding)
+	 break;
+   if (i == num_encodings)
+   {
+      if (num_encodings == BENCH_MAX_ENCODINGS)
+	 return;
+      memset(&encodings[i], 0, sizeof(encodings[i]));
+      encodings[i].encoding = encoding;
+      num_encodings++;
+   }
+   e = &encodings[i];
+   e->rects += rects;
+   /* whatever was not spent waiting for the server was spent decoding */
+   e->usec += adapt_now() - rect_start - (adapt_wait_usec - rect_wait);
+   e->pixels += pixels;
+   e->bytes += adapt_consumed - rect_consumed;
+}
+
+void
+adapt_rect_end(CARD32 encoding, int pixels)
+{
+   _bench_rect_end(encoding, pixels, 1);
+}
+
+void
+adapt_rect_part(CARD32 encoding)
+{
+   _bench_rect_end(encoding, 0, 0);
+}
+
+void
+adapt_update_end(void)
+{
+   long *p;
+
+   if (num_updates == max_updates)
+   {
+      max_updates = max_updates ? max_updates * 2 : 1024;
+      if (!(p = realloc(update_usec, max_updates * sizeof(long))))
+      {
+	 fprintf(stderr, "Memory allocation error.\n");
+	 exit(-1);
+      }
+      update_usec = p;
+   }
+   update_usec[num_updates++] =
+      adapt_now() - update_start - (adapt_wait_usec - update_wait);
+}
+
+static char *
+_bench_encoding_name(CARD32 encoding)
+{
+   static char name[16];
+
+   switch (encoding)
+   {
+      case rfbEncodingRaw: return "raw";
+      case rfbEncodingCopyRect: return "copyrect";
+      case rfbEncodingRRE: return "rre";
+      case rfbEncodingCoRRE: return "corre";
+      case rfbEncodingHextile: return "hextile";
+      case rfbEncodingZlib: return "zlib";
+      case rfbEncodingTight: return "tight";
+      case rfbEncodingZlibHex: return "zlibhex";
+      case rfbEncodingJPEG: return "jpeg";
+      case rfbEncodingH264: return "h264";
+      case rfbEncodingXCursor: return "xcursor";
+      case rfbEncodingRichCursor: return "richcursor";
+      case rfbEncodingLastRect: return "lastrect";
+      case rfbEncodingNewFBSize: return "desktopsize";
+      case rfbEncodingExtDesktopSize: return "extdesktopsize";
+   }
+   snprintf(name, sizeof(name), "%d", (int)encoding);
+   return name;
+}
+
+static int
+_bench_compare_long(const void *a, const void *b)
+{
+   long x = *(const long *)a, y = *(const long *)b;
+
+   return x < y ? -1 : x > y;
+}
+
+/* the value below which pct percent of the update times are */
+static double
+_bench_percentile(int pct)
+{
+   int i = (num_updates * pct + 99) / 100 - 1;
+
+   return update_usec[i < 0 ? 0 : i] / 1000.0;
+}
+
+static void
+_bench_report(void)
+{
+   struct rusage ru;
+   struct bench_encoding *e;
+   long wall = adapt_now() - bench_start;
+   double cpu, secs;
+   int i;
+
+   getrusage(RUSAGE_SELF, &ru);
+   cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+      + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0;
+
+   printf("\n%-14s %8s %10s %10s %10s %10s\n", "encoding", "rects",
+	 "rects/s", "MB/s in", "Mpixel/s", "ms total");
+   for (i = 0; i < num_encodings; i++)
+   {
+      e = &encodings[i];
+      secs = e->usec > 0 ? e->usec / 1000000.0 : 0.000001;
+      printf("%-14s %8ld %10.0f %10.1f %10.1f %10.1f\n",
+	    _bench_encoding_name(e->encoding), e->rects, e->rects / secs,
+	    e->bytes / secs / 1048576.0, e->pixels / secs / 1000000.0,
+	    e->usec / 1000.0);
+   }
+
+   printf("\n%d updates", num_updates);
+   if (num_updates)
+   {
+      qsort(update_usec, num_updates, sizeof(long), _bench_compare_long);
+      printf(", decoding per update: p50 %.2f ms, p99 %.2f ms, max %.2f ms",
+	    _bench_percentile(50), _bench_percentile(99),
+	    update_usec[num_updates - 1] / 1000.0);
+   }
+   printf("\n%lu bytes from the server in %.2f s (%.1f MB/s), "
+	 "CPU %.2f s (%.0f%%)\n", adapt_bytes, wall / 1000000.0,
+	 wall ? adapt_bytes / (wall / 1000000.0) / 1048576.0 : 0.0,
+	 cpu, wall ? 100.0 * cpu / (wall / 1000000.0) : 0.0);
+}
+
+/*
+ * The recording is over when the server closes the connection, and the
+ * client goes down the way it always does then: through the display
+ * deinit, where the report is printed.
+ */
+static void
+_bench_deinit(void)
+{
+   fflush(stdout);
+   backend_deinit();
+   _bench_report();
+   exit(exit_status);
+}
+
+/*
+ * Sends n bytes to the client, meanwhile reading and dropping what the
+ * client sends. If deadline is set, waits until then (in the time of
+ * adapt_now()) before sending. Returns 0 when the client has gone.
+ */
+static int
+_bench_send(int sock, char *data, unsigned int n, long deadline)
+{
+   static char drain[65536];
+   struct pollfd pfd;
+   long now;
+   int timeout, i;
+
+   pfd.fd = sock;
+   while (n > 0 || deadline)
+   {
+      timeout = -1;
+      if (deadline)
+      {
+	 now = adapt_now();
+	 if (now >= deadline)
+	    deadline = 0;
+	 else
+	    timeout = (deadline - now + 999) / 1000;
+      }
+      pfd.events = POLLIN | (deadline || !n ? 0 : POLLOUT);
+      if (poll(&pfd, 1, timeout) < 0)
+      {
+	 if (errno == EINTR)
+	    continue;
+	 return 0;
+      }
+      if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+      {
+	 i = read(sock, drain, sizeof(drain));
+	 if (i == 0 || (i < 0 && errno != EAGAIN && errno != EINTR))
+	    return 0;
+      }
+      if (pfd.revents & POLLOUT)
+      {
+	 i = send(sock, data, n, MSG_NOSIGNAL);
+	 if (i < 0 && errno != EAGAIN && errno != EINTR)
+	    return 0;
+	 if (i > 0)
+	 {
+	    data += i;
+	    n -= i;
+	 }
+      }
+   }
+   return 1;
+}
+
+/*
+ * The stand-in server: sends the recording in f to the client. FBS blocks
+ * go out one by one, at their recorded time if paced, a raw stream in
+ * chunks as large as the socket takes.
+ */
+static void
+_bench_serve(FILE *f, int fbs, int paced, int sock)
+{
+   static char data[65536];
+   char *block = NULL;
+   CARD32 len, timestamp;
+   unsigned int size = 0;
+   long start = adapt_now();
+   int n;
+
+   fcntl(sock, F_SETFL, O_NONBLOCK);
+   if (!fbs)
+   {
+      while ((n = fread(data, 1, sizeof(data), f)) > 0)
+	 if (!_bench_send(sock, data, n, 0))
+	    exit(0);
+   }
+   else
+   {
+      while (fread(&len, 4, 1, f) == 1)
+      {
+	 len = Swap32IfLE(len);
+	 if (((len + 3) & ~3) > size)
+	 {
+	    size = (len + 3) & ~3;
+	    if (!(block = realloc(block, size)))
+	    {
+	       fprintf(stderr, "Memory allocation error.\n");
+	       exit(1);
+	    }
+	 }
+	 if (fread(block, 1, (len + 3) & ~3, f) != ((len + 3) & ~3)
+	       || fread(&timestamp, 4, 1, f) != 1)
+	 {
+	    fprintf(stderr, "directvnc-bench: recording is truncated\n");
+	    break;
+	 }
+	 timestamp = Swap32IfLE(timestamp);
+	 if (!_bench_send(sock, block, len,
+		  paced ? start + timestamp * 1000L : 0))
+	    exit(0);
+      }
+   }
+
+   /* that was all, wait for the client to notice and hang up */
+   shutdown(sock, SHUT_WR);
+   while (_bench_send(sock, NULL, 0, adapt_now() + 1000000))
+      ;
+   exit(0);
+}
+
+static void
+_bench_usage(char *name)
+{
+   fprintf(stderr,
+	 "Usage: %s [--paced] [--directfb] FILE [directvnc options]\n"
+	 "\n"
+	 "Replays FILE, an FBS recording or a raw stream of what a server\n"
+	 "sent, through the decoders and reports how fast they were.\n"
+	 "  --paced      Send the recording at the pace it was recorded\n"
+	 "               instead of as fast as possible (FBS only).\n"
+	 "  --directfb   Draw on the console instead of into memory.\n"
+	 "The directvnc options must match those of the recording.\n",
+	 name);
+   exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+   char header[FBS_HEADER_SIZE];
+   char server[] = "replay:0";
+   char **args;
+   int paced = 0, directfb = 0, fbs, width, height, ret, i;
+   int sv[2];
+   FILE *f;
+   pid_t pid;
+
+   for (i = 1; i < argc && argv[i][0] == '-'; i++)
+   {
+      if (!strcmp(argv[i], "--paced") || !strcmp(argv[i], "-paced"))
+	 paced = 1;
+      else if (!strcmp(argv[i], "--directfb") || !strcmp(argv[i], "-directfb"))
+	 directfb = 1;
+      else
+	 _bench_usage(argv[0]);
+   }
+   if (i == argc)
+      _bench_usage(argv[0]);
+   if (!(f = fopen(argv[i], "rb")))
+   {
+      perror(argv[i]);
+      exit(1);
+   }
+   fbs = fread(header, 1, FBS_HEADER_SIZE, f) == FBS_HEADER_SIZE
+      && !memcmp(header, FBS_HEADER, FBS_HEADER_SIZE);
+   if (!fbs)
+   {
+      rewind(f);
+      if (paced)
+	 fprintf(stderr, "%s is not an FBS file, not pacing\n", argv[i]);
+      paced = 0;
+   }
+
+   /* the rest is for directvnc, connecting to a made up display */
+   args = malloc((argc - i + 2) * sizeof(char *));
+   args[0] = argv[0];
+   args[1] = server;
+   memcpy(args + 2, argv + i + 1, (argc - i - 1) * sizeof(char *));
+   args[argc - i + 1] = NULL;
+   args_parse(argc - i + 1, args);
+   opt.headless = !directfb;
+   /* sockets.c only times its waits for the adaptive controller, which
+    * this file stands in for */
+   opt.adaptive = 1;
+   /* the answer to a challenge goes nowhere, any password will do */
+   if (!opt.password && !opt.passwordfile)
+      opt.password = "";
+   errorMessageOnReadFailure = 0;
+
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+   {
+      perror("socketpair");
+      exit(1);
+   }
+   if ((pid = fork()) < 0)
+   {
+      perror("fork");
+      exit(1);
+   }
+   if (pid == 0)
+   {
+      close(sv[0]);
+      _bench_serve(f, fbs, paced, sv[1]);
+   }
+   close(sv[1]);
+   fclose(f);
+   sock = sv[0];
+   if (set_non_blocking(sock) < 0)
+      exit(1);
+
+   backend = opt.headless ? headless_display : dfb_display;
+   backend_deinit = backend.deinit;
+   backend.deinit = _bench_deinit;
+   display = &backend;
+
+   /* from here on as in main.c */
+   bench_start = adapt_now();
+   if (!rfb_initialise_connection() || !rfb_set_format_and_encodings())
+   {
+      fprintf(stderr, "The recording does not start with a handshake.\n");
+      exit(1);
+   }
+
+   display->init(argc, argv);
+   if (!rfb_negotiate_scale())
+      exit(1);
+
+   width = opt.server.width;
+   height = opt.server.height;
+   opt.server.width = 0;
+   opt.server.height = 0;
+   display->set_server_size(width, height);
+   mousestate.x = opt.client.width / 2;
+   mousestate.y = opt.client.height / 2;
+
+   rfb_send_update_request(0);
+   while ((ret = rfb_handle_server_message()))
+   {
+      if (ret == RFB_MESSAGE_DONE)
+      {
+	 rfb_send_update_request(1);
+	 display->process_events();
+	 /* the end of the recording may already be in the receive
+	  * buffer, so only read again when the next message needs it */
+	 continue;
+      }
+
+      /* wait_for_rfb_server() counts its wait, which is not decoding time */
+      display->process_events();
+      if (!wait_for_rfb_server(sock, 10))
+	 break;
+   }
+   fprintf(stderr, "directvnc-bench: replay stopped on an error\n");
+   exit_status = 1;
+   display->deinit();
+   return 0;
+}
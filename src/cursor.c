@@ -24,6 +24,7 @@
 
 
 #include "directvnc.h"
+#include "arena.h"
 
 #define OPER_SAVE     0
 #define OPER_RESTORE  1
@@ -35,7 +36,7 @@
 
 /* Data kept for RichCursor encoding support. */
 static Bool prevRichCursorSet = False;
-static IDirectFBSurface *rcSavedArea = NULL;
+static void *rcSavedArea = NULL;
 static CARD8 *rcSource, *rcMask;
 static int rcHotX, rcHotY, rcWidth, rcHeight;
 static int rcCursorX = 0, rcCursorY = 0;
@@ -72,36 +73,29 @@ Bool HandleRichCursor(int xhot, int yhot, int width, int height)
 
   /* Read cursor pixel data. */
 
-  rcSource = malloc(width * height * (opt.client.bpp / 8));
+  /* The shape lives in scratch buffers that are reused for the next one,
+     the mask bits are only needed until it is decoded. */
+  rcSource = (CARD8 *)scratch_get(SCRATCH_CURSOR_SOURCE,
+				  width * height * (opt.client.bpp / 8));
   if (rcSource == NULL)
     return False;
 
   if (!read_from_rfb_server(sock, (char *)rcSource,
-			 width * height * (opt.client.bpp / 8))) {
-    free(rcSource);
+			 width * height * (opt.client.bpp / 8)))
     return False;
-  }
 
   /* Read and decode mask data. */
 
-  buf = malloc(bytesMaskData);
-  if (buf == NULL) {
-    free(rcSource);
+  buf = arena_alloc(bytesMaskData);
+  if (buf == NULL)
     return False;
-  }
 
-  if (!read_from_rfb_server(sock, buf, bytesMaskData)) {
-    free(rcSource);
-    free(buf);
+  if (!read_from_rfb_server(sock, buf, bytesMaskData))
     return False;
-  }
 
-  rcMask = malloc(width * height);
-  if (rcMask == NULL) {
-    free(rcSource);
-    free(buf);
+  rcMask = (CARD8 *)scratch_get(SCRATCH_CURSOR_MASK, width * height);
+  if (rcMask == NULL)
     return False;
-  }
 
   ptr = rcMask;
   for (y = 0; y < height; y++) {
@@ -115,10 +109,8 @@ Bool HandleRichCursor(int xhot, int yhot, int width, int height)
     }
   }
 
-  free(buf);
-
   /* Set remaining data associated with cursor. */
-  rcSavedArea = dfb_create_cursor_saved_area(width, height);
+  rcSavedArea = display->cursor_create(width, height);
   if (!rcSavedArea) {
      return False;
   }
@@ -258,10 +250,10 @@ static void SoftCursorCopyArea(int oper)
 
   if (oper == OPER_SAVE) {
     /* Save screen area in memory. */
-    dfb_save_cursor_rect(rcSavedArea, x,y,w,h);
+    display->cursor_save(rcSavedArea, x,y,w,h);
   } else {
     /* Restore screen area. */
-    dfb_restore_cursor_rect(rcSavedArea, x,y,w,h);
+    display->cursor_restore(rcSavedArea, x,y,w,h);
   }
 }
 
@@ -285,7 +277,7 @@ static void SoftCursorDraw(void)
 	  if (rcMask[offset]) {
 	    pos = (char *)&rcSource[offset * bytesPerPixel];
 	    rfb_get_rgb_from_data(&r, &g, &b, pos);
-	    dfb_draw_rect_with_rgb(x0, y0, 1, 1, r,g,b);
+	    display->fill(x0, y0, 1, 1, r,g,b);
 	  }
 	}
       }
@@ -298,8 +290,8 @@ static void FreeCursors(Bool setDotCursor)
  
   if (prevRichCursorSet) {
     SoftCursorCopyArea(OPER_RESTORE);
-    free(rcSource);
-    free(rcMask);
+    display->cursor_free(rcSavedArea);
+    rcSavedArea = NULL;
     prevRichCursorSet = False;
   }
 }
@@ -19,6 +19,7 @@
  * Boston, MA 02110-1301, USA.
  */
 #include "directvnc.h"
+#include "adapt.h"
 #include <math.h>
 #include "keysym.h"
 #define KeySym int
@@ -37,9 +38,34 @@ DFBDisplayLayerConfig layer_config;
 DFBRegion rect;
 DFBRectangle scratch_rect;
 
+/* When the server does not fit on the screen, everything is drawn into the
+ * shadow surface, which holds the whole server, and dfb_flip_rect() copies
+ * what is inside the viewport to the screen. Otherwise canvas is the screen
+ * itself. */
+static IDirectFBSurface *canvas = NULL;
+static IDirectFBSurface *shadow = NULL;
+static DFBSurfacePixelFormat pixelformat;
+static int fb_width, fb_height;         /* size of the canvas */
+static int view_x, view_y;              /* viewport origin in the shadow */
+static int view_w, view_h;              /* size of the viewport */
+static int pan_x, pan_y;                /* where it is shown on the screen */
+
+/* 8 bit pixels, colour map indices or a 3-3-2 true colour format, are not
+ * put on the screen as they are but expanded through this table into the
+ * 16 bit screen format. The decoders still work on 8 bit pixels. */
+static CARD16 lut[256];
+
+/* Pointer motion is collected over all events waiting in the input buffer
+ * and sent at most every opt.pointer_interval ms, button changes go out at
+ * once along with the latest position. */
+static int motion_pending = 0;
+static long motion_sent = 0;
+
 static KeySym DirectFBTranslateSymbol (DFBInputDeviceKeymapEntry *entry, int index);
+static int dfb_pan_viewport(int dx, int dy);
+static void dfb_set_lut_entry(int index, int r, int g, int b);
 
-void
+static void
 dfb_init(int argc, char *argv[])
 {
      DFBCHECK(DirectFBInit( &argc, &argv ));
@@ -64,10 +90,37 @@ dfb_init(int argc, char *argv[])
      dsc.height = layer_config.height;
 
      dsc.caps = DSCAPS_PRIMARY | DSCAPS_SYSTEMONLY /*| DSCAPS_FLIPPING */;
-     /* FIXME */
-     dsc.pixelformat = DSPF_RGB16;
+     /* the decoders write client pixels straight into the surface */
+     switch (opt.client.bpp)
+     {
+	case 32:
+	   dsc.pixelformat = DSPF_RGB32;
+	   break;
+	default:
+	   dsc.pixelformat = DSPF_RGB16;
+	   break;
+     }
      DFBCHECK(dfb->CreateSurface(dfb, &dsc, &primary ));
      primary->GetSize (primary, &opt.client.width, &opt.client.height);
+     pixelformat = dsc.pixelformat;
+     canvas = primary;
+     fb_width = opt.client.width;
+     fb_height = opt.client.height;
+
+     /* true colour formats are known now, colour maps are filled in as they
+      * arrive and start out black */
+     if (opt.client.bpp == 8)
+     {
+	int i, r, g, b;
+	char pixel;
+
+	for (i = 0; i < 256; i++)
+	{
+	   pixel = i;
+	   rfb_get_rgb_from_data(&r, &g, &b, &pixel);
+	   dfb_set_lut_entry(i, r, g, b);
+	}
+     }
 
      DFBCHECK(dfb->GetInputDevice( dfb, DIDID_KEYBOARD, &keyboard ));
      DFBCHECK(dfb->GetInputDevice( dfb, DIDID_MOUSE, &mouse ));
@@ -78,9 +131,11 @@ dfb_init(int argc, char *argv[])
 /*
  * deinitializes resources and DirectFB
  */
-void 
-dfb_deinit()
+static void
+dfb_deinit(void)
 {
+    if ( shadow )
+         shadow->Release( shadow );
     if ( primary )
          primary->Release( primary );
     if ( input_buffer )
@@ -101,97 +156,465 @@ dfb_flip()
    primary->Flip(primary, NULL, DSFLIP_WAITFORSYNC);
 }
 
+/*
+ * Shows the rect x, y, w, h of the canvas on the screen. With a shadow
+ * surface, the part of it inside the viewport is copied to the screen first.
+ */
 void
-dfb_flip_rect(x, y, w, h)
+dfb_flip_rect(int x, int y, int w, int h)
 {
-   rect.x1 = x+opt.h_offset;
-   rect.y1 = y+opt.v_offset;
-   rect.x2 = x+w;
-   rect.y2 = y+h;
+   DFBRectangle area;
+
+   if (shadow)
+   {
+      if (x < view_x)
+      {
+	 w -= view_x - x;
+	 x = view_x;
+      }
+      if (y < view_y)
+      {
+	 h -= view_y - y;
+	 y = view_y;
+      }
+      if (x + w > view_x + view_w)
+	 w = view_x + view_w - x;
+      if (y + h > view_y + view_h)
+	 h = view_y + view_h - y;
+      if (w <= 0 || h <= 0)
+	 return;
+      area.x = x;
+      area.y = y;
+      area.w = w;
+      area.h = h;
+      x += pan_x - view_x;
+      y += pan_y - view_y;
+      primary->Blit(primary, shadow, &area, x, y);
+   }
+   else
+   {
+      x += opt.h_offset;
+      y += opt.v_offset;
+   }
+   rect.x1 = x;
+   rect.y1 = y;
+   rect.x2 = x + w - 1;
+   rect.y2 = y + h - 1;
    primary->Flip(primary, &rect, DSFLIP_WAITFORSYNC);
 }
 
-int
-dfb_write_data_to_screen(int x, int y, int w, int h, void *data)
+/*
+ * Sets the size of the server framebuffer, at startup and whenever the server
+ * is resized. A server that fits on the screen is centred on it, a larger one
+ * is kept in a shadow surface and shown through the viewport. What is still
+ * valid of the old picture is moved along to its new place and the rest is
+ * cleared, so only the newly exposed area has to be fetched again.
+ */
+static void
+dfb_set_server_size(int width, int height)
+{
+   IDirectFBSurface *old = canvas;
+   int old_h_offset = opt.h_offset, old_v_offset = opt.v_offset;
+   int old_width = fb_width, old_height = fb_height;
+   int keep_w, keep_h, sw, sh;
+
+   keep_w = SCALE_TO_SCREEN(width < opt.server.width ? width : opt.server.width);
+   keep_h = SCALE_TO_SCREEN(height < opt.server.height ? height : opt.server.height);
+
+   opt.server.width = width;
+   opt.server.height = height;
+   opt.h_offset = 0;
+   opt.v_offset = 0;
+   sw = SCALE_TO_SCREEN(width);
+   sh = SCALE_TO_SCREEN(height);
+
+   if (sw > opt.client.width || sh > opt.client.height)
+   {
+      memset( &dsc, 0, sizeof(DFBSurfaceDescription) );
+      dsc.flags = DSDESC_WIDTH | DSDESC_HEIGHT | DSDESC_PIXELFORMAT;
+      dsc.width = sw;
+      dsc.height = sh;
+      dsc.pixelformat = pixelformat;
+      DFBCHECK(dfb->CreateSurface(dfb, &dsc, &canvas));
+      fb_width = sw;
+      fb_height = sh;
+   }
+   else
+   {
+      canvas = primary;
+      fb_width = opt.client.width;
+      fb_height = opt.client.height;
+      opt.h_offset = (opt.client.width - sw) / 2;
+      opt.v_offset = (opt.client.height - sh) / 2;
+   }
+
+   /* only what is on the canvas before and after can be kept */
+   if (keep_w > fb_width - opt.h_offset)
+      keep_w = fb_width - opt.h_offset;
+   if (keep_w > old_width - old_h_offset)
+      keep_w = old_width - old_h_offset;
+   if (keep_h > fb_height - opt.v_offset)
+      keep_h = fb_height - opt.v_offset;
+   if (keep_h > old_height - old_v_offset)
+      keep_h = old_height - old_v_offset;
+   if (keep_w <= 0 || keep_h <= 0)
+      keep_w = keep_h = 0;
+
+   scratch_rect.x = old_h_offset;
+   scratch_rect.y = old_v_offset;
+   scratch_rect.w = keep_w;
+   scratch_rect.h = keep_h;
+   if (canvas != old)
+   {
+      canvas->SetColor(canvas, 0, 0, 0, 0xFF);
+      canvas->FillRectangle(canvas, 0, 0, fb_width, fb_height);
+      if (keep_w)
+	 canvas->Blit(canvas, old, &scratch_rect, opt.h_offset, opt.v_offset);
+      if (old == shadow)
+	 shadow->Release(shadow);
+      shadow = canvas == primary ? NULL : canvas;
+   }
+   else if (keep_w && (opt.h_offset != old_h_offset || opt.v_offset != old_v_offset))
+      canvas->Blit(canvas, canvas, &scratch_rect, opt.h_offset, opt.v_offset);
+
+   /* clear above, below, left and right of the kept area */
+   primary->SetColor(primary, 0, 0, 0, 0xFF);
+   if (shadow)
+      primary->FillRectangle(primary, 0, 0, opt.client.width, opt.client.height);
+   else
+   {
+      primary->FillRectangle(primary, 0, 0, opt.client.width, opt.v_offset);
+      primary->FillRectangle(primary, 0, opt.v_offset + keep_h, opt.client.width,
+	    opt.client.height - opt.v_offset - keep_h);
+      primary->FillRectangle(primary, 0, opt.v_offset, opt.h_offset, keep_h);
+      primary->FillRectangle(primary, opt.h_offset + keep_w, opt.v_offset,
+	    opt.client.width - opt.h_offset - keep_w, keep_h);
+   }
+
+   /* the viewport shows as much of the server as fits, centred if it is
+    * narrower or lower than the screen */
+   view_w = sw < opt.client.width ? sw : opt.client.width;
+   view_h = sh < opt.client.height ? sh : opt.client.height;
+   pan_x = (opt.client.width - view_w) / 2;
+   pan_y = (opt.client.height - view_h) / 2;
+   if (!dfb_pan_viewport(0, 0) && shadow)
+      dfb_flip_rect(view_x, view_y, view_w, view_h);
+   dfb_flip();
+}
+
+/*
+ * Moves the viewport by dx, dy screen pixels, as far as the server reaches.
+ * Returns 1 if it has moved.
+ */
+static int
+dfb_pan_viewport(int dx, int dy)
+{
+   int x = view_x + dx, y = view_y + dy;
+
+   if (!shadow)
+   {
+      view_x = view_y = 0;
+      return 0;
+   }
+   if (x > fb_width - view_w)
+      x = fb_width - view_w;
+   if (y > fb_height - view_h)
+      y = fb_height - view_h;
+   if (x < 0)
+      x = 0;
+   if (y < 0)
+      y = 0;
+   if (x == view_x && y == view_y)
+      return 0;
+
+   view_x = x;
+   view_y = y;
+   dfb_flip_rect(view_x, view_y, view_w, view_h);
+   return 1;
+}
+
+/*
+ * Gets the part of the server shown on the screen, in server pixels.
+ */
+static void
+dfb_get_viewport(int *x, int *y, int *w, int *h)
+{
+   *x = view_x * opt.scale;
+   *y = view_y * opt.scale;
+   *w = view_w * opt.scale;
+   *h = view_h * opt.scale;
+}
+
+/*
+ * Translates a position on the screen into one on the shown server
+ * framebuffer, in screen pixels. Positions on the border around a server
+ * smaller than the screen end up on its nearest edge.
+ */
+static void
+dfb_screen_to_canvas(int *x, int *y)
+{
+   int w = SCALE_TO_SCREEN(opt.server.width);
+   int h = SCALE_TO_SCREEN(opt.server.height);
+
+   if (shadow)
+   {
+      *x += view_x - pan_x;
+      *y += view_y - pan_y;
+   }
+   else
+   {
+      *x -= opt.h_offset;
+      *y -= opt.v_offset;
+   }
+   if (*x >= w)
+      *x = w - 1;
+   if (*y >= h)
+      *y = h - 1;
+   if (*x < 0)
+      *x = 0;
+   if (*y < 0)
+      *y = 0;
+}
+
+/*
+ * Sets what 8 bit pixel value index looks like on the screen.
+ */
+static void
+dfb_set_lut_entry(int index, int r, int g, int b)
+{
+   lut[index] = ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3);
+}
+
+/*
+ * Expands w 8 bit pixels, every step'th of src, into screen pixels.
+ */
+static void
+_dfb_expand_row(CARD16 *dst, CARD8 *src, int w, int step)
+{
+   int j;
+
+   if (step == 1)
+   {
+      for (j = 0; j + 4 <= w; j += 4)
+      {
+	 dst[j] = lut[src[j]];
+	 dst[j + 1] = lut[src[j + 1]];
+	 dst[j + 2] = lut[src[j + 2]];
+	 dst[j + 3] = lut[src[j + 3]];
+      }
+      for (; j < w; j++)
+	 dst[j] = lut[src[j]];
+   }
+   else
+      for (j = 0; j < w; j++)
+	 dst[j] = lut[src[j * step]];
+}
+
+/*
+ * Locks the screen so a decoder can write the w*h rect at server position
+ * x, y in place. Returns the address of its first pixel and the pitch of the
+ * screen, or NULL if the rect cannot be written as it is (when scaling, or if
+ * it is not completely on the screen); use dfb_write_data_to_screen() then.
+ * Every successful lock must be followed by dfb_unlock_rect().
+ */
+static char *
+dfb_lock_rect(int x, int y, int w, int h, int *pitch)
+{
+   char *dst;
+
+   if (opt.scale != 1 || opt.client.bpp == 8
+	 || x + w > fb_width || y + h > fb_height)
+      return NULL;
+   if (canvas->Lock(canvas, DSLF_WRITE, (void**)(&dst), pitch) != DFB_OK)
+      return NULL;
+   return dst + (y + opt.v_offset) * *pitch
+	      + (x + opt.h_offset) * opt.client.bpp/8;
+}
+
+static void
+dfb_unlock_rect(int x, int y, int w, int h)
+{
+   canvas->Unlock (canvas);
+   dfb_flip_rect (x,y,w,h);
+}
+
+/*
+ * Writes w*h pixels of data to the screen at screen position x, y. pitch is
+ * the number of bytes per row in data.
+ */
+static int
+dfb_write_screen_data(int x, int y, int w, int h, int pitch, void *data)
 {
  
    char *dst;
-   int pitch;         /* number of bytes per row */
-   int orig_src_pitch, src_pitch;     
+   int dst_pitch;         /* number of bytes per row */
+   int src_pitch;     
 
-   orig_src_pitch = w * opt.client.bpp/8; 
    /* make sure we dont exceed client dimensions */
-   if (x > opt.client.width  || y > opt.client.height)
+   if (x > fb_width  || y > fb_height)
 	   return 1; 
-   if ( x+w > opt.client.width)
-	   w = opt.client.width - x;
-   if ( y+h > opt.client.height)
-	   h = opt.client.height - y;
+   if ( x+w > fb_width)
+	   w = fb_width - x;
+   if ( y+h > fb_height)
+	   h = fb_height - y;
    
    src_pitch = w * opt.client.bpp/8; 
    
-   if(primary->Lock(primary, DSLF_WRITE, (void**)(&dst), &pitch) ==DFB_OK)
+   if(canvas->Lock(canvas, DSLF_WRITE, (void**)(&dst), &dst_pitch) ==DFB_OK)
    {
       int i;
-      dst += opt.v_offset * pitch;
-      dst += (y*pitch + ( (x+opt.h_offset) * opt.client.bpp/8) );
-      for (i=0;i<h;i++)
+      dst += opt.v_offset * dst_pitch;
+      if (opt.client.bpp == 8)
       {
-	 memcpy (dst, data, src_pitch);
-	 data += orig_src_pitch;
-	 dst += pitch ;
-      }	
-      primary->Unlock (primary);
+	 dst += (y*dst_pitch + ( (x+opt.h_offset) * 2) );
+	 for (i=0;i<h;i++)
+	 {
+	    _dfb_expand_row((CARD16 *)dst, data, w, 1);
+	    data += pitch;
+	    dst += dst_pitch ;
+	 }
+      }
+      else
+      {
+	 dst += (y*dst_pitch + ( (x+opt.h_offset) * opt.client.bpp/8) );
+	 for (i=0;i<h;i++)
+	 {
+	    memcpy (dst, data, src_pitch);
+	    data += pitch;
+	    dst += dst_pitch ;
+	 }	
+      }
+      canvas->Unlock (canvas);
    }
    dfb_flip_rect (x,y,w,h);
    return 1;
 }
 
-int   
+/*
+ * Writes a rect of server pixels to the screen. When scaling down, only
+ * every scale'th pixel of every scale'th row is shown.
+ */
+static int
+dfb_write_data_to_screen(int x, int y, int w, int h, void *data)
+{
+   char *dst, *src;
+   int pitch, src_pitch, bpp = opt.client.bpp/8;
+   int sx, sy, sw, sh, i, j;
+
+   if (opt.scale == 1)
+      return dfb_write_screen_data(x, y, w, h, w * bpp, data);
+
+   sx = SCALE_TO_SCREEN(x);
+   sy = SCALE_TO_SCREEN(y);
+   sw = SCALE_TO_SCREEN(x + w) - sx;
+   sh = SCALE_TO_SCREEN(y + h) - sy;
+
+   /* make sure we dont exceed client dimensions */
+   if (sx > fb_width  || sy > fb_height)
+	   return 1; 
+   if ( sx+sw > fb_width)
+	   sw = fb_width - sx;
+   if ( sy+sh > fb_height)
+	   sh = fb_height - sy;
+   if (sw <= 0 || sh <= 0)
+	   return 1;
+
+   src_pitch = w * bpp;
+   if(canvas->Lock(canvas, DSLF_WRITE, (void**)(&dst), &pitch) ==DFB_OK)
+   {
+      /* 8 bit pixels are 16 bit on the screen */
+      dst += (sy + opt.v_offset) * pitch
+	     + (sx + opt.h_offset) * (bpp == 1 ? 2 : bpp);
+      src = (char *)data + (sy * opt.scale - y) * src_pitch 
+	                 + (sx * opt.scale - x) * bpp;
+      for (i=0;i<sh;i++)
+      {
+	 switch (bpp)
+	 {
+	    case 1:
+	       _dfb_expand_row((CARD16 *)dst, (CARD8 *)src, sw, opt.scale);
+	       break;
+	    case 2:
+	       for (j=0;j<sw;j++)
+		  ((CARD16 *)dst)[j] = ((CARD16 *)src)[j * opt.scale];
+	       break;
+	    case 4:
+	       for (j=0;j<sw;j++)
+		  ((CARD32 *)dst)[j] = ((CARD32 *)src)[j * opt.scale];
+	       break;
+	 }
+	 src += src_pitch * opt.scale;
+	 dst += pitch;
+      }
+      canvas->Unlock (canvas);
+   }
+   dfb_flip_rect (sx,sy,sw,sh);
+   return 1;
+}
+
+static int
 dfb_copy_rect(int src_x, int src_y, int dest_x, int dest_y, int w, int h)
 {
+   /* scale to screen coordinates */
+   w = SCALE_TO_SCREEN(dest_x + w) - SCALE_TO_SCREEN(dest_x);
+   h = SCALE_TO_SCREEN(dest_y + h) - SCALE_TO_SCREEN(dest_y);
+   src_x = SCALE_TO_SCREEN(src_x);
+   src_y = SCALE_TO_SCREEN(src_y);
+   dest_x = SCALE_TO_SCREEN(dest_x);
+   dest_y = SCALE_TO_SCREEN(dest_y);
+
    /* make sure we dont exceed client dimensions */
-   if (   src_x > opt.client.width 
-       || src_y > opt.client.height
-       || dest_x > opt.client.width 
-       || dest_y > opt.client.height)
+   if (   src_x > fb_width 
+       || src_y > fb_height
+       || dest_x > fb_width 
+       || dest_y > fb_height)
 	   return 1; 
-   if ( src_x+w > opt.client.width)
-	   w = opt.client.width - src_x;
-   if ( src_y+h > opt.client.height)
-	   h = opt.client.height - src_y;
+   if ( src_x+w > fb_width)
+	   w = fb_width - src_x;
+   if ( src_y+h > fb_height)
+	   h = fb_height - src_y;
+   if (w <= 0 || h <= 0)
+	   return 1;
    
    scratch_rect.x = src_x+opt.h_offset;
    scratch_rect.y = src_y+opt.v_offset;
    scratch_rect.w = w;
    scratch_rect.h = h;
 
-   primary->Blit(primary, primary, &scratch_rect, 
+   canvas->Blit(canvas, canvas, &scratch_rect, 
 	         dest_x+opt.h_offset, dest_y+opt.v_offset);
-   dfb_flip_rect (src_x,src_y,w,h);
+   dfb_flip_rect (dest_x,dest_y,w,h);
    return 1;
 }
 
-int
+static int
 dfb_draw_rect_with_rgb(int x, int y, int w, int h, int r, int g, int b)
 {
+   /* scale to screen coordinates */
+   w = SCALE_TO_SCREEN(x + w) - SCALE_TO_SCREEN(x);
+   h = SCALE_TO_SCREEN(y + h) - SCALE_TO_SCREEN(y);
+   x = SCALE_TO_SCREEN(x);
+   y = SCALE_TO_SCREEN(y);
+
    /* make sure we dont exceed client dimensions */
-   if (x > opt.client.width  || y > opt.client.height)
+   if (x > fb_width  || y > fb_height)
 	   return 1; 
-   if ( x+w > opt.client.width)
-	   w = opt.client.width - x;
-   if ( y+h > opt.client.height)
-	   h = opt.client.height - y;
+   if ( x+w > fb_width)
+	   w = fb_width - x;
+   if ( y+h > fb_height)
+	   h = fb_height - y;
+   if (w <= 0 || h <= 0)
+	   return 1;
    
 
-   primary->SetColor(primary, r,g,b,0xFF);
-   primary->FillRectangle(primary, x+opt.h_offset,y+opt.v_offset,w,h);
+   canvas->SetColor(canvas, r,g,b,0xFF);
+   canvas->FillRectangle(canvas, x+opt.h_offset,y+opt.v_offset,w,h);
    dfb_flip_rect (x,y,w,h);
    return 1;
 }
 
 
-IDirectFBSurface *
+static void *
 dfb_create_cursor_saved_area(int width, int height)
 {
    IDirectFBSurface *surf;
@@ -204,28 +627,56 @@ dfb_create_cursor_saved_area(int width, int height)
    return surf;
 }
 
-void 
-dfb_restore_cursor_rect( IDirectFBSurface *surf, int x, int y, int w, int h)
+static void
+dfb_restore_cursor_rect(void *area, int x, int y, int w, int h)
 {
+   IDirectFBSurface *surf = area;
    int surf_w, surf_h;
+   w = SCALE_TO_SCREEN(x + w) - SCALE_TO_SCREEN(x);
+   h = SCALE_TO_SCREEN(y + h) - SCALE_TO_SCREEN(y);
+   x = SCALE_TO_SCREEN(x);
+   y = SCALE_TO_SCREEN(y);
    surf->GetSize(surf, &surf_w, &surf_h);
    scratch_rect.x = surf_w-w;
    scratch_rect.y = surf_h-h;
    scratch_rect.w = w;
    scratch_rect.h = h;
-   primary->Blit(primary, surf, &scratch_rect, x+opt.h_offset, y+opt.v_offset);
+   canvas->Blit(canvas, surf, &scratch_rect, x+opt.h_offset, y+opt.v_offset);
 }
 
-void 
-dfb_save_cursor_rect( IDirectFBSurface *surf, int x, int y, int w, int h)
+static void
+dfb_save_cursor_rect(void *area, int x, int y, int w, int h)
 {
+   IDirectFBSurface *surf = area;
    int surf_w, surf_h;
+   w = SCALE_TO_SCREEN(x + w) - SCALE_TO_SCREEN(x);
+   h = SCALE_TO_SCREEN(y + h) - SCALE_TO_SCREEN(y);
+   x = SCALE_TO_SCREEN(x);
+   y = SCALE_TO_SCREEN(y);
    scratch_rect.x = x + opt.h_offset;
    scratch_rect.y = y + opt.v_offset;
    scratch_rect.w = w;
    scratch_rect.h = h;
    surf->GetSize(surf, &surf_w, &surf_h);
-   surf->Blit(surf, primary, &scratch_rect, surf_w-w, surf_h -h);
+   surf->Blit(surf, canvas, &scratch_rect, surf_w-w, surf_h -h);
+}
+
+static void
+dfb_free_cursor_saved_area(void *area)
+{
+   IDirectFBSurface *surf = area;
+
+   if (surf)
+      surf->Release(surf);
+}
+
+/*
+ * Every drawing call above puts its rect on the screen right away, so there
+ * is nothing left to do at the end of an update.
+ */
+static void
+dfb_present(void)
+{
 }
 
 static KeySym
@@ -292,7 +743,68 @@ _dfb_handle_key_event(DFBInputEvent evt, int press_or_release)
    rfb_send_key_event(keysym, press_or_release); 	     
 }
 
-int
+/*
+ * Pans the viewport on behalf of the user and lets the server know which
+ * part of it we are interested in now.
+ */
+static void
+_dfb_pan(int dx, int dy)
+{
+   if (dfb_pan_viewport(dx, dy))
+      rfb_viewport_changed();
+}
+
+/*
+ * Ctrl-Alt-arrow pans the viewport by half a screen. Returns 1 if the key
+ * was taken for that and must not go to the server.
+ */
+static int
+_dfb_handle_pan_key(DFBInputEvent evt)
+{
+   int dx = 0, dy = 0;
+
+   if (!shadow || (evt.modifiers & (DIMM_CONTROL | DIMM_ALT)) != (DIMM_CONTROL | DIMM_ALT))
+      return 0;
+   switch (evt.key_id)
+   {
+      case DIKI_LEFT:
+	 dx = -view_w / 2;
+	 break;
+      case DIKI_RIGHT:
+	 dx = view_w / 2;
+	 break;
+      case DIKI_UP:
+	 dy = -view_h / 2;
+	 break;
+      case DIKI_DOWN:
+	 dy = view_h / 2;
+	 break;
+      default:
+	 return 0;
+   }
+   if (evt.type == DIET_KEYPRESS)
+      _dfb_pan(dx, dy);
+   return 1;
+}
+
+/*
+ * Sends the pointer position to the server if it has moved and the last
+ * pointer event is long enough ago, or right away if now is set.
+ */
+static void
+_dfb_send_pointer(int now)
+{
+   long t = adapt_now();
+
+   if (!now && (!motion_pending
+	    || t - motion_sent < opt.pointer_interval * 1000L))
+      return;
+   rfb_update_mouse();
+   motion_pending = 0;
+   motion_sent = t;
+}
+
+static int
 dfb_wait_for_event_with_timeout(int milliseconds)
 {
    return input_buffer->WaitForEventWithTimeout(input_buffer, 0, milliseconds);
@@ -305,8 +817,8 @@ dfb_wait_for_event()
 }
 
 
-int
-dfb_process_events()
+static int
+dfb_process_events(void)
 {
    DFBInputEvent evt;
 
@@ -337,13 +849,16 @@ dfb_process_events()
 		* luckily */
 	       rfb_send_key_event(XK_Control_L, 0); 	     
 	       rfb_send_key_event(XK_Control_R, 0); 	     
+	       flush_output_wait(sock);
 	       dfb_deinit();
 	       exit(1);
 	    }
-	    _dfb_handle_key_event(evt, 1);
+	    if (!_dfb_handle_pan_key(evt))
+	       _dfb_handle_key_event(evt, 1);
 	    break;
 	 case DIET_KEYRELEASE:
-	    _dfb_handle_key_event(evt, 0);
+	    if (!_dfb_handle_pan_key(evt))
+	       _dfb_handle_key_event(evt, 0);
 	    break;
 	 case DIET_AXISMOTION:
 	    if (evt.flags & DIEF_AXISREL)
@@ -359,7 +874,31 @@ dfb_process_events()
 		  default:
 		     break;
 	       }
-	       rfb_update_mouse();
+	       /* pushing against the edge of the screen scrolls the viewport */
+	       if (shadow)
+	       {
+		  int dx = 0, dy = 0;
+
+		  if (mousestate.x < 0)
+		     dx = mousestate.x;
+		  else if (mousestate.x > opt.client.width)
+		     dx = mousestate.x - opt.client.width;
+		  if (mousestate.y < 0)
+		     dy = mousestate.y;
+		  else if (mousestate.y > opt.client.height)
+		     dy = mousestate.y - opt.client.height;
+		  if (dx || dy)
+		     _dfb_pan(dx, dy);
+	       }
+	       /*
+		* events are sent rate limited, so clamp now: an overshoot left
+		* over would pan again with every following event
+		*/
+	       if (mousestate.x < 0) mousestate.x = 0;
+	       if (mousestate.y < 0) mousestate.y = 0;
+	       if (mousestate.x > opt.client.width) mousestate.x = opt.client.width;
+	       if (mousestate.y > opt.client.height) mousestate.y = opt.client.height;
+	       motion_pending = 1;
 	    }
 	    break;
 	 case DIET_BUTTONPRESS:
@@ -378,7 +917,7 @@ dfb_process_events()
 		  //fprintf(stdout, "Are we capturing the wheel here? %d\n", evt.button);
 		  break;
 	    }
-	    rfb_update_mouse();
+	    _dfb_send_pointer(1);
 	    break;
 	 case DIET_BUTTONRELEASE:
 	    switch (evt.button)
@@ -395,7 +934,7 @@ dfb_process_events()
 	       default:
 		  break;
 	    }
-	    rfb_update_mouse();
+	    _dfb_send_pointer(1);
 	    break;
    
 	 case DIET_UNKNOWN:  /* fallthrough */
@@ -404,10 +943,35 @@ dfb_process_events()
 	    break;
       }
    }
+   _dfb_send_pointer(0);
+   flush_output(sock);
    return 1;
    
 }
 
+struct display_backend dfb_display = {
+   "DirectFB",
+   dfb_init,
+   dfb_deinit,
+   dfb_set_server_size,
+   dfb_set_lut_entry,
+   dfb_write_data_to_screen,
+   dfb_write_screen_data,
+   dfb_draw_rect_with_rgb,
+   dfb_copy_rect,
+   dfb_lock_rect,
+   dfb_unlock_rect,
+   dfb_present,
+   dfb_create_cursor_saved_area,
+   dfb_save_cursor_rect,
+   dfb_restore_cursor_rect,
+   dfb_free_cursor_saved_area,
+   dfb_get_viewport,
+   dfb_screen_to_canvas,
+   dfb_process_events,
+   dfb_wait_for_event_with_timeout,
+};
+
 
 /*
    (c) Copyright 2002  Denis Oliver Kropp <dok@directfb.org>
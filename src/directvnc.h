@@ -36,15 +36,12 @@
 #include <directfb.h>
 
 
-/* Note that the CoRRE encoding uses this buffer and assumes it is big enough
-   to hold 255 * 255 * 32 bits -> 260100 bytes.  640*480 = 307200 bytes.
-   Hextile also assumes it is big enough to hold 16 * 16 * 32 bits.
-   Tight encoding assumes BUFFER_SIZE is at least 16384 bytes. */
+/* Smallest band buffer (see arena.h) the Tight and Zlib decoders work in.
+   Wide rects get a larger one, with room for TIGHT_BAND_ROWS rows. */
 
 #define BUFFER_SIZE (640*480) 
-char buffer[BUFFER_SIZE];
 
-#define MAX_ENCODINGS 10
+#define MAX_ENCODINGS 20
 
 #ifdef WORDS_BIGENDIAN
 #define Swap16IfLE(s) (s)
@@ -56,6 +53,11 @@ char buffer[BUFFER_SIZE];
  		       (((l) & 0x0000ff00) << 8)  | \
  		       (((l) & 0x000000ff) << 24))
 #endif /* WORDS_BIGENDIAN */
+
+/* for the pixel size templates (tightbpp.h, jpegbpp.h, rfbbpp.h), which are
+ * included once for every BPP */
+#define CONCAT2(a,b) a##b
+#define CONCAT2E(a,b) CONCAT2(a,b)
  
 struct _mousestate
 {
@@ -72,11 +74,22 @@ int sock;
 int rfb_connect_to_server (char *server, int display);
 int rfb_initialise_connection ();
 int rfb_set_format_and_encodings ();
+int rfb_send_encodings(char *encodings, int compresslevel, int quality);
 int rfb_send_update_request(int incremental);
+int rfb_send_update_request_rect(int x, int y, int w, int h, int incremental);
 int rfb_handle_server_message ();
+/* results of rfb_handle_server_message() besides 0 for errors */
+#define RFB_MESSAGE_DONE 1
+#define RFB_NEED_DATA 2
+/* results of the rect decoders besides 0 for errors: the rect is complete,
+ * or it is decoded in parts and more of it is to come */
+#define RECT_DONE 1
+#define RECT_MORE 2
 int rfb_update_mouse ();
 int rfb_send_key_event(int key, int down_flag);
-void rfb_get_rgb_from_data(int *r, int *g, int *b, char *data);
+int rfb_negotiate_scale(void);
+void rfb_viewport_changed(void);
+extern void (*rfb_get_rgb_from_data)(int *r, int *g, int *b, char *data);
 
 /* args.c */
 struct serversettings
@@ -129,6 +142,17 @@ struct __dfb_vnc_options
    int stretch;
    int localcursor;
    int poll_freq;
+   int jpeg_cache_size;  /* in KB, 0 disables the decoded JPEG cache */
+   int scale;            /* show the server at 1/scale of its size */
+   int server_scale;     /* the part of that done by the server */
+   int adaptive;         /* pick encodings by link and decoder speed */
+   int prefetch;         /* margin around the viewport we keep updated */
+   int pointer_interval; /* ms between pointer motion events */
+   int recv_buffer;      /* receive buffer size in KB */
+   int io_uring;         /* use the io_uring backend if available */
+   int headless;         /* draw into memory instead of on the console */
+   char *dump_file;      /* headless: PPM of every complete update */
+   char *record_file;    /* FBS file the session is recorded in */
    /* not really options, but hey ;) */
    double h_ratio;
    double v_ratio;
@@ -138,26 +162,66 @@ struct __dfb_vnc_options
 
 
 typedef struct __dfb_vnc_options dfb_vnc_options;
+
+/* server to screen coordinates. A screen pixel shows the server pixel at
+ * scale times its position. */
+#define SCALE_TO_SCREEN(v) (((v) + opt.scale - 1) / opt.scale)
+
 extern dfb_vnc_options opt;
 int args_parse(int argc, char **argv);
 
 /* sockets.c */
 int read_from_rfb_server(int sock, char *out, unsigned int n);
+char *peek_from_rfb_server(int sock, unsigned int n);
+void skip_from_rfb_server(unsigned int n);
+char *buffered_from_rfb_server(unsigned int n);
+int fill_from_rfb_server(int sock);
+int expect_from_rfb_server(unsigned int n);
+int wait_for_rfb_server(int sock, int milliseconds);
 int write_exact(int sock, char *buf, unsigned int n);
+int flush_output(int sock);
+int flush_output_wait(int sock);
 int set_non_blocking(int sock);
 
-/* dfb.c */
-void dfb_init(int argc, char *argv[]);
-void dfb_deinit();
-void fb_handle_error(DFBResult err);
-int dfb_write_data_to_screen(int x, int y, int w, int h, void *data);
-int dfb_process_events(void);
-int dfb_wait_for_event_with_timeout(int milliseconds);
-int dfb_copy_rect(int src_x, int src_y, int dest_x, int dest_y, int w, int h);
-int dfb_draw_rect_with_rgb(int x, int y, int w, int h, int r, int g, int b);
-IDirectFBSurface *dfb_create_cursor_saved_area(int width, int heigth);
-void dfb_save_cursor_rect( IDirectFBSurface *surf, int x, int y, int width, int heigth);
-void dfb_restore_cursor_rect( IDirectFBSurface *surf, int x, int y, int width, int heigth);
+/* Display backends: dfb.c draws on the console with DirectFB, headless.c
+ * into memory. Everything that draws goes through display, which main()
+ * points at the one picked on the command line. Positions and sizes are in
+ * server pixels unless noted. */
+struct display_backend
+{
+   char *name;
+   void (*init)(int argc, char *argv[]);
+   void (*deinit)(void);
+   /* the first size of the server framebuffer, or a new one */
+   void (*set_server_size)(int width, int height);
+   /* what 8 bit pixel value index looks like */
+   void (*set_lut_entry)(int index, int r, int g, int b);
+   /* a rect of server pixels, scaled down to the screen */
+   int (*write)(int x, int y, int w, int h, void *data);
+   /* a rect of screen pixels at screen position x, y, pitch bytes per row */
+   int (*write_screen)(int x, int y, int w, int h, int pitch, void *data);
+   int (*fill)(int x, int y, int w, int h, int r, int g, int b);
+   int (*copy)(int src_x, int src_y, int dest_x, int dest_y, int w, int h);
+   /* direct access to a rect, NULL if it has to go through write() */
+   char *(*lock)(int x, int y, int w, int h, int *pitch);
+   void (*unlock)(int x, int y, int w, int h);
+   /* a framebuffer update is complete */
+   void (*present)(void);
+   /* the area under the software cursor */
+   void *(*cursor_create)(int width, int height);
+   void (*cursor_save)(void *area, int x, int y, int w, int h);
+   void (*cursor_restore)(void *area, int x, int y, int w, int h);
+   void (*cursor_free)(void *area);
+   void (*get_viewport)(int *x, int *y, int *w, int *h);
+   /* screen position to shown framebuffer position, in screen pixels */
+   void (*screen_to_canvas)(int *x, int *y);
+   int (*process_events)(void);
+   int (*wait_for_event)(int milliseconds);
+};
+
+extern struct display_backend *display;
+extern struct display_backend dfb_display;
+extern struct display_backend headless_display;
 
 /* cursor.c */
 int HandleRichCursor(int x, int y, int w, int h);
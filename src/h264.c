@@ -0,0 +1,399 @@
+/*
+ * Copyright (C) 2001  Till Adam
+ * Authors: Till Adam <till@adam-lilienthal.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, a copy can be downloaded from
+ * http://www.gnu.org/licenses/gpl.html, or obtained by writing to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * h264.c - Open H.264 encoding support.
+ *
+ * The NAL data of every rect is handed to a decoder thread so the socket
+ * thread can go on reading the next rects while a frame is being decoded.
+ * Decoded frames are converted into the client pixel format by the decoder
+ * thread, but only written to the screen from the main thread in h264_sync(),
+ * which is called before any rect of another encoding and at the end of every
+ * framebuffer update. That keeps the order of screen writes intact.
+ */
+
+#include "config.h"
+#include "directvnc.h"
+#include "h264.h"
+#include "arena.h"
+
+#ifdef HAVE_LIBAVCODEC
+
+#include <pthread.h>
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+
+/* one decoder context per distinct rect, as the protocol demands */
+#define H264_MAX_CONTEXTS 8
+/* number of rects that may be in flight before the socket thread waits */
+#define H264_QUEUE_SIZE 8
+
+struct h264_context
+{
+   int x, y, w, h;
+   int last_used;
+   AVCodecContext *codec;
+   struct SwsContext *sws;
+};
+
+struct h264_job
+{
+   struct h264_context *ctx;
+   int x, y, w, h;
+   CARD8 *data;      /* arena memory, valid until the update ends */
+   int len;
+   int reset;        /* rfbH264ResetContext / rfbH264ResetAllContexts */
+   char *pixels;     /* arena memory for the decoded rect */
+   int ok;           /* set once a frame has been converted into pixels */
+};
+
+/* the decoder thread's packet and frame, kept from rect to rect */
+static AVPacket *packet;
+static AVFrame *frame;
+
+static struct h264_context contexts[H264_MAX_CONTEXTS];
+static int context_clock = 0;
+
+static struct h264_job queue[H264_QUEUE_SIZE];
+/* running counters, the queue slot is the counter modulo the queue size */
+static unsigned int queued = 0, decoded = 0, committed = 0;
+
+static pthread_t decoder_thread;
+static int decoder_started = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static enum AVPixelFormat
+_h264_pixel_format(void)
+{
+   switch (opt.client.bpp)
+   {
+      case 16:
+	 return AV_PIX_FMT_RGB565;
+      case 32:
+#ifdef WORDS_BIGENDIAN
+	 return AV_PIX_FMT_0RGB;
+#else
+	 return AV_PIX_FMT_BGR0;
+#endif
+   }
+   return AV_PIX_FMT_NONE;
+}
+
+static void
+_h264_close_context(struct h264_context *ctx)
+{
+   if (ctx->codec)
+      avcodec_free_context(&ctx->codec);
+   if (ctx->sws)
+      sws_freeContext(ctx->sws);
+   ctx->sws = NULL;
+}
+
+static int
+_h264_open_context(struct h264_context *ctx)
+{
+   const AVCodec *codec;
+
+   codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+   if (!codec)
+   {
+      fprintf(stderr, "H.264: no decoder available in libavcodec\n");
+      return 0;
+   }
+   ctx->codec = avcodec_alloc_context3(codec);
+   if (!ctx->codec)
+      return 0;
+   /* one thread per context, the parallelism is the decoder thread itself */
+   ctx->codec->thread_count = 1;
+   if (avcodec_open2(ctx->codec, codec, NULL) < 0)
+   {
+      fprintf(stderr, "H.264: could not open decoder\n");
+      avcodec_free_context(&ctx->codec);
+      return 0;
+   }
+   return 1;
+}
+
+/*
+ * Runs on the decoder thread. Feeds the NAL data of one rect to its context
+ * and converts the last frame that comes out into job->pixels.
+ */
+static void
+_h264_decode_job(struct h264_job *job)
+{
+   struct h264_context *ctx = job->ctx;
+   uint8_t *dst[4] = { NULL, NULL, NULL, NULL };
+   int dst_stride[4] = { 0, 0, 0, 0 };
+   int i, bpp = opt.client.bpp / 8;
+
+   if (job->reset & rfbH264ResetAllContexts)
+   {
+      for (i = 0; i < H264_MAX_CONTEXTS; i++)
+	 _h264_close_context(&contexts[i]);
+   }
+   else if (job->reset & rfbH264ResetContext)
+      _h264_close_context(ctx);
+
+   if (job->len == 0)
+      return;
+
+   if (!ctx->codec && !_h264_open_context(ctx))
+      return;
+
+   /* the packet only points at the arena, it owns nothing */
+   packet->data = job->data;
+   packet->size = job->len;
+   if (avcodec_send_packet(ctx->codec, packet) < 0)
+   {
+      fprintf(stderr, "H.264: error decoding frame\n");
+      return;
+   }
+
+   while (avcodec_receive_frame(ctx->codec, frame) == 0)
+   {
+      ctx->sws = sws_getCachedContext(ctx->sws,
+	    frame->width, frame->height, frame->format,
+	    job->w, job->h, _h264_pixel_format(),
+	    SWS_POINT, NULL, NULL, NULL);
+      if (!ctx->sws)
+	 break;
+      dst[0] = (uint8_t *)job->pixels;
+      dst_stride[0] = job->w * bpp;
+      sws_scale(ctx->sws, (const uint8_t * const *)frame->data,
+	    frame->linesize, 0, frame->height, dst, dst_stride);
+      job->ok = 1;
+   }
+   av_frame_unref(frame);
+}
+
+static void *
+_h264_thread(void *unused)
+{
+   struct h264_job *job;
+
+   pthread_mutex_lock(&queue_lock);
+   while (1)
+   {
+      while (decoded == queued)
+	 pthread_cond_wait(&work_cond, &queue_lock);
+      job = &queue[decoded % H264_QUEUE_SIZE];
+      pthread_mutex_unlock(&queue_lock);
+
+      _h264_decode_job(job);
+
+      pthread_mutex_lock(&queue_lock);
+      decoded++;
+      pthread_cond_signal(&done_cond);
+   }
+   return NULL;
+}
+
+/*
+ * Finds the context belonging to a rect, or takes over the least recently
+ * used one. *fresh is set if the context has to start over.
+ */
+static struct h264_context *
+_h264_find_context(int x, int y, int w, int h, int *fresh)
+{
+   struct h264_context *ctx = NULL;
+   int i;
+
+   *fresh = 0;
+   for (i = 0; i < H264_MAX_CONTEXTS; i++)
+   {
+      if (contexts[i].last_used && contexts[i].x == x && contexts[i].y == y
+	    && contexts[i].w == w && contexts[i].h == h)
+      {
+	 ctx = &contexts[i];
+	 break;
+      }
+      if (!ctx || contexts[i].last_used < ctx->last_used)
+	 ctx = &contexts[i];
+   }
+   if (i == H264_MAX_CONTEXTS)
+   {
+      ctx->x = x;
+      ctx->y = y;
+      ctx->w = w;
+      ctx->h = h;
+      *fresh = 1;
+   }
+   ctx->last_used = ++context_clock;
+   return ctx;
+}
+
+int
+h264_available(void)
+{
+   return _h264_pixel_format() != AV_PIX_FMT_NONE;
+}
+
+/*
+ * Waits for all queued rects to be decoded and writes them to the screen in
+ * the order they arrived.
+ */
+void
+h264_sync(void)
+{
+   struct h264_job *job;
+
+   if (committed == queued)
+      return;
+
+   pthread_mutex_lock(&queue_lock);
+   while (decoded != queued)
+      pthread_cond_wait(&done_cond, &queue_lock);
+   pthread_mutex_unlock(&queue_lock);
+
+   while (committed != queued)
+   {
+      job = &queue[committed % H264_QUEUE_SIZE];
+      if (job->ok)
+	 display->write(job->x, job->y, job->w, job->h, job->pixels);
+      job->pixels = NULL;
+      job->data = NULL;
+      committed++;
+   }
+}
+
+int
+h264_pending(void)
+{
+   return committed != queued;
+}
+
+int
+_handle_h264_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
+{
+   rfbH264Header hdr;
+   struct h264_job *job;
+   struct h264_context *ctx;
+   CARD8 *data;
+   int len, fresh;
+
+   if (!read_from_rfb_server(sock, (char *)&hdr, sz_rfbH264Header))
+      return 0;
+   len = Swap32IfLE(hdr.length);
+   hdr.flags = Swap32IfLE(hdr.flags);
+
+   /* libavcodec wants zeroed padding behind the input */
+   data = arena_alloc(len + AV_INPUT_BUFFER_PADDING_SIZE);
+   if (!data)
+      return 0;
+   if (!read_from_rfb_server(sock, (char *)data, len))
+      return 0;
+   memset(data + len, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+   if (!decoder_started)
+   {
+      packet = av_packet_alloc();
+      frame = av_frame_alloc();
+      if (!packet || !frame)
+      {
+	 fprintf(stderr, "H.264: out of memory\n");
+	 return 0;
+      }
+      if (pthread_create(&decoder_thread, NULL, _h264_thread, NULL))
+      {
+	 fprintf(stderr, "H.264: could not start decoder thread\n");
+	 return 0;
+      }
+      decoder_started = 1;
+   }
+
+   if (queued - committed == H264_QUEUE_SIZE)
+      h264_sync();
+
+   ctx = _h264_find_context(rectheader.r.x, rectheader.r.y,
+	 rectheader.r.w, rectheader.r.h, &fresh);
+
+   job = &queue[queued % H264_QUEUE_SIZE];
+   job->ctx = ctx;
+   job->x = rectheader.r.x;
+   job->y = rectheader.r.y;
+   job->w = rectheader.r.w;
+   job->h = rectheader.r.h;
+   job->data = data;
+   job->len = len;
+   job->reset = hdr.flags & (rfbH264ResetContext | rfbH264ResetAllContexts);
+   if (fresh)
+      job->reset |= rfbH264ResetContext;
+   /* the decoder thread converts straight into the arena, h264_sync() is
+    * done with the pixels before the arena is reset */
+   job->pixels = arena_alloc(rectheader.r.w * rectheader.r.h *
+	 (opt.client.bpp / 8));
+   if (!job->pixels)
+      return 0;
+   job->ok = 0;
+
+   pthread_mutex_lock(&queue_lock);
+   queued++;
+   pthread_cond_signal(&work_cond);
+   pthread_mutex_unlock(&queue_lock);
+
+   return 1;
+}
+
+#else /* HAVE_LIBAVCODEC */
+
+int
+h264_available(void)
+{
+   return 0;
+}
+
+void
+h264_sync(void)
+{
+}
+
+int
+h264_pending(void)
+{
+   return 0;
+}
+
+int
+_handle_h264_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
+{
+   rfbH264Header hdr;
+   char skip[1024];
+   int len, n;
+
+   /* We never ask for H.264 without libavcodec, but skip the data anyway so
+    * the connection stays usable. */
+   fprintf(stderr, "H.264 encoding received, but support is not compiled in.\n");
+   if (!read_from_rfb_server(sock, (char *)&hdr, sz_rfbH264Header))
+      return 0;
+   len = Swap32IfLE(hdr.length);
+   while (len > 0)
+   {
+      n = len > sizeof(skip) ? sizeof(skip) : len;
+      if (!read_from_rfb_server(sock, skip, n))
+	 return 0;
+      len -= n;
+   }
+   return 1;
+}
+
+#endif /* HAVE_LIBAVCODEC */
@@ -0,0 +1,471 @@
+/*
+ * Copyright (C) 2001  Till Adam
+ * Authors: Till Adam <till@adam-lilienthal.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, a copy can be downloaded from
+ * http://www.gnu.org/licenses/gpl.html, or obtained by writing to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * headless.c - display backend that draws into memory.
+ *
+ * The server framebuffer is kept in memory at screen scale, in the pixel
+ * formats the DirectFB backend puts on the screen: RGB16 for 8 and 16 bpp,
+ * with 8 bit pixels expanded through the LUT, and RGB32 for 32 bpp. There is
+ * no viewport, the screen is as large as the server. As nothing needs a
+ * console, the whole client with all its decoders runs on machines without a
+ * framebuffer. With --dump, the picture is written to a PPM file after every
+ * complete update and at the end.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "directvnc.h"
+
+static char *fb = NULL;
+static int fb_width = 0, fb_height = 0, fb_pitch = 0;
+static int pixel_size;                  /* bytes per pixel in fb */
+static CARD16 lut[256];
+
+/* a saved area under the cursor, the pixels follow */
+struct headless_area
+{
+   int width, height;
+};
+
+static void
+headless_set_lut_entry(int index, int r, int g, int b)
+{
+   lut[index] = ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3);
+}
+
+static void
+headless_init(int argc, char *argv[])
+{
+   int i, r, g, b;
+   char pixel;
+
+   pixel_size = opt.client.bpp == 32 ? 4 : 2;
+   /* true colour formats are known now, colour maps start out black */
+   if (opt.client.bpp == 8)
+   {
+      for (i = 0; i < 256; i++)
+      {
+	 pixel = i;
+	 rfb_get_rgb_from_data(&r, &g, &b, &pixel);
+	 headless_set_lut_entry(i, r, g, b);
+      }
+   }
+}
+
+/*
+ * Writes the framebuffer to opt.dump_file. It goes to a temporary file
+ * first, so whoever looks at the dump never sees half a picture.
+ */
+static void
+_headless_dump(void)
+{
+   char tmp[4096];
+   unsigned char rgb[3];
+   unsigned int p;
+   int x, y;
+   FILE *f;
+
+   if (!fb)
+      return;
+   snprintf(tmp, sizeof(tmp), "%s.tmp", opt.dump_file);
+   if (!(f = fopen(tmp, "wb")))
+   {
+      perror(tmp);
+      return;
+   }
+   fprintf(f, "P6\n%d %d\n255\n", fb_width, fb_height);
+   for (y = 0; y < fb_height; y++)
+   {
+      for (x = 0; x < fb_width; x++)
+      {
+	 if (pixel_size == 4)
+	 {
+	    p = ((CARD32 *)(fb + y * fb_pitch))[x];
+	    rgb[0] = p >> 16;
+	    rgb[1] = p >> 8;
+	    rgb[2] = p;
+	 }
+	 else
+	 {
+	    p = ((CARD16 *)(fb + y * fb_pitch))[x];
+	    rgb[0] = (p >> 8 & 0xF8) | (p >> 13);
+	    rgb[1] = (p >> 3 & 0xFC) | (p >> 9 & 0x03);
+	    rgb[2] = (p << 3 & 0xF8) | (p >> 2 & 0x07);
+	 }
+	 fwrite(rgb, 1, 3, f);
+      }
+   }
+   if (fclose(f) != 0 || rename(tmp, opt.dump_file) != 0)
+      perror(opt.dump_file);
+}
+
+static void
+headless_deinit(void)
+{
+   if (opt.dump_file)
+      _headless_dump();
+   free(fb);
+   fb = NULL;
+}
+
+/*
+ * Sets the size of the server framebuffer. The part of the old picture that
+ * is still inside it is kept, the rest is black.
+ */
+static void
+headless_set_server_size(int width, int height)
+{
+   int sw = SCALE_TO_SCREEN(width), sh = SCALE_TO_SCREEN(height);
+   int keep_w, keep_h, y;
+   char *new_fb;
+
+   new_fb = calloc(sw * sh + 1, pixel_size);
+   if (!new_fb)
+   {
+      fprintf(stderr, "Memory allocation error.\n");
+      exit(-1);
+   }
+   keep_w = sw < fb_width ? sw : fb_width;
+   keep_h = sh < fb_height ? sh : fb_height;
+   for (y = 0; y < keep_h; y++)
+      memcpy(new_fb + y * sw * pixel_size, fb + y * fb_pitch,
+	    keep_w * pixel_size);
+   free(fb);
+
+   fb = new_fb;
+   fb_width = sw;
+   fb_height = sh;
+   fb_pitch = sw * pixel_size;
+   opt.server.width = width;
+   opt.server.height = height;
+   opt.client.width = sw;
+   opt.client.height = sh;
+   opt.h_offset = 0;
+   opt.v_offset = 0;
+}
+
+/*
+ * Cuts the rect x, y, w, h down to the part inside the framebuffer. Returns
+ * 0 if nothing is left of it.
+ */
+static int
+_headless_clip(int *x, int *y, int *w, int *h)
+{
+   if (*x < 0 || *y < 0 || *x >= fb_width || *y >= fb_height)
+      return 0;
+   if (*x + *w > fb_width)
+      *w = fb_width - *x;
+   if (*y + *h > fb_height)
+      *h = fb_height - *y;
+   return *w > 0 && *h > 0;
+}
+
+static char *
+headless_lock_rect(int x, int y, int w, int h, int *pitch)
+{
+   if (opt.scale != 1 || opt.client.bpp == 8
+	 || x < 0 || y < 0 || x + w > fb_width || y + h > fb_height)
+      return NULL;
+   *pitch = fb_pitch;
+   return fb + y * fb_pitch + x * pixel_size;
+}
+
+static void
+headless_unlock_rect(int x, int y, int w, int h)
+{
+}
+
+static int
+headless_write_screen_data(int x, int y, int w, int h, int pitch, void *data)
+{
+   char *dst, *src = data;
+   int i, j;
+
+   if (!_headless_clip(&x, &y, &w, &h))
+      return 1;
+   dst = fb + y * fb_pitch + x * pixel_size;
+   for (i = 0; i < h; i++)
+   {
+      if (opt.client.bpp == 8)
+	 for (j = 0; j < w; j++)
+	    ((CARD16 *)dst)[j] = lut[((CARD8 *)src)[j]];
+      else
+	 memcpy(dst, src, w * pixel_size);
+      src += pitch;
+      dst += fb_pitch;
+   }
+   return 1;
+}
+
+/*
+ * Writes a rect of server pixels. When scaling down, only every scale'th
+ * pixel of every scale'th row is kept, as on the console.
+ */
+static int
+headless_write_data_to_screen(int x, int y, int w, int h, void *data)
+{
+   char *dst, *src;
+   int bpp = opt.client.bpp / 8, src_pitch = w * bpp;
+   int sx, sy, sw, sh, i, j;
+
+   if (opt.scale == 1)
+      return headless_write_screen_data(x, y, w, h, src_pitch, data);
+
+   sx = SCALE_TO_SCREEN(x);
+   sy = SCALE_TO_SCREEN(y);
+   sw = SCALE_TO_SCREEN(x + w) - sx;
+   sh = SCALE_TO_SCREEN(y + h) - sy;
+   if (!_headless_clip(&sx, &sy, &sw, &sh))
+      return 1;
+
+   dst = fb + sy * fb_pitch + sx * pixel_size;
+   src = (char *)data + (sy * opt.scale - y) * src_pitch
+		      + (sx * opt.scale - x) * bpp;
+   for (i = 0; i < sh; i++)
+   {
+      for (j = 0; j < sw; j++)
+      {
+	 switch (bpp)
+	 {
+	    case 1:
+	       ((CARD16 *)dst)[j] = lut[((CARD8 *)src)[j * opt.scale]];
+	       break;
+	    case 2:
+	       ((CARD16 *)dst)[j] = ((CARD16 *)src)[j * opt.scale];
+	       break;
+	    case 4:
+	       ((CARD32 *)dst)[j] = ((CARD32 *)src)[j * opt.scale];
+	       break;
+	 }
+      }
+      src += src_pitch * opt.scale;
+      dst += fb_pitch;
+   }
+   return 1;
+}
+
+static int
+headless_draw_rect_with_rgb(int x, int y, int w, int h, int r, int g, int b)
+{
+   CARD32 pixel;
+   char *dst;
+   int i, j;
+
+   /* scale to screen coordinates */
+   w = SCALE_TO_SCREEN(x + w) - SCALE_TO_SCREEN(x);
+   h = SCALE_TO_SCREEN(y + h) - SCALE_TO_SCREEN(y);
+   x = SCALE_TO_SCREEN(x);
+   y = SCALE_TO_SCREEN(y);
+   if (!_headless_clip(&x, &y, &w, &h))
+      return 1;
+
+   if (pixel_size == 4)
+      pixel = (r & 0xFF) << 16 | (g & 0xFF) << 8 | (b & 0xFF);
+   else
+      pixel = ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | ((b & 0xFF) >> 3);
+
+   dst = fb + y * fb_pitch + x * pixel_size;
+   for (i = 0; i < h; i++)
+   {
+      if (pixel_size == 4)
+	 for (j = 0; j < w; j++)
+	    ((CARD32 *)dst)[j] = pixel;
+      else
+	 for (j = 0; j < w; j++)
+	    ((CARD16 *)dst)[j] = pixel;
+      dst += fb_pitch;
+   }
+   return 1;
+}
+
+static int
+headless_copy_rect(int src_x, int src_y, int dest_x, int dest_y, int w, int h)
+{
+   char *src, *dst;
+   int i, step;
+
+   /* scale to screen coordinates */
+   w = SCALE_TO_SCREEN(dest_x + w) - SCALE_TO_SCREEN(dest_x);
+   h = SCALE_TO_SCREEN(dest_y + h) - SCALE_TO_SCREEN(dest_y);
+   src_x = SCALE_TO_SCREEN(src_x);
+   src_y = SCALE_TO_SCREEN(src_y);
+   dest_x = SCALE_TO_SCREEN(dest_x);
+   dest_y = SCALE_TO_SCREEN(dest_y);
+
+   if (!_headless_clip(&src_x, &src_y, &w, &h)
+	 || !_headless_clip(&dest_x, &dest_y, &w, &h))
+      return 1;
+
+   /* the rects may overlap, go bottom up when moving down */
+   src = fb + src_y * fb_pitch + src_x * pixel_size;
+   dst = fb + dest_y * fb_pitch + dest_x * pixel_size;
+   step = fb_pitch;
+   if (dest_y > src_y)
+   {
+      src += (h - 1) * fb_pitch;
+      dst += (h - 1) * fb_pitch;
+      step = -fb_pitch;
+   }
+   for (i = 0; i < h; i++)
+   {
+      memmove(dst, src, w * pixel_size);
+      src += step;
+      dst += step;
+   }
+   return 1;
+}
+
+static void
+headless_present(void)
+{
+   if (opt.dump_file)
+      _headless_dump();
+}
+
+static void *
+headless_create_cursor_saved_area(int width, int height)
+{
+   struct headless_area *area;
+
+   area = malloc(sizeof(*area) + width * height * pixel_size);
+   if (!area)
+      return NULL;
+   area->width = width;
+   area->height = height;
+   return area;
+}
+
+/*
+ * Copies the rect x, y, w, h between the framebuffer and a saved area, in
+ * the direction of save.
+ */
+static void
+_headless_cursor_copy(struct headless_area *area, int x, int y, int w, int h,
+      int save)
+{
+   char *pixels = (char *)(area + 1), *screen;
+   int i;
+
+   w = SCALE_TO_SCREEN(x + w) - SCALE_TO_SCREEN(x);
+   h = SCALE_TO_SCREEN(y + h) - SCALE_TO_SCREEN(y);
+   x = SCALE_TO_SCREEN(x);
+   y = SCALE_TO_SCREEN(y);
+   if (w > area->width)
+      w = area->width;
+   if (h > area->height)
+      h = area->height;
+   if (!_headless_clip(&x, &y, &w, &h))
+      return;
+
+   screen = fb + y * fb_pitch + x * pixel_size;
+   for (i = 0; i < h; i++)
+   {
+      if (save)
+	 memcpy(pixels, screen, w * pixel_size);
+      else
+	 memcpy(screen, pixels, w * pixel_size);
+      pixels += area->width * pixel_size;
+      screen += fb_pitch;
+   }
+}
+
+static void
+headless_save_cursor_rect(void *area, int x, int y, int w, int h)
+{
+   _headless_cursor_copy(area, x, y, w, h, 1);
+}
+
+static void
+headless_restore_cursor_rect(void *area, int x, int y, int w, int h)
+{
+   _headless_cursor_copy(area, x, y, w, h, 0);
+}
+
+static void
+headless_free_cursor_saved_area(void *area)
+{
+   free(area);
+}
+
+/* the whole server is shown */
+static void
+headless_get_viewport(int *x, int *y, int *w, int *h)
+{
+   *x = 0;
+   *y = 0;
+   *w = opt.server.width;
+   *h = opt.server.height;
+}
+
+static void
+headless_screen_to_canvas(int *x, int *y)
+{
+   if (*x >= fb_width)
+      *x = fb_width - 1;
+   if (*y >= fb_height)
+      *y = fb_height - 1;
+   if (*x < 0)
+      *x = 0;
+   if (*y < 0)
+      *y = 0;
+}
+
+/* there is no input, only output to get out */
+static int
+headless_process_events(void)
+{
+   flush_output(sock);
+   return 1;
+}
+
+/*
+ * Nobody is at the keyboard, so instead of waiting for input this waits
+ * for the server, which gets the next update in as soon as it is sent.
+ */
+static int
+headless_wait_for_event_with_timeout(int milliseconds)
+{
+   return wait_for_rfb_server(sock, milliseconds);
+}
+
+struct display_backend headless_display = {
+   "headless",
+   headless_init,
+   headless_deinit,
+   headless_set_server_size,
+   headless_set_lut_entry,
+   headless_write_data_to_screen,
+   headless_write_screen_data,
+   headless_draw_rect_with_rgb,
+   headless_copy_rect,
+   headless_lock_rect,
+   headless_unlock_rect,
+   headless_present,
+   headless_create_cursor_saved_area,
+   headless_save_cursor_rect,
+   headless_restore_cursor_rect,
+   headless_free_cursor_saved_area,
+   headless_get_viewport,
+   headless_screen_to_canvas,
+   headless_process_events,
+   headless_wait_for_event_with_timeout,
+};
@@ -20,27 +20,31 @@
  *  Boston, MA 02110-1301, USA.
  */
 
+#include <pthread.h>
+#include <setjmp.h>
 #include "jpeg.h"
+#include "arena.h"
+
 /*
  * JPEG source manager functions for JPEG decompression in Tight decoder.
+ * All state lives in the struct jpeg_source behind cinfo->src, so several
+ * rects can be decompressed at the same time.
  */
-static int jpegError;
-static struct jpeg_source_mgr jpegSrcManager;
-static JOCTET *jpegBufferPtr;
-static size_t jpegBufferLen;
 
 void
 JpegInitSource(j_decompress_ptr cinfo)
 {
-  jpegError = 0;
+  ((struct jpeg_source *)cinfo->src)->error = 0;
 }
 
 int
 JpegFillInputBuffer(j_decompress_ptr cinfo)
 {
-  jpegError = 1;
-  jpegSrcManager.bytes_in_buffer = (size_t)jpegBufferLen;
-  jpegSrcManager.next_input_byte = (JOCTET *)jpegBufferPtr;
+  struct jpeg_source *src = (struct jpeg_source *)cinfo->src;
+
+  src->error = 1;
+  src->pub.bytes_in_buffer = src->len;
+  src->pub.next_input_byte = src->data;
 
   return TRUE;
 }
@@ -48,13 +52,15 @@ JpegFillInputBuffer(j_decompress_ptr cinfo)
 void
 JpegSkipInputData(j_decompress_ptr cinfo, long num_bytes)
 {
-  if (num_bytes < 0 || num_bytes > jpegSrcManager.bytes_in_buffer) {
-    jpegError = 1;
-    jpegSrcManager.bytes_in_buffer = (size_t)jpegBufferLen;
-    jpegSrcManager.next_input_byte = (JOCTET *)jpegBufferPtr;
+  struct jpeg_source *src = (struct jpeg_source *)cinfo->src;
+
+  if (num_bytes < 0 || num_bytes > src->pub.bytes_in_buffer) {
+    src->error = 1;
+    src->pub.bytes_in_buffer = src->len;
+    src->pub.next_input_byte = src->data;
   } else {
-    jpegSrcManager.next_input_byte += (size_t) num_bytes;
-    jpegSrcManager.bytes_in_buffer -= (size_t) num_bytes;
+    src->pub.next_input_byte += (size_t) num_bytes;
+    src->pub.bytes_in_buffer -= (size_t) num_bytes;
   }
 }
 
@@ -65,21 +71,22 @@ JpegTermSource(j_decompress_ptr cinfo)
 }
 
 void
-JpegSetSrcManager(j_decompress_ptr cinfo, CARD8 *compressedData,
-		  int compressedLen)
+JpegSetSrcManager(j_decompress_ptr cinfo, struct jpeg_source *src,
+		  CARD8 *compressedData, int compressedLen)
 {
-  jpegBufferPtr = (JOCTET *)compressedData;
-  jpegBufferLen = (size_t)compressedLen;
+  src->data = (JOCTET *)compressedData;
+  src->len = (size_t)compressedLen;
+  src->error = 0;
 
-  jpegSrcManager.init_source = JpegInitSource;
-  jpegSrcManager.fill_input_buffer = JpegFillInputBuffer;
-  jpegSrcManager.skip_input_data = JpegSkipInputData;
-  jpegSrcManager.resync_to_restart = jpeg_resync_to_restart;
-  jpegSrcManager.term_source = JpegTermSource;
-  jpegSrcManager.next_input_byte = jpegBufferPtr;
-  jpegSrcManager.bytes_in_buffer = jpegBufferLen;
+  src->pub.init_source = JpegInitSource;
+  src->pub.fill_input_buffer = JpegFillInputBuffer;
+  src->pub.skip_input_data = JpegSkipInputData;
+  src->pub.resync_to_restart = jpeg_resync_to_restart;
+  src->pub.term_source = JpegTermSource;
+  src->pub.next_input_byte = src->data;
+  src->pub.bytes_in_buffer = src->len;
 
-  cinfo->src = &jpegSrcManager;
+  cinfo->src = &src->pub;
 }
 
 
@@ -92,13 +99,8 @@ JpegSetSrcManager(j_decompress_ptr cinfo, CARD8 *compressedData,
 int
 DecompressJpegRect(int x, int y, int w, int h)
 {
-  struct jpeg_decompress_struct cinfo;
-  struct jpeg_error_mgr jerr;
   int compressedLen;
   CARD8 *compressedData;
-  CARD16 *pixelPtr;
-  JSAMPROW rowPointer[1];
-  int dx, dy;
 
   compressedLen = (int)ReadCompactLen();
   if (compressedLen <= 0) {
@@ -106,82 +108,754 @@ DecompressJpegRect(int x, int y, int w, int h)
     return 0;
   }
 
-  compressedData = malloc(compressedLen);
-  if (compressedData == NULL) {
-    fprintf(stderr, "Memory allocation error.\n");
+  compressedData = arena_alloc(compressedLen);
+  if (compressedData == NULL)
+    return 0;
+
+  if (!read_from_rfb_server(sock, (char*)compressedData, compressedLen))
+    return 0;
+
+  return JpegQueueRect(x, y, w, h, compressedData, compressedLen);
+}
+
+/*----------------------------------------------------------------------------
+ *
+ * Decoded JPEG cache. Servers keep resending identical JPEG rects (animated
+ * banners, video players repainting a still image), so the decoded pixels of
+ * recently seen payloads are kept and blitted again instead of running
+ * libjpeg. Entries are found by a hash of the payload and the size it was
+ * decoded to, which changes with the scale, and the payload itself is
+ * compared to rule out collisions.
+ *
+ */
+
+/* An entry is a single allocation, the pixels and the payload follow it. */
+struct jpeg_cache_entry
+{
+  struct jpeg_cache_entry *prev, *next;	/* LRU list, most recent first */
+  struct jpeg_cache_entry *hashNext;
+  CARD32 hash;
+  int outW, outH, len;		/* outW * outH pixels, len bytes of payload */
+  long size;			/* bytes allocated for this entry */
+  CARD8 *data;			/* the compressed payload */
+  char *pixels;			/* decoded rect in client pixel format */
+};
+
+#define JPEG_CACHE_BUCKETS 256
+
+static struct jpeg_cache_entry *jpegCacheTable[JPEG_CACHE_BUCKETS];
+static struct jpeg_cache_entry *jpegCacheHead = NULL;
+static struct jpeg_cache_entry *jpegCacheTail = NULL;
+static long jpegCacheBytes = 0;
+static unsigned long jpegCacheHits = 0;
+static unsigned long jpegCacheMisses = 0;
+static unsigned long jpegCacheEvictions = 0;
+static int jpegCacheReportSet = 0;
+
+static CARD32
+JpegCacheHash(CARD8 *data, int len, int outW, int outH)
+{
+  /* FNV-1a */
+  CARD32 hash = 2166136261U;
+  int i;
+
+  for (i = 0; i < len; i++) {
+    hash ^= data[i];
+    hash *= 16777619U;
+  }
+  hash ^= (CARD32)outW << 16 | (CARD32)outH;
+  hash *= 16777619U;
+  return hash;
+}
+
+static void
+JpegCacheUnlinkLRU(struct jpeg_cache_entry *e)
+{
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    jpegCacheHead = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    jpegCacheTail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void
+JpegCachePushFront(struct jpeg_cache_entry *e)
+{
+  e->prev = NULL;
+  e->next = jpegCacheHead;
+  if (jpegCacheHead)
+    jpegCacheHead->prev = e;
+  jpegCacheHead = e;
+  if (!jpegCacheTail)
+    jpegCacheTail = e;
+}
+
+/* Takes e out of the cache, the caller frees or reuses it. */
+static void
+JpegCacheEvict(struct jpeg_cache_entry *e)
+{
+  struct jpeg_cache_entry **p;
+
+  JpegCacheUnlinkLRU(e);
+  for (p = &jpegCacheTable[e->hash % JPEG_CACHE_BUCKETS]; *p; p = &(*p)->hashNext) {
+    if (*p == e) {
+      *p = e->hashNext;
+      break;
+    }
+  }
+  jpegCacheBytes -= e->size;
+  jpegCacheEvictions++;
+}
+
+static struct jpeg_cache_entry *
+JpegCacheLookup(CARD32 hash, int outW, int outH, CARD8 *data, int len)
+{
+  struct jpeg_cache_entry *e;
+
+  for (e = jpegCacheTable[hash % JPEG_CACHE_BUCKETS]; e; e = e->hashNext) {
+    if (e->hash == hash && e->outW == outW && e->outH == outH &&
+	e->len == len && !memcmp(e->data, data, len)) {
+      JpegCacheUnlinkLRU(e);
+      JpegCachePushFront(e);
+      return e;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * The payload and the pixels are copied, the job's are arena memory. Once
+ * the cache is full, the first entry evicted makes room for the new one, so
+ * a cache that keeps seeing rects of similar sizes does not allocate.
+ */
+static void
+JpegCacheInsert(CARD32 hash, int outW, int outH, CARD8 *data, int len,
+		char *pixels, long pixelsSize)
+{
+  struct jpeg_cache_entry *e = NULL, *old;
+  long size;
+
+  size = sizeof(*e) + pixelsSize + len;
+  while (jpegCacheTail && jpegCacheBytes + size > opt.jpeg_cache_size * 1024L) {
+    old = jpegCacheTail;
+    JpegCacheEvict(old);
+    if (e == NULL)
+      e = old;
+    else
+      free(old);
+  }
+
+  /* reuse it unless it is too small or would waste more than half */
+  if (e == NULL || e->size < size || e->size > 2 * size) {
+    old = e;
+    e = realloc(e, size);
+    if (e == NULL) {
+      free(old);
+      return;
+    }
+    e->size = size;
+  }
+  /* a reused entry may be larger than asked for */
+  while (jpegCacheTail && jpegCacheBytes + e->size > opt.jpeg_cache_size * 1024L) {
+    old = jpegCacheTail;
+    JpegCacheEvict(old);
+    free(old);
+  }
+  e->pixels = (char *)(e + 1);
+  e->data = (CARD8 *)e->pixels + pixelsSize;
+  memcpy(e->data, data, len);
+  memcpy(e->pixels, pixels, pixelsSize);
+  e->hash = hash;
+  e->outW = outW;
+  e->outH = outH;
+  e->len = len;
+  e->hashNext = jpegCacheTable[hash % JPEG_CACHE_BUCKETS];
+  jpegCacheTable[hash % JPEG_CACHE_BUCKETS] = e;
+  JpegCachePushFront(e);
+  jpegCacheBytes += e->size;
+}
+
+static void
+JpegCacheReport(void)
+{
+  unsigned long lookups = jpegCacheHits + jpegCacheMisses;
+
+  if (!lookups)
+    return;
+  fprintf(stderr, "JPEG cache: %lu hits, %lu misses (%.1f%% hit rate), "
+	  "%lu evictions, %ld of %d KB used\n",
+	  jpegCacheHits, jpegCacheMisses, 100.0 * jpegCacheHits / lookups,
+	  jpegCacheEvictions, jpegCacheBytes / 1024, opt.jpeg_cache_size);
+}
+
+/*
+ * Puts rows first..first+rows-1 of a decoded rect on the screen. When scaling
+ * down, libjpeg has already decoded the rect at screen size (outW pixels per
+ * row), so it is written without scaling it again.
+ */
+static void
+JpegPutRows(int x, int y, int w, int h, int outW, int first, int rows,
+	    char *data)
+{
+  int sx, sy, sw, sh;
+
+  if (opt.scale == 1) {
+    display->write(x, y + first, w, rows, data);
+    return;
+  }
+
+  sx = SCALE_TO_SCREEN(x);
+  sy = SCALE_TO_SCREEN(y);
+  sw = SCALE_TO_SCREEN(x + w) - sx;
+  sh = SCALE_TO_SCREEN(y + h) - sy;
+  if (first + rows > sh)
+    rows = sh - first;
+  if (sw > 0 && rows > 0)
+    display->write_screen(sx, sy + first, sw, rows,
+			  outW * (opt.client.bpp / 8), data);
+}
+
+/*----------------------------------------------------------------------------
+ *
+ * Parallel decoding. JPEG rects share no decoder state, so the rects of an
+ * update are handed to a pool of worker threads while the socket thread goes
+ * on reading. Decoded rects are put on the screen by the socket thread in
+ * JpegSync(), in the order they arrived, before anything else is drawn.
+ *
+ */
+
+#define JPEG_MAX_WORKERS 8
+#define JPEG_QUEUE_SIZE 64
+
+struct jpeg_job
+{
+  int x, y, w, h;
+  int outW, outH;
+  CARD8 *data;			/* the compressed payload, owned by the job */
+  int len;
+  CARD32 hash;
+  int cache;			/* insert into the cache when committed */
+  char *pixels;			/* outW * outH decoded pixels */
+  long pixelsSize;
+  int done;
+  int ok;
+};
+
+static struct jpeg_job jpegQueue[JPEG_QUEUE_SIZE];
+/* running counters, the queue slot is the counter modulo the queue size */
+static unsigned int jpegQueued = 0, jpegTaken = 0, jpegFinished = 0;
+static unsigned int jpegCommitted = 0;
+
+static int jpegWorkers = -1;
+static pthread_t jpegThreads[JPEG_MAX_WORKERS];
+static pthread_mutex_t jpegQueueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jpegWorkCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t jpegDoneCond = PTHREAD_COND_INITIALIZER;
+
+#define BPP 8
+#include "jpegbpp.h"
+#undef BPP
+#define BPP 16
+#include "jpegbpp.h"
+#undef BPP
+#define BPP 32
+#include "jpegbpp.h"
+#undef BPP
+
+/*
+ * libjpeg's own error_exit calls exit(), which would take the whole client
+ * down from a worker thread over one corrupt rect. Ours prints the message
+ * and jumps back into JpegDecode(), which fails just that rect.
+ */
+struct jpeg_error
+{
+  struct jpeg_error_mgr pub;
+  jmp_buf jump;
+};
+
+static void
+JpegErrorExit(j_common_ptr cinfo)
+{
+  struct jpeg_error *err = (struct jpeg_error *)cinfo->err;
+
+  (*err->pub.output_message)(cinfo);
+  longjmp(err->jump, 1);
+}
+
+/*
+ * What a thread decodes with. The decompressor and the scanline it decodes
+ * into are kept from rect to rect, the scanline only grows.
+ */
+struct jpeg_decoder
+{
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error jerr;
+  struct jpeg_source src;
+  int created;
+  JSAMPLE *row;
+  int rowSize;
+};
+
+/* the socket thread's, when there are no workers */
+static struct jpeg_decoder jpegMainDecoder;
+
+/* converts a decoded scanline, see SelectJpegDecoders() */
+static void (*jpegConvertRow)(JSAMPLE *row, int w, char *dst);
+
+int
+SelectJpegDecoders(void)
+{
+  switch (opt.client.bpp) {
+  case 8:
+    jpegConvertRow = JpegConvertRow8;
+    return 1;
+  case 16:
+    jpegConvertRow = JpegConvertRow16;
+    return 1;
+  case 32:
+    jpegConvertRow = JpegConvertRow32;
+    return 1;
+  }
+  fprintf(stderr, "JPEG: %d bpp is not supported.\n", opt.client.bpp);
+  return 0;
+}
+
+/*
+ * Decodes a complete JPEG image into pixels, outW * outH in the client pixel
+ * format. When showing the server scaled down, libjpeg scales in the DCT
+ * domain, which saves most of the IDCT and colour conversion work. Safe to
+ * call from any thread, each with its own decoder.
+ */
+static int
+JpegDecode(struct jpeg_decoder *dec, CARD8 *compressedData, int compressedLen,
+	   int outW, int outH, char *pixels)
+{
+  j_decompress_ptr cinfo = &dec->cinfo;
+  JSAMPLE *row;
+  JSAMPROW rowPointer[1];
+  int pitch = outW * (opt.client.bpp / 8);
+
+  if (outW * 3 > dec->rowSize) {
+    row = realloc(dec->row, outW * 3);
+    if (row == NULL) {
+      fprintf(stderr, "Memory allocation error.\n");
+      return 0;
+    }
+    dec->row = row;
+    dec->rowSize = outW * 3;
+  }
+
+  if (setjmp(dec->jerr.jump)) {
+    /* the decompressor is ready for the next image again */
+    if (dec->created)
+      jpeg_abort_decompress(cinfo);
     return 0;
   }
 
-  if (!read_from_rfb_server(sock, (char*)compressedData, compressedLen)) {
-    free(compressedData);
+  if (!dec->created) {
+    cinfo->err = jpeg_std_error(&dec->jerr.pub);
+    dec->jerr.pub.error_exit = JpegErrorExit;
+    jpeg_create_decompress(cinfo);
+    dec->created = 1;
+  }
+
+  JpegSetSrcManager(cinfo, &dec->src, compressedData, compressedLen);
+
+  jpeg_read_header(cinfo, TRUE);
+  cinfo->out_color_space = JCS_RGB;
+  cinfo->scale_num = 1;
+  cinfo->scale_denom = opt.scale;
+
+  jpeg_start_decompress(cinfo);
+  if (cinfo->output_width != outW || cinfo->output_height != outH ||
+      cinfo->output_components != 3) { 
+    fprintf(stderr, "Wrong JPEG data received.\n");
+    jpeg_abort_decompress(cinfo);
     return 0;
   }
 
-  cinfo.err = jpeg_std_error(&jerr);
-  jpeg_create_decompress(&cinfo);
+  rowPointer[0] = dec->row;
+  while (cinfo->output_scanline < cinfo->output_height) {
+    jpeg_read_scanlines(cinfo, rowPointer, 1);
+    if (dec->src.error) {
+      break;
+    }
+    jpegConvertRow(dec->row, outW, pixels);
+    pixels += pitch;
+  }
+
+  /* either way the decompressor is ready for the next image */
+  if (!dec->src.error)
+    jpeg_finish_decompress(cinfo);
+  else
+    jpeg_abort_decompress(cinfo);
+
+  return !dec->src.error;
+}
+
+static void *
+JpegWorker(void *unused)
+{
+  struct jpeg_job *job;
+  struct jpeg_decoder dec;
+
+  memset(&dec, 0, sizeof(dec));
+
+  pthread_mutex_lock(&jpegQueueLock);
+  while (1) {
+    while (jpegTaken == jpegQueued)
+      pthread_cond_wait(&jpegWorkCond, &jpegQueueLock);
+    job = &jpegQueue[jpegTaken++ % JPEG_QUEUE_SIZE];
+    pthread_mutex_unlock(&jpegQueueLock);
+
+    if (!job->done)
+      job->ok = JpegDecode(&dec, job->data, job->len, job->outW, job->outH,
+			   job->pixels);
+
+    pthread_mutex_lock(&jpegQueueLock);
+    job->done = 1;
+    jpegFinished++;
+    pthread_cond_signal(&jpegDoneCond);
+  }
+  return NULL;
+}
+
+static void
+JpegStartWorkers(void)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
 
-  JpegSetSrcManager(&cinfo, compressedData, compressedLen);
+  /* with a single cpu the socket thread decodes by itself */
+  jpegWorkers = 0;
+  if (cpus <= 1)
+    return;
+  if (cpus > JPEG_MAX_WORKERS)
+    cpus = JPEG_MAX_WORKERS;
 
-  jpeg_read_header(&cinfo, TRUE);
-  cinfo.out_color_space = JCS_RGB;
+  while (jpegWorkers < cpus) {
+    if (pthread_create(&jpegThreads[jpegWorkers], NULL, JpegWorker, NULL))
+      break;
+    jpegWorkers++;
+  }
+}
+
+int
+JpegPending(void)
+{
+  return jpegCommitted != jpegQueued;
+}
+
+/*
+ * Waits for all queued rects to be decoded and puts them on the screen in the
+ * order they arrived.
+ */
+void
+JpegSync(void)
+{
+  struct jpeg_job *job;
+
+  if (jpegCommitted == jpegQueued)
+    return;
+
+  pthread_mutex_lock(&jpegQueueLock);
+  while (jpegFinished != jpegQueued)
+    pthread_cond_wait(&jpegDoneCond, &jpegQueueLock);
+  pthread_mutex_unlock(&jpegQueueLock);
+
+  while (jpegCommitted != jpegQueued) {
+    job = &jpegQueue[jpegCommitted % JPEG_QUEUE_SIZE];
+    if (job->ok)
+      JpegPutRows(job->x, job->y, job->w, job->h, job->outW, 0, job->outH,
+		  job->pixels);
+    /* an earlier job of this update may have brought in the same payload */
+    if (job->ok && job->cache &&
+	!JpegCacheLookup(job->hash, job->outW, job->outH, job->data, job->len))
+      JpegCacheInsert(job->hash, job->outW, job->outH, job->data, job->len,
+		      job->pixels, job->pixelsSize);
+    job->pixels = NULL;
+    job->data = NULL;
+    jpegCommitted++;
+  }
+}
+
+/*
+ * Queues a JPEG rect for decoding. compressedData has to stay valid until
+ * the rect is committed, which JpegSync() does before the update arena is
+ * reset. Rects found in the cache are queued as already decoded.
+ */
+int
+JpegQueueRect(int x, int y, int w, int h, CARD8 *compressedData,
+	      int compressedLen)
+{
+  struct jpeg_job *job;
+  struct jpeg_cache_entry *cached = NULL;
+
+  if (w == 0 || h == 0)
+    return 1;
+
+  if (jpegWorkers < 0)
+    JpegStartWorkers();
+  if (jpegQueued - jpegCommitted == JPEG_QUEUE_SIZE)
+    JpegSync();
+
+  job = &jpegQueue[jpegQueued % JPEG_QUEUE_SIZE];
+  job->x = x;
+  job->y = y;
+  job->w = w;
+  job->h = h;
+  job->outW = SCALE_TO_SCREEN(w);
+  job->outH = SCALE_TO_SCREEN(h);
+  job->data = compressedData;
+  job->len = compressedLen;
+  job->pixelsSize = (long)job->outW * job->outH * (opt.client.bpp / 8);
+  job->cache = 0;
+  job->done = 0;
+  job->ok = 0;
+
+  if (opt.jpeg_cache_size > 0 &&
+      job->pixelsSize + compressedLen <= opt.jpeg_cache_size * 1024L) {
+    if (!jpegCacheReportSet) {
+      atexit(JpegCacheReport);
+      jpegCacheReportSet = 1;
+    }
+    job->hash = JpegCacheHash(compressedData, compressedLen,
+			      job->outW, job->outH);
+    cached = JpegCacheLookup(job->hash, job->outW, job->outH,
+			     compressedData, compressedLen);
+    if (cached)
+      jpegCacheHits++;
+    else {
+      jpegCacheMisses++;
+      job->cache = 1;
+    }
+  }
 
-  jpeg_start_decompress(&cinfo);
-  if (cinfo.output_width != w || cinfo.output_height != h ||
-      cinfo.output_components != 3) { 
-    fprintf(stderr, "Tight Encoding: Wrong JPEG data received.\n");
-    jpeg_destroy_decompress(&cinfo);
-    free(compressedData);
+  job->pixels = arena_alloc(job->pixelsSize);
+  if (job->pixels == NULL)
     return 0;
+
+  /* the cache entry may be gone by the time this job is committed */
+  if (cached) {
+    memcpy(job->pixels, cached->pixels, job->pixelsSize);
+    job->ok = 1;
+    job->done = 1;
   }
 
-  rowPointer[0] = (JSAMPROW)buffer;
-  dy = 0;
-  while (cinfo.output_scanline < cinfo.output_height) {
-    jpeg_read_scanlines(&cinfo, rowPointer, 1);
-    if (jpegError) {
+  if (!jpegWorkers) {
+    if (!job->done)
+      job->ok = JpegDecode(&jpegMainDecoder, job->data, job->len,
+			   job->outW, job->outH, job->pixels);
+    job->done = 1;
+    jpegQueued++;
+    jpegTaken++;
+    jpegFinished++;
+    JpegSync();
+    return job->ok;
+  }
+
+  pthread_mutex_lock(&jpegQueueLock);
+  jpegQueued++;
+  pthread_cond_signal(&jpegWorkCond);
+  pthread_mutex_unlock(&jpegQueueLock);
+
+  return 1;
+}
+
+/*----------------------------------------------------------------------------
+ *
+ * JPEG encoding. The image data is sent without a length, so the stream has
+ * to be parsed marker by marker to find its end. That is done on what has
+ * arrived from the server, going on where the last look stopped, and the
+ * image is read once it is there completely.
+ *
+ */
+
+/* don't let a broken stream eat all our memory */
+#define JPEG_STREAM_MAX (64 * 1024 * 1024)
+
+enum jpeg_scan_state
+{
+  JPEG_SCAN_SOI,		/* at the start of the image */
+  JPEG_SCAN_MARKER,		/* at the 0xFF of the next marker */
+  JPEG_SCAN_MARKER_CODE,	/* behind it, at fill bytes or the code */
+  JPEG_SCAN_LENGTH,		/* at the length of a marker segment */
+  JPEG_SCAN_ENTROPY,		/* in entropy coded data */
+  JPEG_SCAN_ENTROPY_FF		/* behind a 0xFF in entropy coded data */
+};
+
+/* how far JpegStreamSize() has got with the image of the current rect */
+static struct
+{
+  enum jpeg_scan_state state;
+  unsigned int pos;		/* bytes looked at */
+  int marker;
+  int len;			/* of the image once found, -1 if broken */
+} jpegScan;
+
+/* what follows the marker jpegScan.marker */
+static void
+JpegScanMarker(void)
+{
+  int marker = jpegScan.marker;
+
+  if (marker == 0xD9)		/* EOI */
+    jpegScan.len = jpegScan.pos;
+  else if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8))
+    jpegScan.state = JPEG_SCAN_MARKER;	/* TEM, RSTn and SOI have no length */
+  else
+    jpegScan.state = JPEG_SCAN_LENGTH;
+}
+
+/*
+ * Number of bytes the image of a JPEG rect takes, as far as it can be told
+ * from what has arrived. Returns 0 for a broken stream, which
+ * _handle_jpeg_encoded_message() then refuses.
+ */
+unsigned int
+JpegStreamSize(void)
+{
+  CARD8 *p, b;
+  int segLen;
+
+  while (!jpegScan.len) {
+    if (jpegScan.pos > JPEG_STREAM_MAX) {
+      fprintf(stderr, "JPEG encoding: image too large.\n");
+      jpegScan.len = -1;
+      break;
+    }
+
+    switch (jpegScan.state) {
+    case JPEG_SCAN_SOI:
+      if ((p = (CARD8 *)buffered_from_rfb_server(2)) == NULL)
+	return 2;
+      if (p[0] != 0xFF || p[1] != 0xD8) {
+	fprintf(stderr, "JPEG encoding: missing SOI marker.\n");
+	jpegScan.len = -1;
+	break;
+      }
+      jpegScan.pos = 2;
+      jpegScan.state = JPEG_SCAN_MARKER;
+      break;
+
+    case JPEG_SCAN_MARKER:
+      if ((p = (CARD8 *)buffered_from_rfb_server(jpegScan.pos + 1)) == NULL)
+	return jpegScan.pos + 1;
+      if (p[jpegScan.pos++] != 0xFF) {
+	fprintf(stderr, "JPEG encoding: marker expected.\n");
+	jpegScan.len = -1;
+	break;
+      }
+      jpegScan.state = JPEG_SCAN_MARKER_CODE;
+      break;
+
+    case JPEG_SCAN_MARKER_CODE:
+      if ((p = (CARD8 *)buffered_from_rfb_server(jpegScan.pos + 1)) == NULL)
+	return jpegScan.pos + 1;
+      b = p[jpegScan.pos++];
+      if (b != 0xFF) {
+	jpegScan.marker = b;
+	JpegScanMarker();
+      }
+      break;
+
+    case JPEG_SCAN_LENGTH:
+      if ((p = (CARD8 *)buffered_from_rfb_server(jpegScan.pos + 2)) == NULL)
+	return jpegScan.pos + 2;
+      segLen = p[jpegScan.pos] << 8 | p[jpegScan.pos + 1];
+      if (segLen < 2) {
+	fprintf(stderr, "JPEG encoding: bad segment length.\n");
+	jpegScan.len = -1;
+	break;
+      }
+      /* the segment itself need not have arrived to skip it */
+      jpegScan.pos += segLen;
+      jpegScan.state = jpegScan.marker == 0xDA ?
+	JPEG_SCAN_ENTROPY : JPEG_SCAN_MARKER;
+      break;
+
+    case JPEG_SCAN_ENTROPY:
+      /* SOS: entropy coded data follows up to the next marker that is
+       * neither a stuffed zero nor a restart marker. */
+      while ((p = (CARD8 *)buffered_from_rfb_server(jpegScan.pos + 1)) &&
+	     p[jpegScan.pos] != 0xFF)
+	jpegScan.pos++;
+      if (p == NULL)
+	return jpegScan.pos + 1;
+      jpegScan.pos++;
+      jpegScan.state = JPEG_SCAN_ENTROPY_FF;
+      break;
+
+    case JPEG_SCAN_ENTROPY_FF:
+      if ((p = (CARD8 *)buffered_from_rfb_server(jpegScan.pos + 1)) == NULL)
+	return jpegScan.pos + 1;
+      b = p[jpegScan.pos++];
+      if (b == 0xFF)
+	break;
+      if (b == 0x00 || (b >= 0xD0 && b <= 0xD7)) {
+	jpegScan.state = JPEG_SCAN_ENTROPY;
+	break;
+      }
+      jpegScan.marker = b;
+      JpegScanMarker();
       break;
     }
-    /* FIXME 16 bpp hardcoded */
-    /* Fill the second half of our global buffer with the uncompressed data */
-    pixelPtr = (CARD16 *)&buffer[BUFFER_SIZE / 2];
-    for (dx = 0; dx < w; dx++) {
-       *pixelPtr++ =
- 	RGB24_TO_PIXEL(16, buffer[dx*3], buffer[dx*3+1], buffer[dx*3+2]);
-     }
-    
-    /* write scanline to screen */
-    dfb_write_data_to_screen(x, y + dy, w, 1, &buffer[BUFFER_SIZE/2]);
-    dy++;
   }
 
-  if (!jpegError)
-    jpeg_finish_decompress(&cinfo);
+  return jpegScan.len > 0 ? jpegScan.len : 0;
+}
+
+/*
+ * The image has arrived completely, see JpegStreamSize().
+ */
+int
+_handle_jpeg_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
+{
+  CARD8 *copy;
+  int len = jpegScan.len;
 
-  jpeg_destroy_decompress(&cinfo);
-  free(compressedData);
+  memset(&jpegScan, 0, sizeof(jpegScan));
+  if (len <= 0)
+    return 0;
+
+  copy = arena_alloc(len);
+  if (copy == NULL)
+    return 0;
+  if (!read_from_rfb_server(sock, (char *)copy, len))
+    return 0;
 
-  return !jpegError;
+  return JpegQueueRect(rectheader.r.x, rectheader.r.y,
+		       rectheader.r.w, rectheader.r.h, copy, len);
 }
 
+/*
+ * Reads a length of one to three bytes, looking at them in the receive
+ * buffer rather than reading them one by one.
+ */
 long
 ReadCompactLen (void)
 {
   long len;
-  CARD8 b;
+  CARD8 *b;
+  int n = 1;
 
-  if (!read_from_rfb_server(sock, (char *)&b, 1))
+  if ((b = (CARD8 *)peek_from_rfb_server(sock, 1)) == NULL)
     return -1;
-  len = (int)b & 0x7F;
-  if (b & 0x80) {
-    if (!read_from_rfb_server(sock, (char *)&b, 1))
+  len = (int)b[0] & 0x7F;
+  if (b[0] & 0x80) {
+    if ((b = (CARD8 *)peek_from_rfb_server(sock, ++n)) == NULL)
       return -1;
-    len |= ((int)b & 0x7F) << 7;
-    if (b & 0x80) {
-      if (!read_from_rfb_server(sock, (char *)&b, 1))
+    len |= ((int)b[1] & 0x7F) << 7;
+    if (b[1] & 0x80) {
+      if ((b = (CARD8 *)peek_from_rfb_server(sock, ++n)) == NULL)
 	return -1;
-      len |= ((int)b & 0xFF) << 14;
+      len |= ((int)b[2] & 0xFF) << 14;
     }
   }
+  skip_from_rfb_server(n);
   return len;
 }
 
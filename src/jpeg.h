@@ -27,13 +27,30 @@
 #include "directvnc.h"
 #include <jpeglib.h>
 
+/* our source manager, libjpeg only sees pub */
+struct jpeg_source
+{
+  struct jpeg_source_mgr pub;
+  JOCTET *data;
+  size_t len;
+  int error;
+};
+
 void JpegInitSource(j_decompress_ptr cinfo);
 int JpegFillInputBuffer(j_decompress_ptr cinfo);
 void JpegSkipInputData(j_decompress_ptr cinfo, long num_bytes);
 void JpegTermSource(j_decompress_ptr cinfo);
-void JpegSetSrcManager(j_decompress_ptr cinfo, CARD8 *compressedData,
-                              int compressedLen);
+void JpegSetSrcManager(j_decompress_ptr cinfo, struct jpeg_source *src,
+                       CARD8 *compressedData, int compressedLen);
 int DecompressJpegRect(int x, int y, int w, int h);
+int JpegQueueRect(int x, int y, int w, int h, CARD8 *compressedData,
+                  int compressedLen);
+void JpegSync(void);
+int JpegPending(void);
+int SelectJpegDecoders(void);
+unsigned int JpegStreamSize(void);
+
+int _handle_jpeg_encoded_message(rfbFramebufferUpdateRectHeader rectheader);
 
 long ReadCompactLen (void);
 
@@ -0,0 +1,44 @@
+/*
+ *  Copyright (C) 2000, 2001 Const Kaplinsky.  All Rights Reserved.
+ *  Copyright (C) 2000 Tridia Corporation.  All Rights Reserved.
+ *  Copyright (C) 1999 AT&T Laboratories Cambridge.  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, a copy can be downloaded from 
+ *  http://www.gnu.org/licenses/gpl.html, or obtained by writing to the
+ *  Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, 
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * jpegbpp.h - conversion of decoded JPEG scanlines into client pixels.
+ *
+ * This file is included from jpeg.c once for every BPP of 8, 16 and 32.
+ */
+
+#define CARDBPP CONCAT2E(CARD,BPP)
+#define JpegConvertRowBPP CONCAT2E(JpegConvertRow,BPP)
+
+static void
+JpegConvertRowBPP (JSAMPLE *row, int w, char *dst)
+{
+  CARDBPP *pixelPtr = (CARDBPP *)dst;
+  int dx;
+
+  for (dx = 0; dx < w; dx++) {
+    *pixelPtr++ = RGB24_TO_PIXEL(BPP, row[dx*3], row[dx*3+1], row[dx*3+2]);
+  }
+}
+
+#undef CARDBPP
+#undef JpegConvertRowBPP
@@ -21,6 +21,7 @@
 
 #include <unistd.h>
 #include "directvnc.h"
+#include "record.h"
 #include <math.h>
 #include <signal.h>
 
@@ -28,11 +29,18 @@
 static inline double get_time(void);
 static inline void sig_handler(int foo) { exit(1); }
 
+/* where everything is drawn, see directvnc.h */
+struct display_backend *display = &dfb_display;
+
 int
 main (int argc,char **argv)
 {
+   int width, height, ret;
+
    /* parse arguments */
    args_parse(argc, argv);
+   if (opt.headless)
+      display = &headless_display;
    mousestate.buttonmask = 0;
 
    /* Read the modifier map if provided */
@@ -42,6 +50,10 @@ main (int argc,char **argv)
       exit(0);
    }
 
+   /* start recording before there is anything to record */
+   if (opt.record_file && !record_open(opt.record_file))
+      exit(0);
+
    /* Connect to server */
    if (!rfb_connect_to_server(opt.servername, 5900 + opt.port))	
    {
@@ -67,16 +79,27 @@ main (int argc,char **argv)
    }
 
    /* initialize the framebuffer lib */
-   dfb_init(argc, argv);
+   display->init(argc, argv);
 
    /* hook in sighandler, so we can clean up on ctrl-c */
    signal(SIGINT, sig_handler);
 
-   /* calculate horizontal and vertical offset */
-   if (opt.client.width > opt.server.width)
-      opt.h_offset = rint( (opt.client.width - opt.server.width) /2);
-   if (opt.client.height > opt.server.height)
-      opt.v_offset = rint( (opt.client.height - opt.server.height) /2);
+   /* have the server scale its framebuffer down if it can, so we do not
+    * receive pixels only to throw them away */
+   if (!rfb_negotiate_scale())
+   {
+      printf("Error negotiating server side scaling. Exiting.\n");
+      close(sock);
+      exit(0);
+   }
+
+   /* calculate horizontal and vertical offset and clear the screen, as
+    * there is nothing on it to keep yet */
+   width = opt.server.width;
+   height = opt.server.height;
+   opt.server.width = 0;
+   opt.server.height = 0;
+   display->set_server_size(width, height);
 
    mousestate.x = opt.client.width / 2;
    mousestate.y = opt.client.height / 2;
@@ -92,17 +115,29 @@ main (int argc,char **argv)
    rfb_send_update_request(0);
    while (1) 
    {
-
-      if (!rfb_handle_server_message())
+      ret = rfb_handle_server_message();
+      if (!ret)
 	 break; 
 
-      rfb_send_update_request(1);
-
-      /* If we've just been here and there are no events pending, let the 
-       * other kids play for a bit. */
-      dfb_wait_for_event_with_timeout(opt.poll_freq);
+      if (ret == RFB_MESSAGE_DONE)
+      {
+	 rfb_send_update_request(1);
+	 if (!flush_output(sock))
+	    break;
+
+	 /* If we've just been here and there are no events pending, let the 
+	  * other kids play for a bit. */
+	 display->wait_for_event(opt.poll_freq);
+      }
+      else
+      {
+	 /* the server is not done sending yet, see to the user meanwhile */
+	 display->process_events();
+	 if (!wait_for_rfb_server(sock, 10))
+	    break;
+      }
    }
-   dfb_deinit();
+   display->deinit();
    close(sock);
    return (1);
 }
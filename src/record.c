@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2001  Till Adam
+ * Authors: Till Adam <till@adam-lilienthal.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, a copy can be downloaded from
+ * http://www.gnu.org/licenses/gpl.html, or obtained by writing to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * record.c - records the session in an FBS file.
+ *
+ * Every byte received from the server is written to the file, in the
+ * format rfbproxy and other tools use for recorded sessions: the line
+ * "FBS 001.000\n", then one block per read, each a 32 bit big endian
+ * length, the data padded with zeros to a multiple of 4 bytes and a 32 bit
+ * big endian timestamp in milliseconds since the recording started.
+ *
+ * The receiving code only copies the data into a queue. Writing the file
+ * is left to a thread of its own, so a slow disk does not hold up the
+ * session. Only when the queue is full does the receiving code wait for
+ * the writer, as dropping data would make the recording useless.
+ */
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "directvnc.h"
+#include "record.h"
+
+#define RECORD_QUEUE_SIZE 64
+
+#define FBS_HEADER "FBS 001.000\n"
+
+struct record_block
+{
+   char *data;
+   unsigned int len;
+   unsigned int size;   /* allocated size of data */
+   CARD32 timestamp;
+};
+
+static FILE *file = NULL;
+static struct timeval start;
+
+/* the blocks queued and written so far, the queue holds the rest */
+static struct record_block queue[RECORD_QUEUE_SIZE];
+static unsigned int queued = 0, written = 0;
+static int closing = 0;
+
+static pthread_t writer_thread;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Writes one block. After an error nothing more is written, but the
+ * session goes on.
+ */
+static void
+_record_write_block(struct record_block *block)
+{
+   static const char padding[3] = { 0, 0, 0 };
+   static int failed = 0;
+   CARD32 len = Swap32IfLE(block->len), timestamp = Swap32IfLE(block->timestamp);
+
+   if (failed)
+      return;
+   if (fwrite(&len, 4, 1, file) != 1
+	 || fwrite(block->data, 1, block->len, file) != block->len
+	 || fwrite(padding, 1, -block->len & 3, file) != (-block->len & 3)
+	 || fwrite(&timestamp, 4, 1, file) != 1)
+   {
+      perror("DIRECTVNC: recording");
+      failed = 1;
+   }
+}
+
+static void *
+_record_thread(void *unused)
+{
+   struct record_block *block;
+
+   pthread_mutex_lock(&queue_lock);
+   while (1)
+   {
+      while (written == queued && !closing)
+	 pthread_cond_wait(&work_cond, &queue_lock);
+      if (written == queued)
+	 break;
+      block = &queue[written % RECORD_QUEUE_SIZE];
+      pthread_mutex_unlock(&queue_lock);
+
+      _record_write_block(block);
+
+      pthread_mutex_lock(&queue_lock);
+      written++;
+      pthread_cond_signal(&done_cond);
+   }
+   pthread_mutex_unlock(&queue_lock);
+   return NULL;
+}
+
+/*
+ * Starts recording into filename. The file is closed at exit. Returns 0 on
+ * error.
+ */
+int
+record_open(char *filename)
+{
+   if (!(file = fopen(filename, "wb")))
+   {
+      perror(filename);
+      return 0;
+   }
+   if (fputs(FBS_HEADER, file) == EOF)
+   {
+      perror(filename);
+      fclose(file);
+      file = NULL;
+      return 0;
+   }
+   if (pthread_create(&writer_thread, NULL, _record_thread, NULL))
+   {
+      fprintf(stderr, "Recording: could not start writer thread\n");
+      fclose(file);
+      file = NULL;
+      return 0;
+   }
+   gettimeofday(&start, NULL);
+   atexit(record_close);
+   return 1;
+}
+
+/*
+ * Queues n bytes just received from the server.
+ */
+void
+record_data(char *data, unsigned int n)
+{
+   struct record_block *block;
+   struct timeval now;
+   char *p;
+
+   if (!file)
+      return;
+
+   pthread_mutex_lock(&queue_lock);
+   while (queued - written == RECORD_QUEUE_SIZE)
+      pthread_cond_wait(&done_cond, &queue_lock);
+   pthread_mutex_unlock(&queue_lock);
+
+   /* the writer is done with this block, so it can be reused */
+   block = &queue[queued % RECORD_QUEUE_SIZE];
+   if (n > block->size)
+   {
+      if (!(p = realloc(block->data, n)))
+      {
+	 fprintf(stderr, "Memory allocation error.\n");
+	 return;
+      }
+      block->data = p;
+      block->size = n;
+   }
+   memcpy(block->data, data, n);
+   block->len = n;
+   gettimeofday(&now, NULL);
+   block->timestamp = (now.tv_sec - start.tv_sec) * 1000
+		      + (now.tv_usec - start.tv_usec) / 1000;
+
+   pthread_mutex_lock(&queue_lock);
+   queued++;
+   pthread_cond_signal(&work_cond);
+   pthread_mutex_unlock(&queue_lock);
+}
+
+/*
+ * Writes out what is still queued and closes the file.
+ */
+void
+record_close(void)
+{
+   int i;
+
+   if (!file)
+      return;
+
+   pthread_mutex_lock(&queue_lock);
+   closing = 1;
+   pthread_cond_signal(&work_cond);
+   pthread_mutex_unlock(&queue_lock);
+   pthread_join(writer_thread, NULL);
+
+   if (fclose(file) != 0)
+      perror("DIRECTVNC: recording");
+   file = NULL;
+   for (i = 0; i < RECORD_QUEUE_SIZE; i++)
+      free(queue[i].data);
+}
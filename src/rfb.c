@@ -32,6 +32,11 @@
 
 #include "directvnc.h"
 #include "tight.h"
+#include "jpeg.h"
+#include "h264.h"
+#include "adapt.h"
+#include "uring.h"
+#include "arena.h"
 
 int _rfb_negotiate_protocol ();
 int _rfb_authenticate ();
@@ -44,7 +49,23 @@ static int _handle_copyrect_encoded_message(rfbFramebufferUpdateRectHeader recth
 static int _handle_rre_encoded_message(rfbFramebufferUpdateRectHeader rectheader);
 static int _handle_corre_encoded_message(rfbFramebufferUpdateRectHeader rectheader);
 static int _handle_hextile_encoded_message(rfbFramebufferUpdateRectHeader rectheader);
+static int _handle_zlibhex_encoded_message(rfbFramebufferUpdateRectHeader rectheader);
+static int _handle_hextile_tile(rfbFramebufferUpdateRectHeader rectheader, int zlibhex);
 static int _handle_richcursor_message(rfbFramebufferUpdateRectHeader rectheader);
+static int _handle_desktop_size_message(rfbFramebufferUpdateRectHeader rectheader);
+static int _handle_extended_desktop_size_message(rfbFramebufferUpdateRectHeader rectheader);
+static int _select_decoders(void);
+static int _handle_colourmap_entries(int first, int count);
+static void _set_scale(int client_scale, int server_scale);
+
+/* minor protocol version announced by the server */
+static int server_minor_version = 0;
+/* set while a SetScale request has not been answered */
+static int scale_pending = 0;
+/* set once the first framebuffer update has been drawn */
+static int updates_seen = 0;
+/* colours of the colour map, if the client pixel format is not true colour */
+static CARD8 colourmap[256][3];
 
 /*
  * ConnectToRFBServer.
@@ -55,7 +76,7 @@ int
 rfb_connect_to_server (char *host, int port)
 {
    struct hostent *he=NULL;
-   int one=1;
+   int one=1, rcvbuf;
    struct sockaddr_in s;
 
 
@@ -81,6 +102,12 @@ rfb_connect_to_server (char *host, int port)
    s.sin_port = htons(port);
    s.sin_family = AF_INET;
 
+   /* let the kernel buffer as much as we do, before connecting so the
+    * window scale is negotiated for it */
+   rcvbuf = opt.recv_buffer * 1024;
+   if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char *)&rcvbuf, sizeof(rcvbuf)) < 0)
+      fprintf(stderr, "Could not set the socket receive buffer size\n");
+
    if (connect(sock,(struct sockaddr*) &s, sizeof(s)) < 0)
    {
       fprintf(stderr, "Connect error\n");
@@ -95,6 +122,8 @@ rfb_connect_to_server (char *host, int port)
    }
 
    if (!set_non_blocking(sock)) return -1;
+   if (opt.io_uring && !uring_open(sock))
+      fprintf(stderr, "io_uring is not available, using plain socket calls\n");
   
    return (sock);
 }
@@ -114,11 +143,14 @@ int
 _rfb_negotiate_protocol()
 {
    rfbProtocolVersionMsg msg;
+   int major;
  
    /* read the protocol version the server uses */
    if (!read_from_rfb_server(sock, (char*)&msg, sz_rfbProtocolVersionMsg))
       return 0;
-   /* FIXME actually do something with that information ;) */
+   msg[sz_rfbProtocolVersionMsg] = 0;
+   if (sscanf(msg, rfbProtocolVersionFormat, &major, &server_minor_version) != 2)
+      server_minor_version = 0;
 
    /* send the protocol version we want to use */
    sprintf(msg, rfbProtocolVersionFormat, 
@@ -239,11 +271,7 @@ _rfb_initialise_server()
 int
 rfb_set_format_and_encodings()
 {
-   char *next;
-   int num_enc =0;
    rfbSetPixelFormatMsg pf;
-   rfbSetEncodingsMsg em;
-   CARD32 enc[MAX_ENCODINGS];
   
    pf.type = 0;
    pf.format.bitsPerPixel = opt.client.bpp;
@@ -258,13 +286,37 @@ rfb_set_format_and_encodings()
    pf.format.blueShift = opt.client.blueshift;
 
    if (!write_exact(sock, (char*)&pf, sz_rfbSetPixelFormatMsg)) return 0;
+   if (!_select_decoders()) return 0;
+
+   return rfb_send_encodings(opt.encodings, opt.client.compresslevel,
+	 opt.client.quality);
+}
+
+/*
+ * Sends a SetEncodings message for a space separated list of encodings as
+ * given with --encodings (NULL for our default list). compresslevel and
+ * quality are only sent if they are in 0..9. Also used to change encodings
+ * in the middle of a session, see adapt.c.
+ */
+int
+rfb_send_encodings(char *encodings, int compresslevel, int quality)
+{
+   char *list = NULL, *next = NULL;
+   int num_enc =0;
+   rfbSetEncodingsMsg em;
+   CARD32 enc[MAX_ENCODINGS];
 
    em.type = rfbSetEncodings;
    em.nEncodings = Swap16IfLE(0);
 
-   /* figure out the encodings string given on the command line */
-   next = strtok(opt.encodings, " ");
-   while (next && em.nEncodings < MAX_ENCODINGS)
+   /* figure out the encodings string, leaving room for the cursor,
+    * desktop size, compression and quality pseudo encodings */
+   if (encodings)
+   {
+      list = strdup(encodings);
+      next = strtok(list, " ");
+   }
+   while (next && num_enc < MAX_ENCODINGS - 5)
    {
       if (!strcmp(next, "raw"))
       {
@@ -278,6 +330,21 @@ rfb_set_format_and_encodings()
       {
 	 enc[num_enc++] = Swap32IfLE(rfbEncodingHextile);
       }
+      if (!strcmp(next, "zlibhex"))
+      {
+	 enc[num_enc++] = Swap32IfLE(rfbEncodingZlibHex);
+      }
+      if (!strcmp(next, "jpeg"))
+      {
+	 enc[num_enc++] = Swap32IfLE(rfbEncodingJPEG);
+      }
+      if (!strcmp(next, "h264"))
+      {
+	 if (h264_available())
+	    enc[num_enc++] = Swap32IfLE(rfbEncodingH264);
+	 else
+	    fprintf(stderr, "H.264 is not supported by this build or depth\n");
+      }
       if (!strcmp(next, "zlib"))
       {
 	 enc[num_enc++] = Swap32IfLE(rfbEncodingZlib);
@@ -297,9 +364,11 @@ rfb_set_format_and_encodings()
       next = strtok(NULL, " ");
       em.nEncodings = Swap16IfLE(num_enc);
    }
+   free(list);
    if (!em.nEncodings)
    {
       enc[num_enc++] = Swap32IfLE(rfbEncodingTight);
+      enc[num_enc++] = Swap32IfLE(rfbEncodingZlibHex);
       enc[num_enc++] = Swap32IfLE(rfbEncodingHextile);
       enc[num_enc++] = Swap32IfLE(rfbEncodingZlib);
       enc[num_enc++] = Swap32IfLE(rfbEncodingCopyRect);
@@ -311,13 +380,17 @@ rfb_set_format_and_encodings()
    /* Track cursor locally */
    if (opt.localcursor)
       enc[num_enc++] = Swap32IfLE(rfbEncodingRichCursor);
+
+   /* Follow the server when it is resized */
+   enc[num_enc++] = Swap32IfLE(rfbEncodingExtDesktopSize);
+   enc[num_enc++] = Swap32IfLE(rfbEncodingNewFBSize);
      
-   if (opt.client.compresslevel <= 9)
+   if (compresslevel >= 0 && compresslevel <= 9)
       enc[num_enc++] = Swap32IfLE(rfbEncodingCompressLevel0 + 
-	                          opt.client.compresslevel);
-   if (opt.client.quality <= 9)
+	                          compresslevel);
+   if (quality >= 0 && quality <= 9)
       enc[num_enc++] = Swap32IfLE(rfbEncodingQualityLevel0 + 
-	                          opt.client.quality);
+	                          quality);
 
    em.nEncodings = Swap16IfLE(num_enc);
    
@@ -328,17 +401,170 @@ rfb_set_format_and_encodings()
 }
 
 
+/* the part of the server we ask for updates of */
+static int area_x, area_y, area_w, area_h;
+
+/*
+ * Works out the part of the server we want to be kept up to date: the
+ * viewport plus the prefetch margin around it, which is all of the server
+ * unless it is larger than the screen.
+ */
+static void
+_wanted_area(int *x, int *y, int *w, int *h)
+{
+   int vx, vy, vw, vh, x2, y2;
+
+   display->get_viewport(&vx, &vy, &vw, &vh);
+   *x = vx - opt.prefetch;
+   *y = vy - opt.prefetch;
+   x2 = vx + vw + opt.prefetch;
+   y2 = vy + vh + opt.prefetch;
+   if (*x < 0)
+      *x = 0;
+   if (*y < 0)
+      *y = 0;
+   if (x2 > opt.server.width)
+      x2 = opt.server.width;
+   if (y2 > opt.server.height)
+      y2 = opt.server.height;
+   *w = x2 - *x;
+   *h = y2 - *y;
+}
+
+/*
+ * Asks for a full update of everything in the wanted area that is not in
+ * the area we have been asking for so far, which we have up to date already.
+ */
+static void
+_request_exposed(void)
+{
+   int x, y, w, h, ix1, iy1, ix2, iy2;
+
+   _wanted_area(&x, &y, &w, &h);
+   ix1 = x > area_x ? x : area_x;
+   iy1 = y > area_y ? y : area_y;
+   ix2 = x + w < area_x + area_w ? x + w : area_x + area_w;
+   iy2 = y + h < area_y + area_h ? y + h : area_y + area_h;
+
+   if (ix1 >= ix2 || iy1 >= iy2)
+      rfb_send_update_request_rect(x, y, w, h, 0);
+   else
+   {
+      /* above, below, left and right of what we have */
+      if (iy1 > y)
+	 rfb_send_update_request_rect(x, y, w, iy1 - y, 0);
+      if (y + h > iy2)
+	 rfb_send_update_request_rect(x, iy2, w, y + h - iy2, 0);
+      if (ix1 > x)
+	 rfb_send_update_request_rect(x, iy1, ix1 - x, iy2 - iy1, 0);
+      if (x + w > ix2)
+	 rfb_send_update_request_rect(ix2, iy1, x + w - ix2, iy2 - iy1, 0);
+   }
+   area_x = x;
+   area_y = y;
+   area_w = w;
+   area_h = h;
+}
+
+/*
+ * The viewport has been panned. Fetches what has come into view, later
+ * incremental requests cover the new area.
+ */
+void
+rfb_viewport_changed(void)
+{
+   _request_exposed();
+}
+
+/*
+ * Sets how much of the scaling down is done here and how much by the server.
+ * Pointer positions are in the coordinates of the framebuffer we get, the
+ * server scales them back up itself.
+ */
+static void
+_set_scale(int client_scale, int server_scale)
+{
+   opt.scale = client_scale;
+   opt.server_scale = server_scale;
+   opt.h_ratio = client_scale;
+   opt.v_ratio = client_scale;
+}
+
+/*
+ * Asks the server to scale its framebuffer down by opt.scale, which saves
+ * sending the pixels we would drop anyway. Only UltraVNC servers, which
+ * announce themselves with protocol versions 3.4, 3.6, 3.14 and 3.16,
+ * understand SetScale; others would drop the connection on it, so they are
+ * left to client side scaling. The new size comes in as a NewFBSize rect.
+ */
+int
+rfb_negotiate_scale(void)
+{
+   rfbSetScaleMsg ssc;
+   int scale = opt.scale;
+
+   _set_scale(scale, 1);
+   if (scale == 1)
+      return 1;
+   if (server_minor_version != 4 && server_minor_version != 6
+	 && server_minor_version != 14 && server_minor_version != 16)
+      return 1;
+
+   ssc.type = rfbSetScale;
+   ssc.scale = scale;
+   ssc.pad = 0;
+   if (!write_exact(sock, (char*)&ssc, sz_rfbSetScaleMsg))
+      return 0;
+
+   /* assume it works, the first update tells */
+   fprintf(stderr, "Asking the server to scale to 1/%d\n", scale);
+   _set_scale(1, scale);
+   opt.server.width /= scale;
+   opt.server.height /= scale;
+   scale_pending = 1;
+   return 1;
+}
+
+/*
+ * The first update after SetScale is in. If it did not resize the
+ * framebuffer, the server has ignored the request and we scale ourselves.
+ */
+static void
+_check_server_scale(int resized)
+{
+   int scale = opt.server_scale;
+
+   scale_pending = 0;
+   if (resized)
+      return;
+   fprintf(stderr, "Server does not scale, scaling to 1/%d here\n", scale);
+   _set_scale(scale, 1);
+   /* the screen shows garbage drawn at the wrong scale, start over */
+   opt.server.width *= scale;
+   opt.server.height *= scale;
+   display->set_server_size(opt.server.width, opt.server.height);
+   rfb_send_update_request(0);
+}
+
 int
 rfb_send_update_request(int incremental)
+{
+   _wanted_area(&area_x, &area_y, &area_w, &area_h);
+   return rfb_send_update_request_rect(area_x, area_y, area_w, area_h,
+	 incremental);
+}
+
+int
+rfb_send_update_request_rect(int x, int y, int w, int h, int incremental)
 {
    rfbFramebufferUpdateRequestMsg urq;
 
    urq.type = rfbFramebufferUpdateRequest;
    urq.incremental = incremental;
-   urq.x = 0;
-   urq.y = 0;
-   urq.w = opt.server.width;
-   urq.h = opt.server.height;
+   urq.x = x;
+   urq.y = y;
+   urq.w = w;
+   urq.h = h;
 
    urq.x = Swap16IfLE(urq.x);
    urq.y = Swap16IfLE(urq.y);
@@ -347,79 +573,292 @@ rfb_send_update_request(int incremental)
 
    if (!write_exact(sock, (char*)&urq, sz_rfbFramebufferUpdateRequestMsg))
       return 0;
+   adapt_request_sent();
 
    return 1;
 }
 
 
-int
-rfb_handle_server_message()
+/*
+ * The server message parser keeps its place between calls, so it can stop
+ * whenever it runs out of data and go on when more has arrived.
+ */
+static enum {
+   PARSE_MESSAGE,        /* waiting for the next message */
+   PARSE_RECT_HEADER,    /* waiting for the next rect of an update */
+   PARSE_RECT_DATA       /* waiting for the data of the current rect */
+} parse_state = PARSE_MESSAGE;
+static rfbFramebufferUpdateRectHeader cur_rect;
+static int rects_left;
+static int update_resized;
+/* how far the current rect has got, for the encodings decoded in parts as
+ * they come in: the rows done of raw rects, the next tile of hextile ones */
+static int rect_x, rect_y;
+
+#define _peek16(p) (((CARD8 *)(p))[0] << 8 | ((CARD8 *)(p))[1])
+#define _peek32(p) ((CARD32)_peek16(p) << 16 | _peek16((CARD8 *)(p) + 2))
+
+/*
+ * Number of bytes the next message takes, as far as it can be told from what
+ * has arrived.
+ */
+static unsigned int
+_message_size(void)
+{
+   char *p;
+
+   if (!(p = buffered_from_rfb_server(1)))
+      return 1;
+   switch ((CARD8)p[0])
+   {
+      case rfbFramebufferUpdate:
+	 return sz_rfbFramebufferUpdateMsg;
+      case rfbSetColourMapEntries:
+	 if (!(p = buffered_from_rfb_server(sz_rfbSetColourMapEntriesMsg)))
+	    return sz_rfbSetColourMapEntriesMsg;
+	 return sz_rfbSetColourMapEntriesMsg + 6 * _peek16(p + 4);
+      case rfbServerCutText:
+	 if (!(p = buffered_from_rfb_server(sz_rfbServerCutTextMsg)))
+	    return sz_rfbServerCutTextMsg;
+	 return sz_rfbServerCutTextMsg + _peek32(p + 4);
+   }
+   return 1;
+}
+
+/*
+ * Number of rows in the next band of the current raw rect. Raw rects are
+ * drawn band by band as they come in, a band takes at most half the receive
+ * buffer.
+ */
+static int
+_raw_band_rows(void)
+{
+   int row = cur_rect.r.w * (opt.client.bpp / 8);
+   int rows = cur_rect.r.h - rect_y;
+   int max = row ? opt.recv_buffer * 512 / row : rows;
+
+   if (max < 1)
+      max = 1;
+   return rows < max ? rows : max;
+}
+
+/*
+ * Number of bytes the next tile of the current hextile or ZlibHex rect
+ * takes, as far as its subencoding and lengths have arrived.
+ */
+static unsigned int
+_hextile_tile_size(int zlibhex)
+{
+   unsigned int bpp = opt.client.bpp / 8;
+   unsigned int tile_w, tile_h, n;
+   CARD8 *p, enc;
+
+   if (!cur_rect.r.w || rect_y >= cur_rect.r.h)
+      return 0;
+   if (!(p = (CARD8 *)buffered_from_rfb_server(1)))
+      return 1;
+   enc = p[0];
+   tile_w = cur_rect.r.w - rect_x < 16 ? cur_rect.r.w - rect_x : 16;
+   tile_h = cur_rect.r.h - rect_y < 16 ? cur_rect.r.h - rect_y : 16;
+
+   /* a CARD16 length and zlib data, see _handle_hextile_tile() */
+   if (zlibhex && ((enc & rfbHextileZlibRaw) ||
+	    (!(enc & rfbHextileRaw) && (enc & rfbHextileZlibHex))))
+   {
+      if (!(p = (CARD8 *)buffered_from_rfb_server(3)))
+	 return 3;
+      return 3 + _peek16(p + 1);
+   }
+   if (enc & rfbHextileRaw)
+      return 1 + tile_w * tile_h * bpp;
+
+   n = 1;
+   if (enc & rfbHextileBackgroundSpecified)
+      n += bpp;
+   if (enc & rfbHextileForegroundSpecified)
+      n += bpp;
+   if (!(enc & rfbHextileAnySubrects))
+      return n;
+   if (!(p = (CARD8 *)buffered_from_rfb_server(n + 1)))
+      return n + 1;
+   return n + 1 + p[n] * (enc & rfbHextileSubrectsColoured ? bpp + 2 : 2);
+}
+
+/*
+ * Number of bytes the next part of the current rect takes, as far as it can
+ * be told from what has arrived. Raw, hextile, Tight and Zlib rects come in
+ * parts that are decoded one by one, see _handle_rect().
+ */
+static unsigned int
+_rect_data_size(void)
+{
+   unsigned int bpp = opt.client.bpp / 8;
+   unsigned int w = cur_rect.r.w, h = cur_rect.r.h;
+   char *p;
+
+   switch (cur_rect.encoding)
+   {
+      case rfbEncodingRaw:
+	 return _raw_band_rows() * w * bpp;
+      case rfbEncodingCopyRect:
+	 return sz_rfbCopyRect;
+      case rfbEncodingRRE:
+	 if (!(p = buffered_from_rfb_server(sz_rfbRREHeader)))
+	    return sz_rfbRREHeader;
+	 return sz_rfbRREHeader + bpp + _peek32(p) * (bpp + sz_rfbRectangle);
+      case rfbEncodingCoRRE:
+	 if (!(p = buffered_from_rfb_server(sz_rfbRREHeader)))
+	    return sz_rfbRREHeader;
+	 return sz_rfbRREHeader + bpp + _peek32(p) * (bpp + 4);
+      case rfbEncodingHextile:
+	 return _hextile_tile_size(0);
+      case rfbEncodingZlibHex:
+	 return _hextile_tile_size(1);
+      case rfbEncodingTight:
+	 return TightDataSize(w, h);
+      case rfbEncodingZlib:
+	 return ZlibDataSize();
+      case rfbEncodingJPEG:
+	 return JpegStreamSize();
+      case rfbEncodingH264:
+	 if (!(p = buffered_from_rfb_server(sz_rfbH264Header)))
+	    return sz_rfbH264Header;
+	 return sz_rfbH264Header + _peek32(p);
+      case rfbEncodingRichCursor:
+	 return w * h * bpp + (w + 7) / 8 * h;
+      case rfbEncodingExtDesktopSize:
+	 if (!(p = buffered_from_rfb_server(sz_rfbExtDesktopSizeMsg)))
+	    return sz_rfbExtDesktopSizeMsg;
+	 return sz_rfbExtDesktopSizeMsg + (CARD8)p[0] * sz_rfbExtDesktopScreen;
+   }
+   return 0;
+}
+
+/*
+ * Checks whether size() bytes have arrived, reading what is there without
+ * waiting if not. The receive buffer grows if they would not fit. Returns 1
+ * if so, 0 if not and -1 on error.
+ */
+static int
+_have_data(unsigned int (*size)(void))
+{
+   unsigned int n = size();
+
+   if (buffered_from_rfb_server(n))
+      return 1;
+   if (!expect_from_rfb_server(n) || !fill_from_rfb_server(sock))
+      return -1;
+   /* what has come in may tell more about the size */
+   n = size();
+   return buffered_from_rfb_server(n) != NULL;
+}
+
+/*
+ * Decodes the next part of the current rect, which has arrived completely.
+ * Returns RECT_DONE once the rect is complete, RECT_MORE if more of it is to
+ * come and 0 on error. The stream cannot be trusted after a decoder has
+ * failed, so that ends the session.
+ */
+static int
+_handle_rect(void)
+{
+   rfbFramebufferUpdateRectHeader rectheader = cur_rect;
+   int ret;
+
+   switch (rectheader.encoding)
+   {
+      case rfbEncodingRaw:
+	 ret = _handle_raw_encoded_message(rectheader);
+	 break;
+      case rfbEncodingCopyRect:
+	 ret = _handle_copyrect_encoded_message(rectheader);
+	 break;
+      case rfbEncodingRRE:
+	 ret = _handle_rre_encoded_message(rectheader);
+	 break;
+      case rfbEncodingCoRRE:
+	 ret = _handle_corre_encoded_message(rectheader);
+	 break;
+      case rfbEncodingHextile:
+	 ret = _handle_hextile_encoded_message(rectheader);
+	 break;
+      case rfbEncodingZlibHex:
+	 ret = _handle_zlibhex_encoded_message(rectheader);
+	 break;
+      case rfbEncodingJPEG:
+	 ret = _handle_jpeg_encoded_message(rectheader);
+	 break;
+      case rfbEncodingH264:
+	 ret = _handle_h264_encoded_message(rectheader);
+	 break;
+      case rfbEncodingTight:
+	 ret = _handle_tight_encoded_message(rectheader);
+	 break;
+      case rfbEncodingZlib:
+	 ret = _handle_zlib_encoded_message(rectheader);
+	 break;
+      case rfbEncodingRichCursor:
+	 ret = _handle_richcursor_message(rectheader);
+	 break;
+      case rfbEncodingNewFBSize:
+	 ret = _handle_desktop_size_message(rectheader);
+	 update_resized = 1;
+	 break;
+      case rfbEncodingExtDesktopSize:
+	 ret = _handle_extended_desktop_size_message(rectheader);
+	 break;
+      case rfbEncodingLastRect:
+	 /* the update ends here, whatever its header said */
+	 rects_left = 1;
+	 ret = RECT_DONE;
+	 break;
+
+      default:
+	 printf("Unknown encoding\n");
+	 return 0;
+	 break;
+   }
+   if (!ret)
+   {
+      fprintf(stderr, "Bad data in a rect of encoding %d, giving up\n",
+	    (int)rectheader.encoding);
+      return 0;
+   }
+   if (ret == RECT_MORE)
+   {
+      adapt_rect_part(rectheader.encoding);
+      return RECT_MORE;
+   }
+   adapt_rect_end(rectheader.encoding,
+	 rectheader.r.w * rectheader.r.h);
+   /* Now we may discard "soft cursor locks". Pending H.264 and JPEG
+    * rects keep theirs until they have been drawn. */
+   if (!h264_pending() && !JpegPending())
+      SoftCursorUnlockScreen();
+   return RECT_DONE;
+}
+
+/*
+ * Handles a message other than FramebufferUpdate, which has arrived
+ * completely.
+ */
+static int
+_handle_other_message(void)
 {
    int size;
    char *buf;
    rfbServerToClientMsg msg;
-   rfbFramebufferUpdateRectHeader rectheader;
-   
+
    if (!read_from_rfb_server(sock, (char*)&msg, 1)) return 0;
    switch (msg.type)
    {
-      int i;
-      case rfbFramebufferUpdate:
-	 read_from_rfb_server(sock, ((char*)&msg.fu)+1, sz_rfbFramebufferUpdateMsg-1);
-	 msg.fu.nRects = Swap16IfLE(msg.fu.nRects);
-	 for (i=0;i< msg.fu.nRects;i++)
-	 {
-	    read_from_rfb_server(sock, (char*)&rectheader, 
-		  sz_rfbFramebufferUpdateRectHeader);
-	    rectheader.r.x = Swap16IfLE(rectheader.r.x);
-	    rectheader.r.y = Swap16IfLE(rectheader.r.y);
-	    rectheader.r.w = Swap16IfLE(rectheader.r.w);
-	    rectheader.r.h = Swap16IfLE(rectheader.r.h);
-	    rectheader.encoding = Swap32IfLE(rectheader.encoding);
-	    SoftCursorLockArea(rectheader.r.x, rectheader.r.y, rectheader.r.w, rectheader.r.h); 
-	    switch (rectheader.encoding)
-	    {
-	       case rfbEncodingRaw:
-		  _handle_raw_encoded_message(rectheader);		  
-		  break;
-	       case rfbEncodingCopyRect:
-		  _handle_copyrect_encoded_message(rectheader); 
-		  break;
-	       case rfbEncodingRRE:
-		  _handle_rre_encoded_message(rectheader);
-		  break;
-	       case rfbEncodingCoRRE:
-		  _handle_corre_encoded_message(rectheader);
-		  break;
-	       case rfbEncodingHextile:
-		  _handle_hextile_encoded_message(rectheader);
-		  break;
-	       case rfbEncodingTight:
-		  _handle_tight_encoded_message(rectheader);
-		  break;
-	       case rfbEncodingZlib:
-		  _handle_zlib_encoded_message(rectheader);
-		  break;
-	       case rfbEncodingRichCursor:
-		  _handle_richcursor_message(rectheader);
-		  break;
-	       case rfbEncodingLastRect:
-		  printf("LAST\n");
-		  break;
-		  
-	       default:
-		  printf("Unknown encoding\n");
-		  return 0;
-		  break;
-	    }
-	    /* Now we may discard "soft cursor locks". */
-	    SoftCursorUnlockScreen();
-
-	 }
-	 break;
       case rfbSetColourMapEntries:
-	 fprintf(stderr, "SetColourMapEntries\n");
-	 read_from_rfb_server(sock, ((char*)&msg.scme)+1, sz_rfbSetColourMapEntriesMsg-1);
+	 if (!read_from_rfb_server(sock, ((char*)&msg.scme)+1,
+		  sz_rfbSetColourMapEntriesMsg-1))
+	    return 0;
+	 if (!_handle_colourmap_entries(Swap16IfLE(msg.scme.firstColour),
+		  Swap16IfLE(msg.scme.nColours)))
+	    return 0;
 	 break;
       case rfbBell:
 	 fprintf(stderr, "Bell message. Unimplemented.\n");
@@ -429,24 +868,118 @@ rfb_handle_server_message()
 	 read_from_rfb_server(sock, ((char*)&msg.sct)+1, 
 	       sz_rfbServerCutTextMsg-1);
 	 size = Swap32IfLE(msg.sct.length);
-	 buf = malloc(sizeof(char) * size);
+	 if (!(buf = arena_alloc(size + 1)))
+	    return 0;
 	 read_from_rfb_server(sock, buf, size);
 	 buf[size]=0;
 	 printf("%s\n", buf);
-	 free(buf);
+	 arena_reset();
 	 break;
       default:
 	 printf("Unknown server message. Type: %i\n", msg.type);
 	 return 0;
 	 break;
    }
-   return(1);
+   return 1;
+}
+
+/*
+ * Handles what the server has sent, as far as it has arrived. Messages, rect
+ * headers and rect data are only read once they are in the receive buffer
+ * completely, so a slowly arriving update does not keep us from handling
+ * input. Rects that can be large are decoded in parts, raw rects in bands of
+ * rows, hextile rects tile by tile and Tight and Zlib rects in portions of
+ * zlib data, each part as soon as it is there.
+ * Returns RFB_MESSAGE_DONE after a complete message, RFB_NEED_DATA if it has
+ * to wait for the server, and 0 on error.
+ */
+int
+rfb_handle_server_message()
+{
+   rfbFramebufferUpdateMsg fu;
+   int have;
+
+   while (1)
+   {
+      switch (parse_state)
+      {
+	 case PARSE_MESSAGE:
+	    if ((have = _have_data(_message_size)) <= 0)
+	       return have ? 0 : RFB_NEED_DATA;
+	    if (*buffered_from_rfb_server(1) != rfbFramebufferUpdate)
+	       return _handle_other_message() ? RFB_MESSAGE_DONE : 0;
+	    if (!read_from_rfb_server(sock, (char*)&fu, sz_rfbFramebufferUpdateMsg))
+	       return 0;
+	    rects_left = Swap16IfLE(fu.nRects);
+	    update_resized = 0;
+	    adapt_update_begin();
+	    parse_state = PARSE_RECT_HEADER;
+	    break;
+
+	 case PARSE_RECT_HEADER:
+	    if (!rects_left)
+	    {
+	       h264_sync();
+	       JpegSync();
+	       SoftCursorUnlockScreen();
+	       display->present();
+	       /* the decoders are done with the memory of this update */
+	       arena_reset();
+	       adapt_update_end();
+	       if (scale_pending)
+		  _check_server_scale(update_resized);
+	       updates_seen = 1;
+	       parse_state = PARSE_MESSAGE;
+	       return RFB_MESSAGE_DONE;
+	    }
+	    if (!buffered_from_rfb_server(sz_rfbFramebufferUpdateRectHeader))
+	    {
+	       if (!fill_from_rfb_server(sock))
+		  return 0;
+	       if (!buffered_from_rfb_server(sz_rfbFramebufferUpdateRectHeader))
+		  return RFB_NEED_DATA;
+	    }
+	    read_from_rfb_server(sock, (char*)&cur_rect, 
+		  sz_rfbFramebufferUpdateRectHeader);
+	    cur_rect.r.x = Swap16IfLE(cur_rect.r.x);
+	    cur_rect.r.y = Swap16IfLE(cur_rect.r.y);
+	    cur_rect.r.w = Swap16IfLE(cur_rect.r.w);
+	    cur_rect.r.h = Swap16IfLE(cur_rect.r.h);
+	    cur_rect.encoding = Swap32IfLE(cur_rect.encoding);
+	    rect_x = rect_y = 0;
+	    SoftCursorLockArea(cur_rect.r.x, cur_rect.r.y, cur_rect.r.w, cur_rect.r.h); 
+	    /* H.264 rects are decoded in the background, put them on the
+	     * screen before anything else is drawn */
+	    if (cur_rect.encoding != rfbEncodingH264)
+	       h264_sync();
+	    /* same for JPEG rects, Tight syncs them itself unless the rect
+	     * is JPEG as well */
+	    if (cur_rect.encoding != rfbEncodingJPEG &&
+		  cur_rect.encoding != rfbEncodingTight)
+	       JpegSync();
+	    parse_state = PARSE_RECT_DATA;
+	    break;
+
+	 case PARSE_RECT_DATA:
+	    if ((have = _have_data(_rect_data_size)) <= 0)
+	       return have ? 0 : RFB_NEED_DATA;
+	    adapt_rect_begin();
+	    if (!(have = _handle_rect()))
+	       return 0;
+	    if (have == RECT_MORE)
+	       break;
+	    rects_left--;
+	    parse_state = PARSE_RECT_HEADER;
+	    break;
+      }
+   }
 }
 
 int
 rfb_update_mouse()
 {
    rfbPointerEventMsg msg;
+   int x, y;
 
    if (mousestate.x < 0) mousestate.x = 0;
    if (mousestate.y < 0) mousestate.y = 0;
@@ -459,8 +992,11 @@ rfb_update_mouse()
    msg.buttonMask = mousestate.buttonmask;
    
    /* scale to server resolution */
-   msg.x = rint(mousestate.x * opt.h_ratio);
-   msg.y = rint(mousestate.y * opt.v_ratio);
+   x = mousestate.x;
+   y = mousestate.y;
+   display->screen_to_canvas(&x, &y);
+   msg.x = rint(x * opt.h_ratio);
+   msg.y = rint(y * opt.v_ratio);
    
    SoftCursorMove(msg.x, msg.y);
    
@@ -482,23 +1018,27 @@ rfb_send_key_event(int key, int down_flag)
    return (write_exact(sock, (char*)&ke, sz_rfbKeyEventMsg));
 }
 
+/*
+ * Draws the next band of rows of a raw rect, see _raw_band_rows().
+ */
 static int
 _handle_raw_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
 {
-   int size;
+   int size, rows;
    char *buf;
-   size = (opt.client.bpp/8 * rectheader.r.w) * rectheader.r.h;
-   buf = malloc(size);
+   rows = _raw_band_rows();
+   size = (opt.client.bpp/8 * rectheader.r.w) * rows;
+   if (!(buf = scratch_get(SCRATCH_DECODE, size))) return 0;
    if (!read_from_rfb_server(sock, buf, size)) return 0;
-   dfb_write_data_to_screen(
+   display->write(
 	 rectheader.r.x, 
-	 rectheader.r.y, 
+	 rectheader.r.y + rect_y, 
 	 rectheader.r.w, 
-	 rectheader.r.h, 
+	 rows, 
 	 buf
 	 );
-   free (buf);
-   return 1;
+   rect_y += rows;
+   return rect_y < rectheader.r.h ? RECT_MORE : RECT_DONE;
 }
 
 static int
@@ -513,7 +1053,7 @@ _handle_copyrect_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
            "cursor lock area" (previously set to destination
            rectangle) to the source rectangle as well. */
    SoftCursorLockArea(src_x, src_y, rectheader.r.w, rectheader.r.h);
-   dfb_copy_rect(
+   display->copy(
 	 Swap16IfLE(src_x),
 	 Swap16IfLE(src_y),
 	 rectheader.r.x,
@@ -528,19 +1068,18 @@ static int
 _handle_rre_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
 {
    rfbRREHeader header;
-   char *colour;
+   char colour[4];
    CARD16 rect[4];
    int i;
    int r=0, g=0, b=0;
 
-   colour = malloc(sizeof(opt.client.bpp/8));
    if (!read_from_rfb_server(sock, (char *)&header, sz_rfbRREHeader)) return 0;
    header.nSubrects = Swap32IfLE(header.nSubrects);
    
    /* draw background rect */
    if (!read_from_rfb_server(sock, colour, opt.client.bpp/8)) return 0;
    rfb_get_rgb_from_data(&r, &g, &b, colour);
-   dfb_draw_rect_with_rgb(
+   display->fill(
 	         rectheader.r.x,
 	         rectheader.r.y,
 	         rectheader.r.w,
@@ -556,7 +1095,7 @@ _handle_rre_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
       rfb_get_rgb_from_data(&r, &g, &b, colour);
       if (!read_from_rfb_server(sock, (char *)&rect, sizeof(rect))) 
 	 return 0;
-      dfb_draw_rect_with_rgb(
+      display->fill(
 	    Swap16IfLE(rect[0]) + rectheader.r.x,
 	    Swap16IfLE(rect[1]) + rectheader.r.y,
 	    Swap16IfLE(rect[2]),
@@ -564,7 +1103,6 @@ _handle_rre_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
 	    r,g,b
 	    );
    }   
-   free (colour);
    return 1;
 }
    
@@ -572,19 +1110,18 @@ static int
 _handle_corre_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
 {
    rfbRREHeader header;
-   char *colour;
+   char colour[4];
    CARD8 rect[4];
    int i;
    int r=0, g=0, b=0;
 
-   colour = malloc(sizeof(opt.client.bpp/8));
    if (!read_from_rfb_server(sock, (char *)&header, sz_rfbRREHeader)) return 0;
    header.nSubrects = Swap32IfLE(header.nSubrects);
    
    /* draw background rect */
    if (!read_from_rfb_server(sock, colour, opt.client.bpp/8)) return 0;
    rfb_get_rgb_from_data(&r, &g, &b, colour);
-   dfb_draw_rect_with_rgb( 
+   display->fill( 
 	 rectheader.r.x, rectheader.r.y, rectheader.r.w, rectheader.r.h, r,g,b);
    
    /* subrect pixel values */
@@ -595,107 +1132,292 @@ _handle_corre_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
       rfb_get_rgb_from_data(&r, &g, &b, colour);
       if (!read_from_rfb_server(sock, (char *)&rect, sizeof(rect))) 
 	 return 0;
-      dfb_draw_rect_with_rgb( rect[0] + rectheader.r.x, 
-	                      rect[1] + rectheader.r.y, 
-			      rect[2], rect[3], r,g,b);
+      display->fill( rect[0] + rectheader.r.x, 
+		     rect[1] + rectheader.r.y, 
+		     rect[2], rect[3], r,g,b);
    }   
-   free (colour);
    return 1;
 }
 
 static int
 _handle_hextile_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
 {
-   int rect_x, rect_y, rect_w,rect_h, i=0,j=0, n;
-   int tile_w = 16, tile_h = 16;
-   int remaining_w, remaining_h;
+   return _handle_hextile_tile(rectheader, 0);
+}
+
+static int
+_handle_zlibhex_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
+{
+   return _handle_hextile_tile(rectheader, 1);
+}
+
+/* the colours carry over from tile to tile of a hextile rect */
+static int hextile_bg_r, hextile_bg_g, hextile_bg_b;
+static int hextile_fg_r, hextile_fg_g, hextile_fg_b;
+
+/* ZlibHex uses two zlib streams, one for raw tiles and one for hextile
+ * encoded tiles. Both live as long as the connection. */
+static z_stream zlibhex_raw_stream;
+static z_stream zlibhex_enc_stream;
+static int zlibhex_raw_inited = 0;
+static int zlibhex_enc_inited = 0;
+
+/* compressed tile data is at most 0xFFFF bytes (CARD16 length) */
+static char zlibhex_buffer[65536];
+/* an inflated hextile tile: bg, fg, count and 255 coloured subrects */
+static char zlibhex_tile[2 * 4 + 1 + 255 * (4 + 2)];
+/* a raw tile, or a single pixel value */
+static char hextile_tile[16 * 16 * 4];
+
+/* when set, tile data is taken from here instead of the socket */
+static char *tile_data = NULL;
+static int tile_data_len = 0;
+
+/*
+ * Consumes the next n bytes of tile data and returns where they are, in the
+ * receive buffer or the inflated ZlibHex tile. They stay valid until the
+ * next read from the server.
+ */
+static char *
+_view_tile_data(unsigned int n)
+{
+   char *data;
+
+   if (!tile_data)
+   {
+      if ((data = peek_from_rfb_server(sock, n)) != NULL)
+	 skip_from_rfb_server(n);
+      return data;
+   }
+
+   if (n > tile_data_len)
+   {
+      fprintf(stderr, "ZlibHex: tile data too short\n");
+      return NULL;
+   }
+   data = tile_data;
+   tile_data += n;
+   tile_data_len -= n;
+   return data;
+}
+
+static int
+_read_tile_data(char *out, unsigned int n)
+{
+   char *data;
+
+   if (!(data = _view_tile_data(n)))
+      return 0;
+   memcpy(out, data, n);
+   return 1;
+}
+
+/*
+ * Reads a CARD16 length and that many bytes of zlib data and inflates them
+ * into out using the given stream. Returns the number of bytes inflated or -1
+ * on error.
+ */
+static int
+_inflate_zlibhex_tile(z_streamp zs, int *inited, char *out, int out_size)
+{
+   CARD16 len;
+   int err;
+
+   if (!read_from_rfb_server(sock, (char*)&len, 2)) return -1;
+   len = Swap16IfLE(len);
+   if (!read_from_rfb_server(sock, zlibhex_buffer, len)) return -1;
+
+   if (!*inited)
+   {
+      zs->zalloc = Z_NULL;
+      zs->zfree = Z_NULL;
+      zs->opaque = Z_NULL;
+      err = inflateInit(zs);
+      if (err != Z_OK)
+      {
+	 fprintf(stderr, "ZlibHex: inflateInit error: %d\n", err);
+	 return -1;
+      }
+      *inited = 1;
+   }
+
+   zs->next_in = (Bytef *)zlibhex_buffer;
+   zs->avail_in = len;
+   zs->next_out = (Bytef *)out;
+   zs->avail_out = out_size;
+
+   err = inflate(zs, Z_SYNC_FLUSH);
+   if (err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR)
+   {
+      fprintf(stderr, "ZlibHex: inflate error: %d, msg: %s\n", err, 
+	    zs->msg ? zs->msg : "");
+      return -1;
+   }
+   if (zs->avail_in > 0)
+   {
+      fprintf(stderr, "ZlibHex: inflate ran out of space!\n");
+      return -1;
+   }
+   return out_size - zs->avail_out;
+}
+
+/*
+ * Decodes the next tile of a hextile or ZlibHex rect, which has arrived
+ * completely. The tiles go row by row, rect_x and rect_y are where the next
+ * one is.
+ */
+static int
+_handle_hextile_tile(rfbFramebufferUpdateRectHeader rectheader, int zlibhex)
+{
+   int tile_x, tile_y, n;
+   int tile_w, tile_h;
    CARD8 subrect_encoding;
    int bpp = opt.client.bpp / 8;
    int nr_subr = 0;		  
+   int subrect_size;
+   char *subrects;
    int x,y,w,h;
    int r=0, g=0, b=0;
-   int fg_r=0, fg_g=0, fg_b=0;
-   int bg_r=0, bg_g=0, bg_b=0;
-   rect_w = remaining_w = rectheader.r.w;
-   rect_h = remaining_h = rectheader.r.h;
-   rect_x = rectheader.r.x;
-   rect_y = rectheader.r.y;
-
-   /* the rect is divided into tiles of width and height 16. Iterate over
-    * those */
-   while ((double)i < (double) rect_h/16)
+
+   if (!rectheader.r.w || rect_y >= rectheader.r.h)
+      return RECT_DONE;
+
+   /* the last tiles in a row or column could be smaller than 16 */
+   tile_w = rectheader.r.w - rect_x < 16 ? rectheader.r.w - rect_x : 16;
+   tile_h = rectheader.r.h - rect_y < 16 ? rectheader.r.h - rect_y : 16;
+   tile_x = rectheader.r.x + rect_x;
+   tile_y = rectheader.r.y + rect_y;
+
+   tile_data = NULL;
+   if (!read_from_rfb_server(sock, (char*)&subrect_encoding, 1)) return 0;
+   /* ZlibHex: the raw pixels come compressed in the raw stream */
+   if (zlibhex && (subrect_encoding & rfbHextileZlibRaw))
    {
-      /* the last tile in a column could be smaller than 16 */
-      if ( (remaining_h -=16) <= 0) tile_h = remaining_h +16;
-	
-      j=0;
-      while ((double)j < (double) rect_w/16)
+      if (_inflate_zlibhex_tile(&zlibhex_raw_stream, &zlibhex_raw_inited,
+	       hextile_tile, bpp*tile_w*tile_h) != bpp*tile_w*tile_h)
+	 return 0;
+      display->write(tile_x, tile_y, tile_w, tile_h, hextile_tile);
+   }
+   /* first, check if the raw bit is set */
+   else if (subrect_encoding & rfbHextileRaw)
+   {
+      if (!read_from_rfb_server(sock, hextile_tile, bpp*tile_w*tile_h)) return 0;
+      display->write(tile_x, tile_y, tile_w, tile_h, hextile_tile);
+   } 
+   else  /* subrect encoding is not raw */
+   {
+      /* ZlibHex: the rest of the tile comes compressed in the encoded
+       * stream, parse it from there */
+      if (zlibhex && (subrect_encoding & rfbHextileZlibHex))
       {
-	 /* the last tile in a row could also be smaller */
-	 if ( (remaining_w -= 16) <= 0 ) tile_w = remaining_w +16;
-	 
-	 if (!read_from_rfb_server(sock, (char*)&subrect_encoding, 1)) return 0;
-	 /* first, check if the raw bit is set */
-	 if (subrect_encoding & rfbHextileRaw)
-	 {
-	    if (!read_from_rfb_server(sock, buffer, bpp*tile_w*tile_h)) return 0;
-	    dfb_write_data_to_screen( 
-		  rect_x+(j*16), rect_y+(i*16), tile_w, tile_h, buffer);
-	 } 
-	 else  /* subrect encoding is not raw */
+	 tile_data_len = _inflate_zlibhex_tile(&zlibhex_enc_stream, 
+	       &zlibhex_enc_inited, zlibhex_tile, sizeof(zlibhex_tile));
+	 if (tile_data_len < 0) return 0;
+	 tile_data = zlibhex_tile;
+      }
+      /* check whether theres a new bg or fg colour specified */
+      if (subrect_encoding & rfbHextileBackgroundSpecified)
+      {
+	 if (!_read_tile_data(hextile_tile, bpp)) return 0;
+	 rfb_get_rgb_from_data(&hextile_bg_r, &hextile_bg_g, &hextile_bg_b,
+	       hextile_tile);
+      }
+      if (subrect_encoding & rfbHextileForegroundSpecified)
+      {
+	 if (!_read_tile_data(hextile_tile, bpp)) return 0;
+	 rfb_get_rgb_from_data(&hextile_fg_r, &hextile_fg_g, &hextile_fg_b,
+	       hextile_tile);
+      }
+      /* fill the background */
+      display->fill(tile_x, tile_y, tile_w, tile_h,
+	    hextile_bg_r, hextile_bg_g, hextile_bg_b);
+
+      if (subrect_encoding & rfbHextileAnySubrects)
+      {
+	 if (!_read_tile_data((char*)&nr_subr, 1)) return 0;
+	 /* all subrects of the tile at once */
+	 subrect_size = subrect_encoding & rfbHextileSubrectsColoured
+	    ? bpp + 2 : 2;
+	 if (!(subrects = _view_tile_data(nr_subr * subrect_size)))
+	    return 0;
+	 for (n=0;n<nr_subr;n++, subrects += subrect_size)
 	 {
-	    /* check whether theres a new bg or fg colour specified */
-	    if (subrect_encoding & rfbHextileBackgroundSpecified)
+	    if (subrect_encoding & rfbHextileSubrectsColoured)
 	    {
-	       if (!read_from_rfb_server(sock, buffer, bpp)) return 0;
-	       rfb_get_rgb_from_data(&bg_r, &bg_g, &bg_b, buffer);
+	       rfb_get_rgb_from_data(&r, &g, &b, subrects);
+	       
+	       x = rfbHextileExtractX( (CARD8) subrects[bpp]);
+	       y = rfbHextileExtractY( (CARD8) subrects[bpp]);
+	       w = rfbHextileExtractW( (CARD8) subrects[bpp+1]);
+	       h = rfbHextileExtractH( (CARD8) subrects[bpp+1]);
+	       display->fill(x + tile_x, y + tile_y, w, h, r,g,b);
 	    }
-	    if (subrect_encoding & rfbHextileForegroundSpecified)
+	    else
 	    {
-	       if (!read_from_rfb_server(sock, buffer, bpp)) return 0;
-	       rfb_get_rgb_from_data(&fg_r, &fg_g, &fg_b, buffer);
-	    }
-	    /* fill the background */
-	    dfb_draw_rect_with_rgb(
-		    rect_x+(j*16), rect_y+(i*16), tile_w, tile_h, bg_r, bg_g, bg_b);
-
-	    if (subrect_encoding & rfbHextileAnySubrects)
-	    {
-	       if (!read_from_rfb_server(sock, (char*)&nr_subr, 1)) return 0;
-	       for (n=0;n<nr_subr;n++)
-	       {
-		  if (subrect_encoding & rfbHextileSubrectsColoured)
-		  {
-		     read_from_rfb_server(sock, buffer, bpp);
-		     rfb_get_rgb_from_data(&r, &g, &b, buffer);
-		     
-		     read_from_rfb_server(sock, buffer, 2);
-		     x = rfbHextileExtractX( (CARD8) *buffer);
-		     y = rfbHextileExtractY( (CARD8) *buffer);
-		     w = rfbHextileExtractW( (CARD8)*(buffer+1));
-		     h = rfbHextileExtractH( (CARD8)*(buffer+1));
-		     dfb_draw_rect_with_rgb(
-			   x+(rect_x+(j*16)), y+(rect_y+(i*16)), w, h, r,g,b);
-		  }
-		  else
-		  {
-		     read_from_rfb_server(sock, buffer, 2);
-		     x = rfbHextileExtractX( (CARD8) *buffer);
-		     y = rfbHextileExtractY( (CARD8) *buffer);
-		     w = rfbHextileExtractW( (CARD8)* (buffer+1));
-		     h = rfbHextileExtractH( (CARD8)* (buffer+1));
-		     dfb_draw_rect_with_rgb(
-			   x+(rect_x+(j*16)), y+(rect_y+(i*16)), w, h, fg_r,fg_g,fg_b);
-		  }
-	       }
+	       x = rfbHextileExtractX( (CARD8) subrects[0]);
+	       y = rfbHextileExtractY( (CARD8) subrects[0]);
+	       w = rfbHextileExtractW( (CARD8) subrects[1]);
+	       h = rfbHextileExtractH( (CARD8) subrects[1]);
+	       display->fill(x + tile_x, y + tile_y, w, h,
+		     hextile_fg_r, hextile_fg_g, hextile_fg_b);
 	    }
 	 }
-	 j++;
       }
-      remaining_w = rectheader.r.w;
-      tile_w = 16; /* reset for next row */
-      i++;
-   }	
+   }
+   tile_data = NULL;
+
+   if ((rect_x += 16) >= rectheader.r.w)
+   {
+      rect_x = 0;
+      rect_y += 16;
+   }
+   return rect_y < rectheader.r.h ? RECT_MORE : RECT_DONE;
+}
+
+/*
+ * The server has been resized. The part of the old framebuffer that is still
+ * there stays on the screen, only the newly exposed area is requested.
+ */
+static void
+_resize_framebuffer(int width, int height)
+{
+   if (width == opt.server.width && height == opt.server.height)
+      return;
+   fprintf(stderr, "Server resized to %dx%d\n", width, height);
+   display->set_server_size(width, height);
+
+   /* what we have kept is what we had inside the new bounds */
+   if (area_x + area_w > width)
+      area_w = width > area_x ? width - area_x : 0;
+   if (area_y + area_h > height)
+      area_h = height > area_y ? height - area_y : 0;
+   _request_exposed();
+}
+
+static int
+_handle_desktop_size_message(rfbFramebufferUpdateRectHeader rectheader)
+{
+   _resize_framebuffer(rectheader.r.w, rectheader.r.h);
+   return 1;
+}
+
+static int
+_handle_extended_desktop_size_message(rfbFramebufferUpdateRectHeader rectheader)
+{
+   rfbExtDesktopSizeMsg eds;
+   rfbExtDesktopScreen screen;
+   int i;
+
+   if (!read_from_rfb_server(sock, (char*)&eds, sz_rfbExtDesktopSizeMsg))
+      return 0;
+   /* we show the framebuffer as a whole, the screen layout does not matter */
+   for (i = 0; i < eds.numberOfScreens; i++)
+      if (!read_from_rfb_server(sock, (char*)&screen, sz_rfbExtDesktopScreen))
+	 return 0;
+
+   /* r.y is the status of a SetDesktopSize request, which we never send */
+   if (rectheader.r.y == 0)
+      _resize_framebuffer(rectheader.r.w, rectheader.r.h);
    return 1;
 }
 
@@ -705,27 +1427,79 @@ _handle_richcursor_message(rfbFramebufferUpdateRectHeader rectheader)
   return HandleRichCursor(rectheader.r.x, rectheader.r.y, rectheader.r.w, rectheader.r.h); 
 }
 
-void
-rfb_get_rgb_from_data(int *r, int *g, int *b, char *data)
+#define BPP 8
+#include "rfbbpp.h"
+#undef BPP
+#define BPP 16
+#include "rfbbpp.h"
+#undef BPP
+#define BPP 32
+#include "rfbbpp.h"
+#undef BPP
+
+static void
+rfb_get_rgb_from_colourmap(int *r, int *g, int *b, char *data)
 {
-   CARD16 foo16;
+   CARD8 *colour = colourmap[*(CARD8 *)data];
+
+   *r = colour[0];
+   *g = colour[1];
+   *b = colour[2];
+}
 
+/*
+ * Reads count colour map entries starting at first. They go into the
+ * screen lookup table; whatever is on the screen already was drawn with the
+ * old colours, so it is fetched again.
+ */
+static int
+_handle_colourmap_entries(int first, int count)
+{
+   CARD16 rgb[3];
+   int i;
+
+   for (i = first; i < first + count; i++)
+   {
+      if (!read_from_rfb_server(sock, (char *)rgb, 6))
+	 return 0;
+      if (i > 255)
+	 continue;
+      colourmap[i][0] = Swap16IfLE(rgb[0]) >> 8;
+      colourmap[i][1] = Swap16IfLE(rgb[1]) >> 8;
+      colourmap[i][2] = Swap16IfLE(rgb[2]) >> 8;
+      display->set_lut_entry(i, colourmap[i][0], colourmap[i][1], colourmap[i][2]);
+   }
+   if (updates_seen)
+      rfb_send_update_request(0);
+   return 1;
+}
+
+void (*rfb_get_rgb_from_data)(int *r, int *g, int *b, char *data);
+
+/*
+ * Picks the pixel size specific decoders for the client pixel format, so
+ * none of them has to look at opt.client.bpp while drawing.
+ */
+static int
+_select_decoders(void)
+{
    switch (opt.client.bpp)
    {
       case 8:
-	 printf("FIXME unimplemented\n");	 
+	 if (opt.client.truecolour)
+	    rfb_get_rgb_from_data = rfb_get_rgb_from_data8;
+	 else
+	    rfb_get_rgb_from_data = rfb_get_rgb_from_colourmap;
 	 break;
       case 16:
-	 memcpy(&foo16, data, 2);
-	 *r = (( foo16 >> opt.client.redshift ) & opt.client.redmax) <<3;
- 	 *g = (( foo16 >> opt.client.greenshift ) & opt.client.greenmax)<<2;
- 	 *b = (( foo16 >> opt.client.blueshift ) & opt.client.bluemax)<<3;
+	 rfb_get_rgb_from_data = rfb_get_rgb_from_data16;
 	 break;
-      case 24:
       case 32:
-         *r=data[2]&0x00FF;
-	 *g=data[1]&0x00FF;
-	 *b=data[0]&0x00FF;
+	 rfb_get_rgb_from_data = rfb_get_rgb_from_data32;
 	 break;
+      default:
+	 fprintf(stderr, "%d bpp is not supported.\n", opt.client.bpp);
+	 return 0;
    }
+   return SelectTightDecoders() && SelectJpegDecoders();
 }
@@ -0,0 +1,47 @@
+/* 
+ * Copyright (C) 2001  Till Adam
+ * Authors: Till Adam <till@adam-lilienthal.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, a copy can be downloaded from 
+ * http://www.gnu.org/licenses/gpl.html, or obtained by writing to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, 
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * rfbbpp.h - splitting client pixels into their colour components.
+ *
+ * This file is included from rfb.c once for every BPP of 8, 16 and 32.
+ * Components are scaled up to 0..255 for display->fill().
+ */
+
+#define CARDBPP CONCAT2E(CARD,BPP)
+#define rfb_get_rgb_from_dataBPP CONCAT2E(rfb_get_rgb_from_data,BPP)
+
+static void
+rfb_get_rgb_from_dataBPP(int *r, int *g, int *b, char *data)
+{
+   CARDBPP pixel;
+
+   memcpy(&pixel, data, sizeof(pixel));
+   *r = ((pixel >> opt.client.redshift) & opt.client.redmax) * 255
+      / opt.client.redmax;
+   *g = ((pixel >> opt.client.greenshift) & opt.client.greenmax) * 255
+      / opt.client.greenmax;
+   *b = ((pixel >> opt.client.blueshift) & opt.client.bluemax) * 255
+      / opt.client.bluemax;
+}
+
+#undef CARDBPP
+#undef rfb_get_rgb_from_dataBPP
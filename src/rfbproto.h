@@ -278,6 +278,10 @@ typedef struct {
 #define rfbPointerEvent 5
 #define rfbClientCutText 6
 
+/* UltraVNC and PalmVNC extensions */
+#define rfbSetScale 8
+#define rfbPalmVNCSetScaleFactor 0xF
+
 
 
 
@@ -295,6 +299,8 @@ typedef struct {
 #define rfbEncodingZlib 6
 #define rfbEncodingTight 7
 #define rfbEncodingZlibHex 8
+#define rfbEncodingJPEG 21
+#define rfbEncodingH264 50
 
 /*
  * Special encoding numbers:
@@ -321,6 +327,9 @@ typedef struct {
 #define rfbEncodingRichCursor      0xFFFFFF11
 
 #define rfbEncodingLastRect        0xFFFFFF20
+#define rfbEncodingNewFBSize       0xFFFFFF21   /* DesktopSize, -223 */
+
+#define rfbEncodingExtDesktopSize  0xFFFFFECC   /* -308 */
 
 #define rfbEncodingQualityLevel0   0xFFFFFFE0
 #define rfbEncodingQualityLevel1   0xFFFFFFE1
@@ -479,6 +488,40 @@ typedef struct {
 #define rfbHextileExtractH(byte) (((byte) & 0xf) + 1)
 
 
+/*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * ZlibHex Encoding.  Same tile layout as Hextile, with two additional
+ * subencoding bits.  If ZlibRaw is set, a CARD16 length follows and then
+ * that many bytes of zlib data which inflate to the raw tile pixels.  If
+ * ZlibHex is set, the CARD16 length and zlib data inflate to the rest of an
+ * ordinary hextile tile (background, foreground, subrects) as selected by
+ * the other bits.  Raw tiles and encoded tiles use two separate zlib streams
+ * which persist for the whole session.
+ */
+
+#define rfbHextileZlibRaw		(1 << 5)
+#define rfbHextileZlibHex		(1 << 6)
+#define rfbHextileZlibMono		(1 << 7)
+
+
+/*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Open H.264 Encoding.  We have an rfbH264Header structure giving the number
+ * of bytes following and a set of flags, then that many bytes of H.264 NAL
+ * units.  Each distinct rectangle (position and size) has its own decoder
+ * context; the flags ask the client to reset that context or all of them
+ * before decoding.
+ */
+
+typedef struct {
+    CARD32 length;
+    CARD32 flags;
+} rfbH264Header;
+
+#define sz_rfbH264Header 8
+
+#define rfbH264ResetContext		(1 << 0)
+#define rfbH264ResetAllContexts		(1 << 1)
+
+
 /*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * zlib - zlib compressed Encoding.  We have an rfbZlibHeader structure
  * giving the number of bytes following.  Finally the data follows is
@@ -552,6 +595,34 @@ typedef struct {
  */
 
 
+/*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * DesktopSize and ExtendedDesktopSize pseudo encodings. The server tells the
+ * client about a new framebuffer size with a rectangle whose r.w and r.h hold
+ * the new size. DesktopSize has no data. For ExtendedDesktopSize, r.x is the
+ * reason for the change and r.y the status of a SetDesktopSize request, and
+ * an rfbExtDesktopSizeMsg follows with the number of rfbExtDesktopScreen
+ * structures after it.
+ */
+
+typedef struct {
+    CARD8 numberOfScreens;
+    CARD8 pad[3];
+} rfbExtDesktopSizeMsg;
+
+#define sz_rfbExtDesktopSizeMsg 4
+
+typedef struct {
+    CARD32 id;
+    CARD16 x;
+    CARD16 y;
+    CARD16 width;
+    CARD16 height;
+    CARD32 flags;
+} rfbExtDesktopScreen;
+
+#define sz_rfbExtDesktopScreen 16
+
+
 /*-----------------------------------------------------------------------------
  * SetColourMapEntries - these messages are only sent if the pixel
  * format uses a "colour map" (i.e. trueColour false) and the client has not
@@ -770,6 +841,22 @@ typedef struct {
 
 
 
+/*-----------------------------------------------------------------------------
+ * SetScale - UltraVNC extension. The server scales its framebuffer down to
+ * 1/scale and announces the new size with a NewFBSize rect. Pointer events
+ * are then in scaled coordinates.
+ */
+
+typedef struct {
+    CARD8 type;			/* always rfbSetScale */
+    CARD8 scale;
+    CARD16 pad;
+} rfbSetScaleMsg;
+
+#define sz_rfbSetScaleMsg 4
+
+
+
 /*-----------------------------------------------------------------------------
  * Union of all client->server messages.
  */
@@ -783,4 +870,5 @@ typedef union {
     rfbKeyEventMsg ke;
     rfbPointerEventMsg pe;
     rfbClientCutTextMsg cct;
+    rfbSetScaleMsg ssc;
 } rfbClientToServerMsg;
@@ -30,18 +30,309 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <sys/select.h>
 #include <memory.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include "directvnc.h"
+#include "adapt.h"
+#include "uring.h"
+#include "record.h"
 
 void PrintInHex(char *buf, int len);
 
 int errorMessageOnReadFailure = 1;
 
-#define BUF_SIZE 8192
-static char buf[BUF_SIZE];
-static char *bufoutptr = buf;
-static int buffered = 0;
+/*
+ * Receive buffer. Data is read in as large chunks as the socket has, and
+ * handed out from [bufoutptr, bufoutptr + buffered). When a request for
+ * contiguous bytes does not fit behind the end anymore, the rest is moved to
+ * the front, so views into the buffer are always contiguous. Its size is
+ * opt.recv_buffer KB and the kernel socket buffer is set to match, see
+ * rfb_connect_to_server(). A part of a message that is larger makes it grow
+ * for as long as the part takes to come in, see expect_from_rfb_server().
+ */
+static char *buf = NULL;
+static unsigned int bufsize = 0;
+static char *bufoutptr = NULL;
+static unsigned int buffered = 0;
+
+/*
+ * The socket calls, through io_uring if that is set up (see uring.c).
+ */
+static ssize_t
+_sock_read(int sock, char *out, size_t n)
+{
+   if (uring_active())
+      return uring_recv(out, n);
+   return read(sock, out, n);
+}
+
+static ssize_t
+_sock_send(int sock, char *data, size_t n)
+{
+   if (uring_active())
+      return uring_send(data, n);
+   return send(sock, data, n, MSG_NOSIGNAL);
+}
+
+/*
+ * Waits up to milliseconds for the socket to become readable. Returns 1 if
+ * it is, 0 on timeout and -1 on error.
+ */
+static int
+_sock_wait(int sock, int milliseconds)
+{
+   fd_set fds;
+   struct timeval tv;
+   int ret;
+
+   if (uring_active())
+      return uring_wait(milliseconds);
+
+   FD_ZERO(&fds);
+   FD_SET(sock, &fds);
+   tv.tv_sec = milliseconds / 1000;
+   tv.tv_usec = (milliseconds % 1000) * 1000;
+   ret = select(sock + 1, &fds, NULL, NULL, &tv);
+   if (ret < 0 && errno == EINTR)
+      return 0;
+   return ret < 0 ? -1 : FD_ISSET(sock, &fds);
+}
+
+static void
+_server_closed(int sock)
+{
+   if (errorMessageOnReadFailure)
+   {
+      fprintf(stderr, "%s: VNC server closed connection\n",
+              "DIRECTVNC");
+   }
+   close(sock);
+   display->deinit();
+   exit (-1);
+}
+
+/*
+ * Reads at most n bytes into out, waiting for at least one. Only the
+ * handshake waits here, once the session runs the message parser never asks
+ * for more than has arrived, and input is handled by the main loop while it
+ * waits. Returns the number of bytes read or 0 on error.
+ */
+static int
+_read_some(int sock, char *out, unsigned int n)
+{
+   int i;
+
+   while (1)
+   {
+      /* whatever we have to say must be out before we wait for the reply */
+      if (!flush_output(sock))
+         return 0;
+      i = _sock_read(sock, out, n);
+      if (i > 0)
+      {
+         adapt_bytes += i;
+         if (opt.record_file)
+            record_data(out, i);
+         return i;
+      }
+      if (i == 0)
+         _server_closed(sock);
+      if (errno == EWOULDBLOCK || errno == EAGAIN)
+      {
+         long waited = opt.adaptive ? adapt_now() : 0;
+
+         if (_sock_wait(sock, 10) < 0)
+         {
+            fprintf(stderr, "DIRECTVNC");
+            perror(": wait");
+            return 0;
+         }
+         if (opt.adaptive)
+            adapt_wait_usec += adapt_now() - waited;
+      }
+      else if (errno != EINTR)
+      {
+         fprintf(stderr, "DIRECTVNC");
+         perror(": read");
+         return 0;
+      }
+   }
+}
+
+static int
+_alloc_buffer(void)
+{
+   bufsize = opt.recv_buffer * 1024;
+   buf = malloc(bufsize);
+   if (!buf)
+   {
+      fprintf(stderr, "Memory allocation error.\n");
+      return 0;
+   }
+   bufoutptr = buf;
+   return 1;
+}
+
+/*
+ * Makes room for the next n bytes from the server behind bufoutptr, growing
+ * the receive buffer if they do not fit. Views into the buffer are invalid
+ * afterwards. Returns 0 on error.
+ */
+int
+expect_from_rfb_server(unsigned int n)
+{
+   unsigned int size;
+   char *p;
+
+   if (!buf && !_alloc_buffer())
+      return 0;
+   if (bufoutptr + n <= buf + bufsize)
+      return 1;
+   if (bufoutptr != buf)
+   {
+      memmove(buf, bufoutptr, buffered);
+      bufoutptr = buf;
+   }
+   if (n <= bufsize)
+      return 1;
+   /* doubling, as the size of a JPEG is found out a byte at a time */
+   for (size = bufsize; size < n; size *= 2)
+      ;
+   if (!(p = realloc(buf, size)))
+   {
+      fprintf(stderr, "DIRECTVNC: no memory for %u bytes of server data\n", size);
+      return 0;
+   }
+   buf = bufoutptr = p;
+   bufsize = size;
+   return 1;
+}
+
+/*
+ * Returns a pointer to the next n bytes from the server without consuming
+ * them, waiting for them if needed, or NULL on error. The bytes stay valid
+ * until the next call of any of the read functions; skip_from_rfb_server()
+ * moves past them.
+ */
+char *
+peek_from_rfb_server(int sock, unsigned int n)
+{
+   int i;
+
+   if (n <= buffered)
+      return bufoutptr;
+
+   if (!expect_from_rfb_server(n))
+      return NULL;
+   while (buffered < n)
+   {
+      i = _read_some(sock, bufoutptr + buffered,
+                     buf + bufsize - bufoutptr - buffered);
+      if (!i)
+         return NULL;
+      buffered += i;
+   }
+   return bufoutptr;
+}
+
+/*
+ * Returns a pointer to the next n bytes if they have arrived already, or
+ * NULL. Never reads from the socket.
+ */
+char *
+buffered_from_rfb_server(unsigned int n)
+{
+   return n <= buffered ? bufoutptr : NULL;
+}
+
+/*
+ * Reads whatever the server has sent into the receive buffer, without
+ * waiting. Views into the buffer are invalid afterwards. Returns 0 on error.
+ */
+int
+fill_from_rfb_server(int sock)
+{
+   int i;
+
+   if (!buf && !_alloc_buffer())
+      return 0;
+   if (bufoutptr + buffered == buf + bufsize)
+   {
+      if (bufoutptr == buf)
+         return 1;      /* full */
+      memmove(buf, bufoutptr, buffered);
+      bufoutptr = buf;
+   }
+
+   if (!flush_output(sock))
+      return 0;
+   i = _sock_read(sock, bufoutptr + buffered, buf + bufsize - bufoutptr - buffered);
+   if (i > 0)
+   {
+      if (opt.record_file)
+         record_data(bufoutptr + buffered, i);
+      buffered += i;
+      adapt_bytes += i;
+      return 1;
+   }
+   if (i == 0)
+      _server_closed(sock);
+   if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR)
+      return 1;
+   fprintf(stderr, "DIRECTVNC");
+   perror(": read");
+   return 0;
+}
+
+/*
+ * Waits up to milliseconds for the server to send something and reads it
+ * into the receive buffer. Returns 0 on error.
+ */
+int
+wait_for_rfb_server(int sock, int milliseconds)
+{
+   long waited = opt.adaptive ? adapt_now() : 0;
+   int ret;
+
+   if (!flush_output(sock))
+      return 0;
+   if ((ret = _sock_wait(sock, milliseconds)) < 0)
+   {
+      fprintf(stderr, "DIRECTVNC");
+      perror(": wait");
+      return 0;
+   }
+   if (opt.adaptive)
+      adapt_wait_usec += adapt_now() - waited;
+   if (!ret)
+      return 1;
+   return fill_from_rfb_server(sock);
+}
+
+/*
+ * Consumes n bytes returned by peek_from_rfb_server(). A receive buffer that
+ * has grown for a large message goes back to its size once it is empty.
+ */
+void
+skip_from_rfb_server(unsigned int n)
+{
+   char *p;
+
+   bufoutptr += n;
+   buffered -= n;
+   adapt_consumed += n;
+   if (buffered)
+      return;
+   if (bufsize > opt.recv_buffer * 1024 &&
+       (p = realloc(buf, opt.recv_buffer * 1024)) != NULL)
+   {
+      buf = p;
+      bufsize = opt.recv_buffer * 1024;
+   }
+   bufoutptr = buf;
+}
 
 /*
  * ReadFromRFBServer is called whenever we want to read some data from the RFB
@@ -52,165 +343,141 @@ static int buffered = 0;
  *    copies the data out of an internal buffer.  For large amounts of data it
  *    reads directly into the buffer provided by the caller.
  *
- * 2. Whenever read() would block, it invokes the Xt event dispatching
- *    mechanism to process X events.  In fact, this is the only place these
- *    events are processed, as there is no XtAppMainLoop in the program.
+ * 2. Whenever read() would block, it waits for the socket without handling
+ *    any input.  Once the session runs, rfb_handle_server_message() only
+ *    reads what has arrived, so this happens during the handshake only.
  */
 
-
 int
 read_from_rfb_server(int sock, char *out, unsigned int n)
 {
-   if (n <= buffered)
+   char *data;
+   int i;
+
+   if (!buf && !_alloc_buffer())
+      return 0;
+   if (n <= buffered || n <= bufsize / 2)
    {
-      memcpy(out, bufoutptr, n);
-      bufoutptr += n;
-      buffered -= n;
+      if (!(data = peek_from_rfb_server(sock, n)))
+         return 0;
+      memcpy(out, data, n);
+      skip_from_rfb_server(n);
       return 1;
    }
 
+   /* large reads go straight to the caller */
    memcpy(out, bufoutptr, buffered);
    out += buffered;
    n -= buffered;
+   skip_from_rfb_server(buffered);
+   adapt_consumed += n;
 
-   bufoutptr = buf;
-   buffered = 0;
-
-   if (n <= BUF_SIZE)
+   while (n > 0)
    {
+      if (!(i = _read_some(sock, out, n)))
+         return 0;
+      out += i;
+      n -= i;
+   }
+   return 1;
+}
 
-      while (buffered < n)
-      {
-         int i = read(sock, buf + buffered, BUF_SIZE - buffered);
 
-         if (i <= 0)
-         {
-            if (i < 0)
-            {
-               if (errno == EWOULDBLOCK || errno == EAGAIN)
-               {
-                  dfb_process_events();
-                  usleep(10000);
-                  i = 0;
-               }
-               else
-               {
-                  fprintf(stderr, "DIRECTVNC");
-                  perror(": read");
-                  return -1;
-               }
-            }
-            else
-            {
-               if (errorMessageOnReadFailure)
-               {
-                  fprintf(stderr, "%s: VNC server closed connection\n",
-                          "DIRECTVNC");
-               }
-	       close(sock);
-	       dfb_deinit();
-	       exit (-1);
-            }
-         }
-         buffered += i;
-      }
+/*
+ * Messages to the server are not written one by one, but collected in an
+ * output queue that flush_output() sends with as few send() calls as the
+ * socket allows. The socket is non-blocking and stays that way: whatever
+ * does not fit is kept for the next flush, so a congested uplink never stops
+ * us from decoding or handling input.
+ */
 
-      memcpy(out, bufoutptr, n);
-      bufoutptr += n;
-      buffered -= n;
-      return 1;
+static char *outbuf = NULL;
+static unsigned int outlen = 0, outsize = 0;
 
-   }
-   else
+/*
+ * Queues n bytes for the server. They are sent with the next flush_output(),
+ * which happens at the latest when we wait for the server.
+ */
+
+int
+write_exact(int sock, char *buf, unsigned int n)
+{
+   if (outlen + n > outsize)
    {
+      unsigned int size = outsize ? outsize : 4096;
+      char *p;
 
-      while (n > 0)
+      while (size < outlen + n)
+         size *= 2;
+      p = realloc(outbuf, size);
+      if (!p)
       {
-         int i = read(sock, out, n);
-
-         if (i <= 0)
-         {
-            if (i < 0)
-            {
-               if (errno == EWOULDBLOCK || errno == EAGAIN)
-               {
-                  dfb_process_events();
-                  usleep(10000);
-                  i = 0;
-               }
-               else
-               {
-                  fprintf(stderr, "DIRECTVNC");
-                  perror(": read");
-                  return -1;
-               }
-            }
-            else
-            {
-               if (errorMessageOnReadFailure)
-               {
-                  fprintf(stderr, "%s: VNC server closed connection\n",
-                          "DIRECTVNC");
-               }
-	       close(sock);
-	       dfb_deinit();
-	       exit (-1);
-            }
-         }
-         out += i;
-         n -= i;
+         fprintf(stderr, "Memory allocation error.\n");
+         return 0;
       }
+      outbuf = p;
+      outsize = size;
+   }
+   memcpy(outbuf + outlen, buf, n);
+   outlen += n;
+   return 1;
+}
 
-      return 1;
+
+/*
+ * Sends as much of the output queue as the socket takes without blocking.
+ * Returns 0 if the connection is broken.
+ */
+
+int
+flush_output(int sock)
+{
+   int j;
+
+   while (outlen > 0)
+   {
+      j = _sock_send(sock, outbuf, outlen);
+      if (j < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         if (errno == EWOULDBLOCK || errno == EAGAIN)
+            return 1;
+         fprintf(stderr, "DIRECTVNC");
+         perror(": write");
+         return 0;
+      }
+      outlen -= j;
+      memmove(outbuf, outbuf + j, outlen);
    }
+   return 1;
 }
 
 
 /*
- * Write an exact number of bytes, and don't return until you've sent them.
+ * Waits until the output queue is empty, for the few places that must not
+ * go on before the server has got everything, like quitting.
  */
 
 int
-write_exact(int sock, char *buf, unsigned int n)
+flush_output_wait(int sock)
 {
    fd_set fds;
-   int i = 0;
-   int j;
 
-   while (i < n)
+   while (outlen > 0)
    {
-      j = write(sock, buf + i, (n - i));
-      if (j <= 0)
+      if (!flush_output(sock))
+         return 0;
+      if (outlen == 0)
+         break;
+      FD_ZERO(&fds);
+      FD_SET(sock, &fds);
+      if (select(sock + 1, NULL, &fds, NULL, NULL) < 0 && errno != EINTR)
       {
-         if (j < 0)
-         {
-            if (errno == EWOULDBLOCK || errno == EAGAIN)
-            {
-               FD_ZERO(&fds);
-               FD_SET(sock, &fds);
-
-               if (select(sock + 1, NULL, &fds, NULL, NULL) <= 0)
-               {
-                  fprintf(stderr, "DIRECTVNC");
-                  perror(": select");
-                  return -1;
-               }
-               j = 0;
-            }
-            else
-            {
-               fprintf(stderr, "DIRECTVNC");
-               perror(": write");
-               return -1;
-            }
-         }
-         else
-         {
-            fprintf(stderr, "%s: write failed\n", "DIRECTVNC");
-            return -1;
-         }
+         fprintf(stderr, "DIRECTVNC");
+         perror(": select");
+         return 0;
       }
-      i += j;
    }
    return 1;
 }
@@ -0,0 +1,2232 @@
+/*
+ * Copyright (C) 2001  Till Adam
+ * Authors: Till Adam <till@adam-lilienthal.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, a copy can be downloaded from
+ * http://www.gnu.org/licenses/gpl.html, or obtained by writing to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * testserver.c - a VNC server with made up screen contents, to measure
+ * clients against.
+ *
+ * It speaks RFB 3.3 to 3.8 with no or VNC authentication, takes any pixel
+ * format (true colour or with a colour map) and sends updates in raw,
+ * CopyRect, RRE, Hextile, Zlib, Tight or H.264 encoding, whichever the
+ * client prefers, Tight with all its subencodings: fill, the copy, palette
+ * and gradient filters and JPEG. H.264 sends the whole screen as an IDR
+ * picture whenever anything changed. The cursor shape goes out as
+ * RichCursor.
+ *
+ * The screen shows one of these workloads, advanced at a target rate:
+ *
+ *   text    a terminal scrolling up a line every frame
+ *   noise   video-like: the whole screen changes every frame
+ *   drag    a window being dragged around over the desktop
+ *
+ * The server keeps a copy of what the client has seen. When the client asks
+ * for an update, the screen is compared with that copy in tiles, and
+ * whatever differs is sent, after a CopyRect for the scrolling or moving
+ * parts. A client too slow for the rate gets fewer, larger updates, like
+ * from a real server. Every 5 seconds the frame and update rates, the data
+ * rate and the time between sending an update and the next request (the
+ * client's decoding time plus the round trip) are printed.
+ *
+ * Every client gets a process of its own.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include <X11/Xmd.h>
+#include <jpeglib.h>
+#include "rfbproto.h"
+#include "vncauth.h"
+#include "getopt.h"
+
+/* size of the tiles the screen is compared in */
+#define TILE_SIZE 16
+
+#define STATS_INTERVAL_USEC 5000000
+
+#define TIGHT_MAX_WIDTH 2048
+#define TIGHT_MAX_PIXELS 65536
+#define TIGHT_MIN_TO_COMPRESS 12
+#define TIGHT_MAX_PALETTE 64
+#define TIGHT_MIN_JPEG_SIZE 8
+
+/* shadow pixels that never match a screen pixel, to force sending them */
+#define INVALID_PIXEL 0xFF000000
+
+struct settings
+{
+   int display;
+   int width;
+   int height;
+   char *workload;
+   int rate;
+   char *password;
+   int time;
+   int once;
+};
+
+static struct settings settings = { 1, 1024, 768, "text", 30, NULL, 0, 0 };
+
+/* what the client asked for */
+static struct
+{
+   int bpp;
+   int depth;
+   int bigendian;
+   int truecolour;
+   int redmax, greenmax, bluemax;
+   int redshift, greenshift, blueshift;
+} fmt;
+static int bytes_pp;
+static int cut_zeros;          /* Tight sends 32 bit pixels as 3 bytes */
+static CARD32 encoding = rfbEncodingRaw;
+static int use_copyrect, use_richcursor;
+static int compress_level = 6;
+static int quality = -1;       /* no JPEG */
+
+/* the screen, 0x00RRGGBB, and what the client has of it */
+static CARD32 *fb, *shadow;
+static int width, height;
+
+/* a pending CopyRect */
+static struct
+{
+   int valid;
+   int sx, sy, dx, dy, w, h;
+} copy;
+
+static int request_pending, req_x, req_y, req_w, req_h;
+static int cursor_pending, colourmap_pending;
+
+static int sock;
+static unsigned int frame = 0;
+
+/* the update being put together */
+static unsigned char *out;
+static size_t out_len, out_size;
+static int out_rects;
+
+static struct
+{
+   long frames, updates, rects;
+   unsigned long bytes;
+   long rtt_sum, rtt_max, rtt_count;
+} stats;
+static long update_sent;       /* when the last update went out, or 0 */
+
+static unsigned int seed = 1;
+
+static long
+_now(void)
+{
+   struct timeval tv;
+
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+static unsigned int
+_random(void)
+{
+   seed ^= seed << 13;
+   seed ^= seed >> 17;
+   seed ^= seed << 5;
+   return seed;
+}
+
+static void *
+_alloc(size_t n)
+{
+   void *p = malloc(n);
+
+   if (!p)
+   {
+      fprintf(stderr, "Memory allocation error.\n");
+      exit(1);
+   }
+   return p;
+}
+
+/*
+ * Output
+ */
+
+static unsigned char *
+_out_reserve(size_t n)
+{
+   if (out_len + n > out_size)
+   {
+      out_size = out_size ? out_size : 65536;
+      while (out_len + n > out_size)
+	 out_size *= 2;
+      if (!(out = realloc(out, out_size)))
+      {
+	 fprintf(stderr, "Memory allocation error.\n");
+	 exit(1);
+      }
+   }
+   return out + out_len;
+}
+
+static void
+_out8(int v)
+{
+   *_out_reserve(1) = v;
+   out_len++;
+}
+
+static void
+_out16(int v)
+{
+   unsigned char *p = _out_reserve(2);
+
+   p[0] = v >> 8;
+   p[1] = v;
+   out_len += 2;
+}
+
+static void
+_out32(CARD32 v)
+{
+   unsigned char *p = _out_reserve(4);
+
+   p[0] = v >> 24;
+   p[1] = v >> 16;
+   p[2] = v >> 8;
+   p[3] = v;
+   out_len += 4;
+}
+
+static void
+_out_bytes(const void *data, size_t n)
+{
+   memcpy(_out_reserve(n), data, n);
+   out_len += n;
+}
+
+/* Sends what has been put together, returns 0 if the client is gone. */
+static int
+_out_flush(void)
+{
+   size_t done = 0;
+   ssize_t n;
+
+   while (done < out_len)
+   {
+      n = send(sock, out + done, out_len - done, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+	 continue;
+      if (n <= 0)
+	 return 0;
+      done += n;
+   }
+   stats.bytes += out_len;
+   out_len = 0;
+   return 1;
+}
+
+static int
+_read_exact(void *buf, size_t n)
+{
+   char *p = buf;
+   ssize_t i;
+
+   while (n > 0)
+   {
+      i = read(sock, p, n);
+      if (i < 0 && errno == EINTR)
+	 continue;
+      if (i <= 0)
+	 return 0;
+      p += i;
+      n -= i;
+   }
+   return 1;
+}
+
+static int
+_get16(unsigned char *p)
+{
+   return p[0] << 8 | p[1];
+}
+
+static CARD32
+_get32(unsigned char *p)
+{
+   return (CARD32)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/*
+ * Pixels
+ */
+
+/* the client pixel value for 0x00RRGGBB */
+static CARD32
+_pixel(CARD32 rgb)
+{
+   int r = rgb >> 16 & 0xFF, g = rgb >> 8 & 0xFF, b = rgb & 0xFF;
+
+   /* the colour map is a 3-3-2 colour cube, see _send_colourmap() */
+   if (!fmt.truecolour)
+      return (r >> 5) << 5 | (g >> 5) << 2 | b >> 6;
+   return (CARD32)((r * fmt.redmax + 127) / 255) << fmt.redshift
+      | (CARD32)((g * fmt.greenmax + 127) / 255) << fmt.greenshift
+      | (CARD32)((b * fmt.bluemax + 127) / 255) << fmt.blueshift;
+}
+
+static unsigned char *
+_put_pixel(unsigned char *dst, CARD32 pix)
+{
+   switch (bytes_pp)
+   {
+      case 1:
+	 dst[0] = pix;
+	 break;
+      case 2:
+	 dst[fmt.bigendian ? 1 : 0] = pix;
+	 dst[fmt.bigendian ? 0 : 1] = pix >> 8;
+	 break;
+      default:
+	 if (fmt.bigendian)
+	 {
+	    dst[0] = pix >> 24;
+	    dst[1] = pix >> 16;
+	    dst[2] = pix >> 8;
+	    dst[3] = pix;
+	 }
+	 else
+	 {
+	    dst[0] = pix;
+	    dst[1] = pix >> 8;
+	    dst[2] = pix >> 16;
+	    dst[3] = pix >> 24;
+	 }
+	 break;
+   }
+   return dst + bytes_pp;
+}
+
+static void
+_out_pixel(CARD32 pix)
+{
+   _put_pixel(_out_reserve(4), pix);
+   out_len += bytes_pp;
+}
+
+/* a Tight pixel, 3 bytes R, G, B for 32 bit pixels of depth 24 */
+static unsigned char *
+_put_tpixel(unsigned char *dst, CARD32 pix)
+{
+   if (!cut_zeros)
+      return _put_pixel(dst, pix);
+   dst[0] = pix >> fmt.redshift;
+   dst[1] = pix >> fmt.greenshift;
+   dst[2] = pix >> fmt.blueshift;
+   return dst + 3;
+}
+
+static void
+_out_tpixel(CARD32 pix)
+{
+   out_len = _put_tpixel(_out_reserve(4), pix) - out;
+}
+
+/* The client pixels of a rect, w * h of them. */
+static CARD32 *
+_translate(int x, int y, int w, int h)
+{
+   static CARD32 *pix = NULL;
+   static size_t size = 0;
+   CARD32 *src, *dst, last_rgb = 0, last = _pixel(0);
+   int i, j;
+
+   if ((size_t)w * h > size)
+   {
+      free(pix);
+      size = (size_t)w * h;
+      pix = _alloc(size * sizeof(CARD32));
+   }
+   dst = pix;
+   for (i = 0; i < h; i++)
+   {
+      src = fb + (y + i) * width + x;
+      for (j = 0; j < w; j++)
+      {
+	 /* neighbours mostly have the same colour */
+	 if (src[j] != last_rgb)
+	 {
+	    last_rgb = src[j];
+	    last = _pixel(last_rgb);
+	 }
+	 *dst++ = last;
+      }
+   }
+   return pix;
+}
+
+static void
+_out_pixels(CARD32 *pix, int n)
+{
+   unsigned char *dst = _out_reserve((size_t)n * bytes_pp);
+   int i;
+
+   for (i = 0; i < n; i++)
+      dst = _put_pixel(dst, pix[i]);
+   out_len += (size_t)n * bytes_pp;
+}
+
+/*
+ * Counts the colours in n pixels, up to max. Returns their number, or max + 1
+ * if there are more.
+ */
+static int
+_palette(CARD32 *pix, int n, CARD32 *palette, int max)
+{
+   int i, j, colours = 0;
+
+   for (i = 0; i < n; i++)
+   {
+      if (i && pix[i] == pix[i - 1])
+	 continue;
+      for (j = 0; j < colours; j++)
+	 if (palette[j] == pix[i])
+	    break;
+      if (j < colours)
+	 continue;
+      if (colours == max)
+	 return max + 1;
+      palette[colours++] = pix[i];
+   }
+   return colours;
+}
+
+/* The most frequent colour among the first 64 different ones. */
+static CARD32
+_background(CARD32 *pix, int n)
+{
+   CARD32 colours[64];
+   int counts[64], num = 0, best = 0, i, j;
+
+   for (i = 0; i < n; i++)
+   {
+      for (j = 0; j < num; j++)
+	 if (colours[j] == pix[i])
+	    break;
+      if (j == num)
+      {
+	 if (num == 64)
+	    continue;
+	 colours[num] = pix[i];
+	 counts[num++] = 0;
+      }
+      if (++counts[j] > counts[best])
+	 best = j;
+   }
+   return colours[best];
+}
+
+struct subrect
+{
+   CARD32 pixel;
+   int x, y, w, h;
+};
+
+/*
+ * Covers the pixels of a w x h block that are not bg with single coloured
+ * rects, each as wide and then as high as it goes. Returns their number, or
+ * -1 if there would be more than max.
+ */
+static int
+_subrects(CARD32 *pix, int w, int h, CARD32 bg, struct subrect *rects, int max)
+{
+   static char *covered = NULL;
+   static int size = 0;
+   CARD32 c;
+   int n = 0, x, y, i, j, rw, rh;
+
+   if (w * h > size)
+   {
+      free(covered);
+      size = w * h;
+      covered = _alloc(size);
+   }
+   memset(covered, 0, w * h);
+
+   for (y = 0; y < h; y++)
+   {
+      for (x = 0; x < w; x++)
+      {
+	 c = pix[y * w + x];
+	 if (c == bg || covered[y * w + x])
+	    continue;
+	 if (n == max)
+	    return -1;
+	 for (rw = 1; x + rw < w; rw++)
+	    if (pix[y * w + x + rw] != c || covered[y * w + x + rw])
+	       break;
+	 for (rh = 1; y + rh < h; rh++)
+	 {
+	    for (i = 0; i < rw; i++)
+	       if (pix[(y + rh) * w + x + i] != c || covered[(y + rh) * w + x + i])
+		  break;
+	    if (i < rw)
+	       break;
+	 }
+	 for (j = 0; j < rh; j++)
+	    memset(covered + (y + j) * w + x, 1, rw);
+	 rects[n].pixel = c;
+	 rects[n].x = x;
+	 rects[n].y = y;
+	 rects[n].w = rw;
+	 rects[n].h = rh;
+	 n++;
+      }
+   }
+   return n;
+}
+
+/*
+ * zlib streams, one for Zlib and four for Tight. They last as long as the
+ * connection, like the client's.
+ */
+
+struct zstream
+{
+   z_stream zs;
+   int level;
+   int ready;
+};
+
+static struct zstream zlib_stream, tight_streams[4];
+
+static unsigned char *
+_deflate(struct zstream *s, void *data, size_t len, size_t *clen)
+{
+   static unsigned char *buf = NULL;
+   static size_t size = 0;
+   int err;
+
+   if (!s->ready)
+   {
+      memset(&s->zs, 0, sizeof(s->zs));
+      if (deflateInit(&s->zs, compress_level) != Z_OK)
+      {
+	 fprintf(stderr, "deflateInit failed\n");
+	 exit(1);
+      }
+      s->level = compress_level;
+      s->ready = 1;
+   }
+   else if (s->level != compress_level)
+   {
+      /* nothing is pending after a sync flush, so this outputs nothing */
+      deflateParams(&s->zs, compress_level, Z_DEFAULT_STRATEGY);
+      s->level = compress_level;
+   }
+
+   if (deflateBound(&s->zs, len) + 64 > size)
+   {
+      free(buf);
+      size = deflateBound(&s->zs, len) + 64;
+      buf = _alloc(size);
+   }
+   s->zs.next_in = data;
+   s->zs.avail_in = len;
+   s->zs.next_out = buf;
+   s->zs.avail_out = size;
+   err = deflate(&s->zs, Z_SYNC_FLUSH);
+   if (err != Z_OK || s->zs.avail_in || !s->zs.avail_out)
+   {
+      fprintf(stderr, "deflate failed\n");
+      exit(1);
+   }
+   *clen = size - s->zs.avail_out;
+   return buf;
+}
+
+/*
+ * Encoders. Each puts one or more rects covering x, y, w, h into the update.
+ */
+
+static void
+_rect_header(int x, int y, int w, int h, CARD32 enc)
+{
+   _out16(x);
+   _out16(y);
+   _out16(w);
+   _out16(h);
+   _out32(enc);
+   out_rects++;
+}
+
+static void
+_encode_raw(int x, int y, int w, int h)
+{
+   _rect_header(x, y, w, h, rfbEncodingRaw);
+   _out_pixels(_translate(x, y, w, h), w * h);
+}
+
+static void
+_encode_rre(int x, int y, int w, int h)
+{
+   CARD32 *pix = _translate(x, y, w, h), bg = _background(pix, w * h);
+   struct subrect *rects = _alloc((size_t)w * h * sizeof(struct subrect));
+   int n, i;
+
+   n = _subrects(pix, w, h, bg, rects, w * h);
+   _rect_header(x, y, w, h, rfbEncodingRRE);
+   _out32(n);
+   _out_pixel(bg);
+   for (i = 0; i < n; i++)
+   {
+      _out_pixel(rects[i].pixel);
+      _out16(rects[i].x);
+      _out16(rects[i].y);
+      _out16(rects[i].w);
+      _out16(rects[i].h);
+   }
+   free(rects);
+}
+
+static void
+_encode_hextile(int x, int y, int w, int h)
+{
+   CARD32 *tile, bg, fg = 0, last_bg = 0, last_fg = 0;
+   struct subrect rects[255];
+   int tx, ty, tw, th, i, n, mono, size, flags;
+   int have_bg = 0, have_fg = 0;
+
+   _rect_header(x, y, w, h, rfbEncodingHextile);
+   for (ty = 0; ty < h; ty += 16)
+   {
+      th = h - ty < 16 ? h - ty : 16;
+      for (tx = 0; tx < w; tx += 16)
+      {
+	 tw = w - tx < 16 ? w - tx : 16;
+	 tile = _translate(x + tx, y + ty, tw, th);
+
+	 bg = _background(tile, tw * th);
+	 n = _subrects(tile, tw, th, bg, rects, 255);
+	 mono = 1;
+	 for (i = 1; i < n; i++)
+	    if (rects[i].pixel != rects[0].pixel)
+	       mono = 0;
+	 if (n > 0)
+	    fg = rects[0].pixel;
+
+	 /* fall back to raw when the subrects would be larger */
+	 size = 1 + bytes_pp * 2 + 1 + n * (mono ? 2 : bytes_pp + 2);
+	 if (n < 0 || size > tw * th * bytes_pp)
+	 {
+	    _out8(rfbHextileRaw);
+	    _out_pixels(tile, tw * th);
+	    /* the client may not keep the colours across raw tiles */
+	    have_bg = have_fg = 0;
+	    continue;
+	 }
+
+	 flags = 0;
+	 if (!have_bg || bg != last_bg)
+	    flags |= rfbHextileBackgroundSpecified;
+	 if (n > 0)
+	 {
+	    flags |= rfbHextileAnySubrects;
+	    if (!mono)
+	       flags |= rfbHextileSubrectsColoured;
+	    else if (!have_fg || fg != last_fg)
+	       flags |= rfbHextileForegroundSpecified;
+	 }
+	 _out8(flags);
+	 if (flags & rfbHextileBackgroundSpecified)
+	    _out_pixel(bg);
+	 if (flags & rfbHextileForegroundSpecified)
+	    _out_pixel(fg);
+	 if (n > 0)
+	    _out8(n);
+	 for (i = 0; i < n; i++)
+	 {
+	    if (!mono)
+	       _out_pixel(rects[i].pixel);
+	    _out8(rfbHextilePackXY(rects[i].x, rects[i].y));
+	    _out8(rfbHextilePackWH(rects[i].w, rects[i].h));
+	 }
+	 last_bg = bg;
+	 have_bg = 1;
+	 if (flags & rfbHextileForegroundSpecified)
+	 {
+	    last_fg = fg;
+	    have_fg = 1;
+	 }
+	 /* coloured subrects leave the foreground undefined */
+	 if (flags & rfbHextileSubrectsColoured)
+	    have_fg = 0;
+      }
+   }
+}
+
+static void
+_encode_zlib(int x, int y, int w, int h)
+{
+   CARD32 *pix = _translate(x, y, w, h);
+   unsigned char *raw = _alloc((size_t)w * h * bytes_pp), *p = raw, *data;
+   size_t len;
+   int i;
+
+   for (i = 0; i < w * h; i++)
+      p = _put_pixel(p, pix[i]);
+   data = _deflate(&zlib_stream, raw, (size_t)w * h * bytes_pp, &len);
+   free(raw);
+
+   _rect_header(x, y, w, h, rfbEncodingZlib);
+   _out32(len);
+   _out_bytes(data, len);
+}
+
+/*
+ * Tight
+ */
+
+static void
+_tight_out_length(size_t len)
+{
+   _out8((len & 0x7F) | (len > 0x7F ? 0x80 : 0));
+   if (len > 0x7F)
+   {
+      _out8((len >> 7 & 0x7F) | (len > 0x3FFF ? 0x80 : 0));
+      if (len > 0x3FFF)
+	 _out8(len >> 14);
+   }
+}
+
+/* filtered data, compressed unless there is too little of it */
+static void
+_tight_out_data(int stream, unsigned char *data, size_t len)
+{
+   unsigned char *cdata;
+   size_t clen;
+
+   if (len < TIGHT_MIN_TO_COMPRESS)
+   {
+      _out_bytes(data, len);
+      return;
+   }
+   cdata = _deflate(&tight_streams[stream], data, len, &clen);
+   _tight_out_length(clen);
+   _out_bytes(cdata, clen);
+}
+
+/* a libjpeg destination writing into a growing buffer */
+static unsigned char *jpeg_buf = NULL;
+static size_t jpeg_size = 0;
+
+static void
+_jpeg_init_destination(j_compress_ptr cinfo)
+{
+   if (!jpeg_buf)
+   {
+      jpeg_size = 65536;
+      jpeg_buf = _alloc(jpeg_size);
+   }
+   cinfo->dest->next_output_byte = jpeg_buf;
+   cinfo->dest->free_in_buffer = jpeg_size;
+}
+
+static boolean
+_jpeg_empty_output_buffer(j_compress_ptr cinfo)
+{
+   size_t old = jpeg_size;
+
+   jpeg_size *= 2;
+   if (!(jpeg_buf = realloc(jpeg_buf, jpeg_size)))
+   {
+      fprintf(stderr, "Memory allocation error.\n");
+      exit(1);
+   }
+   cinfo->dest->next_output_byte = jpeg_buf + old;
+   cinfo->dest->free_in_buffer = jpeg_size - old;
+   return TRUE;
+}
+
+static void
+_jpeg_term_destination(j_compress_ptr cinfo)
+{
+}
+
+static void
+_tight_jpeg(int x, int y, int w, int h)
+{
+   /* the JPEG qualities TightVNC uses for the quality levels */
+   static const int jpeg_quality[10] = { 5, 10, 15, 25, 37, 50, 60, 70, 75, 80 };
+   struct jpeg_compress_struct cinfo;
+   struct jpeg_error_mgr jerr;
+   struct jpeg_destination_mgr dest;
+   unsigned char *row = _alloc(w * 3);
+   JSAMPROW rows[1] = { row };
+   CARD32 *src;
+   int i, j;
+
+   cinfo.err = jpeg_std_error(&jerr);
+   jpeg_create_compress(&cinfo);
+   dest.init_destination = _jpeg_init_destination;
+   dest.empty_output_buffer = _jpeg_empty_output_buffer;
+   dest.term_destination = _jpeg_term_destination;
+   cinfo.dest = &dest;
+   cinfo.image_width = w;
+   cinfo.image_height = h;
+   cinfo.input_components = 3;
+   cinfo.in_color_space = JCS_RGB;
+   jpeg_set_defaults(&cinfo);
+   jpeg_set_quality(&cinfo, jpeg_quality[quality], TRUE);
+   jpeg_start_compress(&cinfo, TRUE);
+   for (i = 0; i < h; i++)
+   {
+      src = fb + (y + i) * width + x;
+      for (j = 0; j < w; j++)
+      {
+	 row[j * 3] = src[j] >> 16;
+	 row[j * 3 + 1] = src[j] >> 8;
+	 row[j * 3 + 2] = src[j];
+      }
+      jpeg_write_scanlines(&cinfo, rows, 1);
+   }
+   jpeg_finish_compress(&cinfo);
+
+   _out8(rfbTightJpeg << 4);
+   _tight_out_length(jpeg_size - dest.free_in_buffer);
+   _out_bytes(jpeg_buf, jpeg_size - dest.free_in_buffer);
+   jpeg_destroy_compress(&cinfo);
+   free(row);
+}
+
+/*
+ * Whether the gradient filter suits the rect: the average error of its
+ * prediction is small on photos and gradients, and large on text and noise.
+ */
+static int
+_tight_smooth(CARD32 *pix, int w, int h)
+{
+   int shift[3] = { fmt.redshift, fmt.greenshift, fmt.blueshift };
+   int max[3] = { fmt.redmax, fmt.greenmax, fmt.bluemax };
+   long error = 0, samples = 0;
+   int x, y, c, a, l, al, p, est;
+
+   if (w < 8 || h < 8 || !fmt.truecolour)
+      return 0;
+   for (y = 1; y < h; y += 4)
+   {
+      for (x = 1; x < w; x++)
+      {
+	 for (c = 0; c < 3; c++)
+	 {
+	    p = pix[y * w + x] >> shift[c] & max[c];
+	    l = pix[y * w + x - 1] >> shift[c] & max[c];
+	    a = pix[(y - 1) * w + x] >> shift[c] & max[c];
+	    al = pix[(y - 1) * w + x - 1] >> shift[c] & max[c];
+	    est = l + a - al;
+	    est = est < 0 ? 0 : est > max[c] ? max[c] : est;
+	    error += abs(p - est) * 255 / (max[c] ? max[c] : 1);
+	 }
+	 samples++;
+      }
+   }
+   return error < samples * 3 * 4;
+}
+
+static void
+_tight_gradient(CARD32 *pix, int w, int h)
+{
+   int shift[3] = { fmt.redshift, fmt.greenshift, fmt.blueshift };
+   int max[3] = { fmt.redmax, fmt.greenmax, fmt.bluemax };
+   int psize = cut_zeros ? 3 : bytes_pp;
+   unsigned char *data = _alloc((size_t)w * h * psize), *dst = data;
+   int x, y, c, est, cur, left, above, aboveleft;
+   CARD32 diff;
+
+   for (y = 0; y < h; y++)
+   {
+      for (x = 0; x < w; x++)
+      {
+	 diff = 0;
+	 for (c = 0; c < 3; c++)
+	 {
+	    cur = pix[y * w + x] >> shift[c] & max[c];
+	    above = y ? pix[(y - 1) * w + x] >> shift[c] & max[c] : 0;
+	    left = x ? pix[y * w + x - 1] >> shift[c] & max[c] : 0;
+	    aboveleft = x && y ? pix[(y - 1) * w + x - 1] >> shift[c] & max[c] : 0;
+	    est = left + above - aboveleft;
+	    est = est < 0 ? 0 : est > max[c] ? max[c] : est;
+	    diff |= (CARD32)((cur - est) & max[c]) << shift[c];
+	 }
+	 dst = _put_tpixel(dst, diff);
+      }
+   }
+   _out8((3 | rfbTightExplicitFilter) << 4);
+   _out8(rfbTightFilterGradient);
+   _tight_out_data(3, data, dst - data);
+   free(data);
+}
+
+static void
+_tight_palette(CARD32 *pix, int w, int h, CARD32 *palette, int colours)
+{
+   int row = colours == 2 ? (w + 7) / 8 : w;
+   unsigned char *data = _alloc((size_t)row * h), *dst;
+   int x, y, i = 0;
+
+   _out8(((colours == 2 ? 1 : 2) | rfbTightExplicitFilter) << 4);
+   _out8(rfbTightFilterPalette);
+   _out8(colours - 1);
+   for (i = 0; i < colours; i++)
+      _out_tpixel(palette[i]);
+
+   memset(data, 0, (size_t)row * h);
+   i = 0;
+   for (y = 0; y < h; y++)
+   {
+      dst = data + y * row;
+      for (x = 0; x < w; x++)
+      {
+	 /* most pixels have the colour of the one before */
+	 if (palette[i] != pix[y * w + x])
+	    for (i = 0; palette[i] != pix[y * w + x]; i++)
+	       ;
+	 if (colours > 2)
+	    dst[x] = i;
+	 else if (i)
+	    dst[x / 8] |= 0x80 >> (x % 8);
+      }
+   }
+   _tight_out_data(colours == 2 ? 1 : 2, data, (size_t)row * h);
+   free(data);
+}
+
+static void
+_tight_subrect(int x, int y, int w, int h)
+{
+   CARD32 palette[TIGHT_MAX_PALETTE], *pix = _translate(x, y, w, h);
+   int colours = _palette(pix, w * h, palette, TIGHT_MAX_PALETTE);
+   unsigned char *data, *dst;
+   int i;
+
+   _rect_header(x, y, w, h, rfbEncodingTight);
+   if (colours == 1)
+   {
+      _out8(rfbTightFill << 4);
+      _out_tpixel(palette[0]);
+   }
+   else if (colours <= TIGHT_MAX_PALETTE)
+      _tight_palette(pix, w, h, palette, colours);
+   else if (quality >= 0 && fmt.bpp >= 16 && fmt.truecolour
+	 && w >= TIGHT_MIN_JPEG_SIZE && h >= TIGHT_MIN_JPEG_SIZE)
+      _tight_jpeg(x, y, w, h);
+   else if (_tight_smooth(pix, w, h))
+      _tight_gradient(pix, w, h);
+   else
+   {
+      /* the copy filter, implicit */
+      data = _alloc((size_t)w * h * 4);
+      dst = data;
+      for (i = 0; i < w * h; i++)
+	 dst = _put_tpixel(dst, pix[i]);
+      _out8(0);
+      _tight_out_data(0, data, dst - data);
+      free(data);
+   }
+}
+
+static void
+_encode_tight(int x, int y, int w, int h)
+{
+   int cx, cy, cw, ch, rows;
+
+   cw = w < TIGHT_MAX_WIDTH ? w : TIGHT_MAX_WIDTH;
+   rows = TIGHT_MAX_PIXELS / cw;
+   for (cy = y; cy < y + h; cy += rows)
+   {
+      ch = y + h - cy < rows ? y + h - cy : rows;
+      for (cx = x; cx < x + w; cx += cw)
+	 _tight_subrect(cx, cy, x + w - cx < cw ? x + w - cx : cw, ch);
+   }
+}
+
+/*
+ * H.264, without an encoder library: every frame is an IDR picture of
+ * I_PCM macroblocks, the samples stored as they are. That makes for about
+ * 1.5 bytes a pixel, but any decoder takes it, and the client goes through
+ * all of its H.264 path.
+ */
+
+static unsigned char *nal_buf = NULL;
+static size_t nal_size = 0, nal_len;
+static int nal_bits;		/* bits used in the last byte, 0 if none */
+static unsigned int idr_pic_id = 0;
+
+static void
+_nal_bit(int b)
+{
+   if (!nal_bits)
+   {
+      if (nal_len == nal_size)
+      {
+	 nal_size = nal_size ? 2 * nal_size : 65536;
+	 if (!(nal_buf = realloc(nal_buf, nal_size)))
+	 {
+	    fprintf(stderr, "Memory allocation error.\n");
+	    exit(1);
+	 }
+      }
+      nal_buf[nal_len++] = 0;
+   }
+   if (b)
+      nal_buf[nal_len - 1] |= 0x80 >> nal_bits;
+   nal_bits = (nal_bits + 1) & 7;
+}
+
+static void
+_nal_u(int n, unsigned int v)
+{
+   /* whole bytes, the samples mostly, go in at once */
+   if (n == 8 && !nal_bits)
+   {
+      _nal_bit(0);
+      nal_buf[nal_len - 1] = v;
+      nal_bits = 0;
+      return;
+   }
+   while (n--)
+      _nal_bit(v >> n & 1);
+}
+
+/* Exp-Golomb codes */
+static void
+_nal_ue(unsigned int v)
+{
+   int n = 0;
+
+   while ((v + 1) >> (n + 1))
+      n++;
+   _nal_u(n, 0);
+   _nal_u(n + 1, v + 1);
+}
+
+static void
+_nal_se(int v)
+{
+   _nal_ue(v > 0 ? 2 * v - 1 : -2 * v);
+}
+
+static void
+_nal_start(int type)
+{
+   nal_len = 0;
+   nal_bits = 0;
+   _nal_u(8, 3 << 5 | type);
+}
+
+static void
+_nal_trailing_bits(void)
+{
+   _nal_bit(1);
+   while (nal_bits)
+      _nal_bit(0);
+}
+
+/*
+ * Puts the NAL unit with its start code into the update, with emulation
+ * prevention bytes wherever the payload would look like a start code.
+ */
+static void
+_nal_out(void)
+{
+   size_t i;
+   int zeros = 0;
+
+   _out32(1);
+   for (i = 0; i < nal_len; i++)
+   {
+      if (zeros == 2 && nal_buf[i] <= 3)
+      {
+	 _out8(3);
+	 zeros = 0;
+      }
+      _out8(nal_buf[i]);
+      zeros = nal_buf[i] ? 0 : zeros + 1;
+   }
+}
+
+/* BT.601 with video range, what libswscale takes by default */
+static void
+_yuv(CARD32 rgb, int *y, int *u, int *v)
+{
+   int r = rgb >> 16 & 0xff, g = rgb >> 8 & 0xff, b = rgb & 0xff;
+
+   *y = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+   *u = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+   *v = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+}
+
+/* a screen pixel, the edge ones repeated into the padding macroblocks */
+static CARD32
+_h264_pixel(int x, int y)
+{
+   return fb[(y < height ? y : height - 1) * width + (x < width ? x : width - 1)];
+}
+
+static void
+_h264_macroblock(int mx, int my)
+{
+   unsigned char cb[64], cr[64];
+   int x, y, i, j, ys, us, vs, su, sv;
+
+   _nal_ue(25);			/* mb_type I_PCM */
+   while (nal_bits)
+      _nal_bit(0);
+   for (y = 0; y < 16; y++)
+      for (x = 0; x < 16; x++)
+      {
+	 _yuv(_h264_pixel(mx + x, my + y), &ys, &us, &vs);
+	 _nal_u(8, ys);
+      }
+   for (y = 0; y < 8; y++)
+      for (x = 0; x < 8; x++)
+      {
+	 su = sv = 0;
+	 for (i = 0; i < 2; i++)
+	    for (j = 0; j < 2; j++)
+	    {
+	       _yuv(_h264_pixel(mx + 2 * x + j, my + 2 * y + i), &ys, &us, &vs);
+	       su += us;
+	       sv += vs;
+	    }
+	 cb[y * 8 + x] = (su + 2) / 4;
+	 cr[y * 8 + x] = (sv + 2) / 4;
+      }
+   for (i = 0; i < 64; i++)
+      _nal_u(8, cb[i]);
+   for (i = 0; i < 64; i++)
+      _nal_u(8, cr[i]);
+}
+
+/*
+ * The whole screen as one rect, so the client keeps a single decoder
+ * context. The picture is cropped to the screen size in steps of two
+ * pixels; an odd sized screen leaves one padding column or row, which the
+ * client scales away.
+ */
+static void
+_encode_h264(void)
+{
+   int mbw = (width + 15) / 16, mbh = (height + 15) / 16;
+   int crop_x = (mbw * 16 - width) / 2, crop_y = (mbh * 16 - height) / 2;
+   size_t start, len;
+   int mx, my;
+
+   _rect_header(0, 0, width, height, rfbEncodingH264);
+   start = out_len;
+   _out32(0);			/* length, filled in below */
+   _out32(0);			/* flags */
+
+   /* sequence parameter set: Baseline, level 5.1 */
+   _nal_start(7);
+   _nal_u(8, 66);
+   _nal_u(8, 0xc0);		/* constraint_set0 and 1 */
+   _nal_u(8, 51);
+   _nal_ue(0);			/* seq_parameter_set_id */
+   _nal_ue(0);			/* log2_max_frame_num_minus4 */
+   _nal_ue(2);			/* pic_order_cnt_type */
+   _nal_ue(1);			/* max_num_ref_frames */
+   _nal_bit(0);			/* gaps_in_frame_num_value_allowed_flag */
+   _nal_ue(mbw - 1);
+   _nal_ue(mbh - 1);
+   _nal_bit(1);			/* frame_mbs_only_flag */
+   _nal_bit(1);			/* direct_8x8_inference_flag */
+   _nal_bit(crop_x || crop_y);
+   if (crop_x || crop_y)
+   {
+      _nal_ue(0);
+      _nal_ue(crop_x);
+      _nal_ue(0);
+      _nal_ue(crop_y);
+   }
+   _nal_bit(0);			/* vui_parameters_present_flag */
+   _nal_trailing_bits();
+   _nal_out();
+
+   /* picture parameter set: CAVLC, everything else off */
+   _nal_start(8);
+   _nal_ue(0);			/* pic_parameter_set_id */
+   _nal_ue(0);			/* seq_parameter_set_id */
+   _nal_bit(0);			/* entropy_coding_mode_flag */
+   _nal_bit(0);			/* bottom_field_pic_order_in_frame_present_flag */
+   _nal_ue(0);			/* num_slice_groups_minus1 */
+   _nal_ue(0);			/* num_ref_idx_l0_default_active_minus1 */
+   _nal_ue(0);			/* num_ref_idx_l1_default_active_minus1 */
+   _nal_bit(0);			/* weighted_pred_flag */
+   _nal_u(2, 0);		/* weighted_bipred_idc */
+   _nal_se(0);			/* pic_init_qp_minus26 */
+   _nal_se(0);			/* pic_init_qs_minus26 */
+   _nal_se(0);			/* chroma_qp_index_offset */
+   _nal_bit(1);			/* deblocking_filter_control_present_flag */
+   _nal_bit(0);			/* constrained_intra_pred_flag */
+   _nal_bit(0);			/* redundant_pic_cnt_present_flag */
+   _nal_trailing_bits();
+   _nal_out();
+
+   /* the IDR slice */
+   _nal_start(5);
+   _nal_ue(0);			/* first_mb_in_slice */
+   _nal_ue(7);			/* slice_type I */
+   _nal_ue(0);			/* pic_parameter_set_id */
+   _nal_u(4, 0);		/* frame_num */
+   _nal_ue(idr_pic_id++ & 0xffff);
+   _nal_bit(0);			/* no_output_of_prior_pics_flag */
+   _nal_bit(0);			/* long_term_reference_flag */
+   _nal_se(0);			/* slice_qp_delta */
+   _nal_ue(1);			/* disable_deblocking_filter_idc */
+   for (my = 0; my < mbh; my++)
+      for (mx = 0; mx < mbw; mx++)
+	 _h264_macroblock(mx * 16, my * 16);
+   _nal_trailing_bits();
+   _nal_out();
+
+   len = out_len - start - sz_rfbH264Header;
+   out[start] = len >> 24;
+   out[start + 1] = len >> 16;
+   out[start + 2] = len >> 8;
+   out[start + 3] = len;
+}
+
+/*
+ * The cursor, an arrow
+ */
+
+static const char *cursor_shape[] = {
+   "X           ",
+   "XX          ",
+   "X.X         ",
+   "X..X        ",
+   "X...X       ",
+   "X....X      ",
+   "X.....X     ",
+   "X......X    ",
+   "X.......X   ",
+   "X........X  ",
+   "X.........X ",
+   "X......XXXXX",
+   "X...X..X    ",
+   "X..XX..X    ",
+   "X.X  X..X   ",
+   "XX   X..X   ",
+   "X     X..X  ",
+   "      X..X  ",
+   "       XX   ",
+};
+#define CURSOR_WIDTH 12
+#define CURSOR_HEIGHT 19
+
+static void
+_encode_cursor(void)
+{
+   CARD32 black = _pixel(0), white = _pixel(0xFFFFFF);
+   unsigned char mask;
+   int x, y;
+
+   _rect_header(0, 0, CURSOR_WIDTH, CURSOR_HEIGHT, rfbEncodingRichCursor);
+   for (y = 0; y < CURSOR_HEIGHT; y++)
+      for (x = 0; x < CURSOR_WIDTH; x++)
+	 _out_pixel(cursor_shape[y][x] == '.' ? white : black);
+   for (y = 0; y < CURSOR_HEIGHT; y++)
+   {
+      mask = 0;
+      for (x = 0; x < CURSOR_WIDTH; x++)
+      {
+	 if (cursor_shape[y][x] != ' ')
+	    mask |= 0x80 >> (x % 8);
+	 if (x % 8 == 7 || x == CURSOR_WIDTH - 1)
+	 {
+	    _out8(mask);
+	    mask = 0;
+	 }
+      }
+   }
+}
+
+/*
+ * Workloads. Each draws a frame into fb, moving parts with _move().
+ */
+
+/*
+ * Records that the rect at sx, sy moved to dx, dy, for a CopyRect. Two moves
+ * between updates are combined into one for the part that was moved twice.
+ */
+static void
+_record_copy(int sx, int sy, int dx, int dy, int w, int h)
+{
+   int x1, y1, x2, y2;
+
+   if (copy.valid)
+   {
+      /* where the first move went, cut to what the second one takes */
+      x1 = copy.dx > sx ? copy.dx : sx;
+      y1 = copy.dy > sy ? copy.dy : sy;
+      x2 = copy.dx + copy.w < sx + w ? copy.dx + copy.w : sx + w;
+      y2 = copy.dy + copy.h < sy + h ? copy.dy + copy.h : sy + h;
+      if (x2 <= x1 || y2 <= y1)
+      {
+	 copy.valid = 0;
+	 return;
+      }
+      copy.sx += x1 - copy.dx;
+      copy.sy += y1 - copy.dy;
+      copy.dx = x1 + dx - sx;
+      copy.dy = y1 + dy - sy;
+      copy.w = x2 - x1;
+      copy.h = y2 - y1;
+      return;
+   }
+   copy.valid = 1;
+   copy.sx = sx;
+   copy.sy = sy;
+   copy.dx = dx;
+   copy.dy = dy;
+   copy.w = w;
+   copy.h = h;
+}
+
+static void
+_fill(int x, int y, int w, int h, CARD32 rgb)
+{
+   int i, j;
+
+   for (i = y; i < y + h; i++)
+      for (j = x; j < x + w; j++)
+	 fb[i * width + j] = rgb;
+}
+
+/* text */
+
+#define LINE_HEIGHT 16
+#define CHAR_WIDTH 8
+#define TEXT_BACKGROUND 0x101820
+
+static unsigned char glyphs[128][LINE_HEIGHT];
+
+static void
+_draw_char(int x, int y, int c, CARD32 rgb)
+{
+   int i, j;
+
+   for (i = 0; i < LINE_HEIGHT; i++)
+      for (j = 0; j < CHAR_WIDTH; j++)
+	 if (glyphs[c][i] & 0x80 >> j)
+	    fb[(y + i) * width + x + j] = rgb;
+}
+
+static void
+_text_init(void)
+{
+   int c, i;
+
+   /* made up glyphs, a few random strokes in the middle rows */
+   for (c = 33; c < 127; c++)
+      for (i = 3; i < LINE_HEIGHT - 3; i++)
+	 glyphs[c][i] = (_random() & _random()) & 0x7E;
+   _fill(0, 0, width, height, TEXT_BACKGROUND);
+}
+
+static void
+_text_step(void)
+{
+   static const CARD32 colours[] = { 0xC0C0C0, 0xC0C0C0, 0xC0C0C0, 0x60D060,
+				     0xE0C040, 0x6090F0 };
+   int lines = height / LINE_HEIGHT, y = (lines - 1) * LINE_HEIGHT;
+   int len, x, word;
+   CARD32 rgb = colours[0];
+
+   /* scroll up a line */
+   memmove(fb, fb + LINE_HEIGHT * width,
+	 (size_t)(lines - 1) * LINE_HEIGHT * width * sizeof(CARD32));
+   _record_copy(0, LINE_HEIGHT, 0, 0, width, y);
+   _fill(0, y, width, LINE_HEIGHT, TEXT_BACKGROUND);
+
+   /* and write a new one, words in different colours */
+   len = _random() % (width / CHAR_WIDTH);
+   word = 0;
+   for (x = 0; x < len; x++)
+   {
+      if (!word)
+      {
+	 word = 2 + _random() % 10;
+	 rgb = colours[_random() % (sizeof(colours) / sizeof(colours[0]))];
+	 continue;
+      }
+      _draw_char(x * CHAR_WIDTH, y, 33 + _random() % 94, rgb);
+      word--;
+   }
+}
+
+/* noise */
+
+static unsigned char wave[256];
+
+static void
+_noise_init(void)
+{
+   int i;
+
+   for (i = 0; i < 256; i++)
+      wave[i] = 127.5 + 127.5 * sin(i * 2 * M_PI / 256);
+}
+
+/* plasma moving in waves, with some grain, like video */
+static void
+_noise_step(void)
+{
+   int x, y, r, g, b, n;
+   unsigned int t = frame;
+   CARD32 *p = fb;
+
+   for (y = 0; y < height; y++)
+   {
+      for (x = 0; x < width; x++)
+      {
+	 n = (_random() & 31) - 16;
+	 r = (wave[(x / 3 + t * 2) & 255] + wave[(y / 2 + t) & 255]) / 2 + n;
+	 g = (wave[(x / 2 + y / 3 + t * 3) & 255] + wave[(y / 4 - t) & 255]) / 2 + n;
+	 b = (wave[(x / 4 - t) & 255] + wave[(x / 5 + y / 3 + t * 2) & 255]) / 2 + n;
+	 r = r < 0 ? 0 : r > 255 ? 255 : r;
+	 g = g < 0 ? 0 : g > 255 ? 255 : g;
+	 b = b < 0 ? 0 : b > 255 ? 255 : b;
+	 *p++ = r << 16 | g << 8 | b;
+      }
+   }
+}
+
+/* drag */
+
+static CARD32 *desktop, *window;
+static int win_x, win_y, win_w, win_h, win_dx = 7, win_dy = 5;
+
+static void
+_drag_init(void)
+{
+   int x, y, i;
+
+   /* a desktop with a gradient and rows of icons */
+   desktop = _alloc((size_t)width * height * sizeof(CARD32));
+   for (y = 0; y < height; y++)
+      for (x = 0; x < width; x++)
+	 desktop[y * width + x] = (0x20 + 0x40 * y / height) << 8
+				  | (0x60 + 0x60 * y / height);
+   memcpy(fb, desktop, (size_t)width * height * sizeof(CARD32));
+   for (y = 16; y + 48 < height; y += 80)
+   {
+      _fill(16, y, 48, 48, 0xE0E0E0);
+      _fill(20, y + 4, 40, 40, 0x3070C0 + (y & 0xFF) * 0x10000);
+   }
+   memcpy(desktop, fb, (size_t)width * height * sizeof(CARD32));
+
+   /* a window with a title bar and some text */
+   win_w = width / 3;
+   win_h = height / 3;
+   window = _alloc((size_t)win_w * win_h * sizeof(CARD32));
+   for (i = 0; i < win_w * win_h; i++)
+      window[i] = 0xF0F0F0;
+   for (y = 0; y < 20; y++)
+      for (x = 0; x < win_w; x++)
+	 window[y * win_w + x] = 0x2050A0;
+   for (y = 28; y + 8 < win_h; y += 12)
+      for (x = 8; x < win_w - 8; x++)
+	 if ((_random() & 7) && (x / 6 + y) % 9)
+	    for (i = 0; i < 8; i++)
+	       if (_random() & 1)
+		  window[(y + i) * win_w + x] = 0x202020;
+   win_x = width / 4;
+   win_y = height / 4;
+}
+
+static void
+_drag_step(void)
+{
+   int x = win_x + win_dx, y = win_y + win_dy, i;
+
+   if (x < 0 || x + win_w > width)
+   {
+      win_dx = -win_dx;
+      x = win_x + win_dx;
+   }
+   if (y < 0 || y + win_h > height)
+   {
+      win_dy = -win_dy;
+      y = win_y + win_dy;
+   }
+
+   /* uncover the desktop and put the window on top of it again */
+   for (i = 0; i < win_h; i++)
+      memcpy(fb + (win_y + i) * width + win_x,
+	    desktop + (win_y + i) * width + win_x, win_w * sizeof(CARD32));
+   for (i = 0; i < win_h; i++)
+      memcpy(fb + (y + i) * width + x, window + i * win_w,
+	    win_w * sizeof(CARD32));
+   _record_copy(win_x, win_y, x, y, win_w, win_h);
+   win_x = x;
+   win_y = y;
+}
+
+struct workload
+{
+   char *name;
+   void (*init)(void);
+   void (*step)(void);
+};
+
+static struct workload workloads[] = {
+   { "text", _text_init, _text_step },
+   { "noise", _noise_init, _noise_step },
+   { "drag", _drag_init, _drag_step },
+   { NULL, NULL, NULL }
+};
+
+static struct workload *workload;
+
+/*
+ * Updates
+ */
+
+/* Makes the client's copy of a rect wrong, so that it is sent. */
+static void
+_invalidate(int x, int y, int w, int h)
+{
+   int i, j;
+
+   for (i = y; i < y + h; i++)
+      for (j = x; j < x + w; j++)
+	 shadow[i * width + j] = INVALID_PIXEL;
+}
+
+/* Does to the client's copy what the client does for a CopyRect. */
+static void
+_shadow_copy(void)
+{
+   int i;
+
+   if (copy.dy > copy.sy)
+      for (i = copy.h - 1; i >= 0; i--)
+	 memmove(shadow + (copy.dy + i) * width + copy.dx,
+	       shadow + (copy.sy + i) * width + copy.sx, copy.w * sizeof(CARD32));
+   else
+      for (i = 0; i < copy.h; i++)
+	 memmove(shadow + (copy.dy + i) * width + copy.dx,
+	       shadow + (copy.sy + i) * width + copy.sx, copy.w * sizeof(CARD32));
+}
+
+static int
+_tile_dirty(int x, int y, int w, int h)
+{
+   int i;
+
+   for (i = y; i < y + h; i++)
+      if (memcmp(fb + i * width + x, shadow + i * width + x,
+	       w * sizeof(CARD32)))
+	 return 1;
+   return 0;
+}
+
+static void
+_encode(int x, int y, int w, int h)
+{
+   int i;
+
+   switch (encoding)
+   {
+      case rfbEncodingRRE:
+	 _encode_rre(x, y, w, h);
+	 break;
+      case rfbEncodingHextile:
+	 _encode_hextile(x, y, w, h);
+	 break;
+      case rfbEncodingZlib:
+	 _encode_zlib(x, y, w, h);
+	 break;
+      case rfbEncodingTight:
+	 _encode_tight(x, y, w, h);
+	 break;
+      default:
+	 _encode_raw(x, y, w, h);
+	 break;
+   }
+   for (i = y; i < y + h; i++)
+      memcpy(shadow + i * width + x, fb + i * width + x, w * sizeof(CARD32));
+}
+
+/*
+ * Puts the differing tiles in the requested area into the update: runs of
+ * tiles in a row become one rect, and rects of the same columns in
+ * consecutive rows are joined.
+ */
+static void
+_encode_changes(void)
+{
+   struct span { int x1, x2, y1, y2; } *spans, *open, *s;
+   int cols = (width + TILE_SIZE - 1) / TILE_SIZE;
+   int num_open = 0, num_new, tx, ty, x1, x2, y1, y2, x, i;
+
+   spans = _alloc(2 * cols * sizeof(struct span));
+   open = spans;
+
+   for (ty = req_y / TILE_SIZE * TILE_SIZE; ; ty += TILE_SIZE)
+   {
+      struct span *next = open == spans ? spans + cols : spans;
+
+      num_new = 0;
+      if (ty < req_y + req_h)
+      {
+	 y1 = ty > req_y ? ty : req_y;
+	 y2 = ty + TILE_SIZE < req_y + req_h ? ty + TILE_SIZE : req_y + req_h;
+	 x1 = -1;
+	 for (tx = req_x / TILE_SIZE * TILE_SIZE; tx < req_x + req_w + TILE_SIZE;
+	       tx += TILE_SIZE)
+	 {
+	    x = tx > req_x ? tx : req_x;
+	    if (x > req_x + req_w)
+	       x = req_x + req_w;
+	    x2 = tx + TILE_SIZE < req_x + req_w ? tx + TILE_SIZE : req_x + req_w;
+	    if (x < x2 && _tile_dirty(x, y1, x2 - x, y2 - y1))
+	    {
+	       if (x1 < 0)
+		  x1 = x;
+	       continue;
+	    }
+	    if (x1 >= 0)
+	    {
+	       next[num_new].x1 = x1;
+	       next[num_new].x2 = x;
+	       next[num_new].y1 = y1;
+	       next[num_new].y2 = y2;
+	       num_new++;
+	       x1 = -1;
+	    }
+	 }
+      }
+
+      /* spans that go on below grow, the others are done */
+      for (i = 0; i < num_open; i++)
+      {
+	 s = &open[i];
+	 for (x = 0; x < num_new; x++)
+	    if (next[x].x1 == s->x1 && next[x].x2 == s->x2)
+	       break;
+	 if (x < num_new)
+	    next[x].y1 = s->y1;
+	 else
+	    _encode(s->x1, s->y1, s->x2 - s->x1, s->y2 - s->y1);
+      }
+      if (!num_new && ty >= req_y + req_h)
+	 break;
+      open = next;
+      num_open = num_new;
+   }
+   free(spans);
+}
+
+static int
+_send_colourmap(void)
+{
+   int i;
+
+   _out8(rfbSetColourMapEntries);
+   _out8(0);
+   _out16(0);
+   _out16(256);
+   for (i = 0; i < 256; i++)
+   {
+      _out16((i >> 5 & 7) * 65535 / 7);
+      _out16((i >> 2 & 7) * 65535 / 7);
+      _out16((i & 3) * 65535 / 3);
+   }
+   colourmap_pending = 0;
+   return _out_flush();
+}
+
+/*
+ * Sends an update for the pending request if there is anything to send.
+ * Returns 0 if the client is gone.
+ */
+static int
+_send_update(void)
+{
+   size_t start;
+
+   if (!request_pending)
+      return 1;
+   if (colourmap_pending && !_send_colourmap())
+      return 0;
+
+   start = out_len;
+   _out8(rfbFramebufferUpdate);
+   _out8(0);
+   _out16(0);
+   out_rects = 0;
+
+   if (cursor_pending)
+   {
+      _encode_cursor();
+      cursor_pending = 0;
+   }
+   if (copy.valid && use_copyrect && encoding != rfbEncodingH264)
+   {
+      _rect_header(copy.dx, copy.dy, copy.w, copy.h, rfbEncodingCopyRect);
+      _out16(copy.sx);
+      _out16(copy.sy);
+      _shadow_copy();
+   }
+   copy.valid = 0;
+   if (encoding != rfbEncodingH264)
+      _encode_changes();
+   else if (_tile_dirty(0, 0, width, height))
+   {
+      _encode_h264();
+      memcpy(shadow, fb, width * height * sizeof(CARD32));
+   }
+
+   if (!out_rects)
+   {
+      out_len = start;
+      return 1;
+   }
+   out[start + 2] = out_rects >> 8;
+   out[start + 3] = out_rects;
+   request_pending = 0;
+   stats.updates++;
+   stats.rects += out_rects;
+   if (!_out_flush())
+      return 0;
+   update_sent = _now();
+   return 1;
+}
+
+/*
+ * Client messages
+ */
+
+static int
+_handle_set_pixel_format(void)
+{
+   unsigned char m[sz_rfbSetPixelFormatMsg - 1];
+
+   if (!_read_exact(m, sizeof(m)))
+      return 0;
+   /* m[0..2] is padding, the pixel format follows */
+   fmt.bpp = m[3];
+   fmt.depth = m[4];
+   fmt.bigendian = m[5];
+   fmt.truecolour = m[6];
+   fmt.redmax = _get16(m + 7);
+   fmt.greenmax = _get16(m + 9);
+   fmt.bluemax = _get16(m + 11);
+   fmt.redshift = m[13];
+   fmt.greenshift = m[14];
+   fmt.blueshift = m[15];
+   if (fmt.bpp != 8 && fmt.bpp != 16 && fmt.bpp != 32)
+   {
+      fprintf(stderr, "%d bits per pixel are not supported\n", fmt.bpp);
+      return 0;
+   }
+   if (!fmt.truecolour && fmt.bpp != 8)
+   {
+      fprintf(stderr, "colour maps are only supported with 8 bits per pixel\n");
+      return 0;
+   }
+   bytes_pp = fmt.bpp / 8;
+   cut_zeros = fmt.bpp == 32 && fmt.depth == 24 && fmt.truecolour
+      && fmt.redmax == 255 && fmt.greenmax == 255 && fmt.bluemax == 255;
+   colourmap_pending = !fmt.truecolour;
+   /* everything the client has is in the old format */
+   _invalidate(0, 0, width, height);
+   return 1;
+}
+
+static int
+_handle_set_encodings(void)
+{
+   unsigned char m[3], e[4];
+   CARD32 enc;
+   int n, chosen = 0;
+
+   if (!_read_exact(m, sizeof(m)))
+      return 0;
+   use_copyrect = use_richcursor = 0;
+   compress_level = 6;
+   quality = -1;
+   encoding = rfbEncodingRaw;
+   for (n = _get16(m + 1); n > 0; n--)
+   {
+      if (!_read_exact(e, 4))
+	 return 0;
+      enc = _get32(e);
+      switch (enc)
+      {
+	 case rfbEncodingCopyRect:
+	    use_copyrect = 1;
+	    break;
+	 case rfbEncodingRichCursor:
+	    if (!use_richcursor)
+	       cursor_pending = 1;
+	    use_richcursor = 1;
+	    break;
+	 case rfbEncodingRaw:
+	 case rfbEncodingRRE:
+	 case rfbEncodingHextile:
+	 case rfbEncodingZlib:
+	 case rfbEncodingTight:
+	 case rfbEncodingH264:
+	    /* the first one we know is the one the client likes best */
+	    if (!chosen)
+	       encoding = enc;
+	    chosen = 1;
+	    break;
+	 default:
+	    if (enc >= rfbEncodingCompressLevel0
+		  && enc <= rfbEncodingCompressLevel0 + 9)
+	       compress_level = enc - rfbEncodingCompressLevel0;
+	    else if (enc >= rfbEncodingQualityLevel0
+		  && enc <= rfbEncodingQualityLevel0 + 9)
+	       quality = enc - rfbEncodingQualityLevel0;
+	    break;
+      }
+   }
+   return 1;
+}
+
+static int
+_handle_update_request(void)
+{
+   unsigned char m[sz_rfbFramebufferUpdateRequestMsg - 1];
+   int x, y, w, h, x2, y2;
+   long now;
+
+   if (!_read_exact(m, sizeof(m)))
+      return 0;
+   x = _get16(m + 1);
+   y = _get16(m + 3);
+   w = _get16(m + 5);
+   h = _get16(m + 7);
+   if (x >= width || y >= height)
+      return 1;
+   if (x + w > width)
+      w = width - x;
+   if (y + h > height)
+      h = height - y;
+
+   if (update_sent)
+   {
+      now = _now();
+      stats.rtt_sum += now - update_sent;
+      stats.rtt_count++;
+      if (now - update_sent > stats.rtt_max)
+	 stats.rtt_max = now - update_sent;
+      update_sent = 0;
+   }
+
+   /* non-incremental means the client wants it all, changed or not */
+   if (!m[0])
+      _invalidate(x, y, w, h);
+   if (request_pending)
+   {
+      x2 = req_x + req_w > x + w ? req_x + req_w : x + w;
+      y2 = req_y + req_h > y + h ? req_y + req_h : y + h;
+      req_x = req_x < x ? req_x : x;
+      req_y = req_y < y ? req_y : y;
+      req_w = x2 - req_x;
+      req_h = y2 - req_y;
+   }
+   else
+   {
+      req_x = x;
+      req_y = y;
+      req_w = w;
+      req_h = h;
+   }
+   request_pending = 1;
+   return 1;
+}
+
+/* Returns 0 if the client is gone or sent something we cannot handle. */
+static int
+_handle_client_message(void)
+{
+   unsigned char type, m[7];
+   char *text;
+   CARD32 len;
+
+   if (!_read_exact(&type, 1))
+      return 0;
+   switch (type)
+   {
+      case rfbSetPixelFormat:
+	 return _handle_set_pixel_format();
+      case rfbSetEncodings:
+	 return _handle_set_encodings();
+      case rfbFramebufferUpdateRequest:
+	 return _handle_update_request();
+      case rfbKeyEvent:
+	 return _read_exact(m, sz_rfbKeyEventMsg - 1);
+      case rfbPointerEvent:
+	 return _read_exact(m, sz_rfbPointerEventMsg - 1);
+      case rfbClientCutText:
+	 if (!_read_exact(m, sz_rfbClientCutTextMsg - 1))
+	    return 0;
+	 len = _get32(m + 3);
+	 text = _alloc(len + 1);
+	 if (!_read_exact(text, len))
+	    return 0;
+	 free(text);
+	 return 1;
+      default:
+	 fprintf(stderr, "unknown message type %d from the client\n", type);
+	 return 0;
+   }
+}
+
+/*
+ * Connection setup
+ */
+
+/* Returns 0 if the client could not or may not connect. */
+static int
+_handshake(void)
+{
+   char version[sz_rfbProtocolVersionMsg + 1];
+   unsigned char challenge[CHALLENGESIZE], expected[CHALLENGESIZE];
+   unsigned char response[CHALLENGESIZE], shared, type;
+   char name[64];
+   int major, minor, scheme = settings.password ? rfbVncAuth : rfbNoAuth;
+   int ok;
+
+   sprintf(version, rfbProtocolVersionFormat, 3, 8);
+   _out_bytes(version, sz_rfbProtocolVersionMsg);
+   if (!_out_flush() || !_read_exact(version, sz_rfbProtocolVersionMsg))
+      return 0;
+   version[sz_rfbProtocolVersionMsg] = 0;
+   if (sscanf(version, rfbProtocolVersionFormat, &major, &minor) != 2
+	 || major != 3)
+   {
+      fprintf(stderr, "unknown protocol version from the client\n");
+      return 0;
+   }
+
+   /* 3.3 has the server pick, later versions offer a list */
+   if (minor < 7)
+      _out32(scheme);
+   else
+   {
+      _out8(1);
+      _out8(scheme);
+      if (!_out_flush() || !_read_exact(&type, 1))
+	 return 0;
+      if (type != scheme)
+	 return 0;
+   }
+
+   ok = 1;
+   if (scheme == rfbVncAuth)
+   {
+      vncRandomBytes(challenge);
+      memcpy(expected, challenge, CHALLENGESIZE);
+      vncEncryptBytes(expected, settings.password);
+      _out_bytes(challenge, CHALLENGESIZE);
+      if (!_out_flush() || !_read_exact(response, CHALLENGESIZE))
+	 return 0;
+      ok = !memcmp(response, expected, CHALLENGESIZE);
+   }
+   /* 3.8 has a result even without authentication */
+   if (scheme == rfbVncAuth || minor >= 8)
+   {
+      _out32(ok ? rfbVncAuthOK : rfbVncAuthFailed);
+      if (!ok && minor >= 8)
+      {
+	 _out32(strlen("Authentication failed"));
+	 _out_bytes("Authentication failed", strlen("Authentication failed"));
+      }
+   }
+   if (!_out_flush() || !ok)
+      return 0;
+
+   if (!_read_exact(&shared, 1))
+      return 0;
+
+   /* our own format: 32 bit true colour, 0x00RRGGBB in little endian */
+   fmt.bpp = 32;
+   fmt.depth = 24;
+   fmt.bigendian = 0;
+   fmt.truecolour = 1;
+   fmt.redmax = fmt.greenmax = fmt.bluemax = 255;
+   fmt.redshift = 16;
+   fmt.greenshift = 8;
+   fmt.blueshift = 0;
+   bytes_pp = 4;
+   cut_zeros = 1;
+
+   snprintf(name, sizeof(name), "test server: %s", workload->name);
+   _out16(width);
+   _out16(height);
+   _out8(fmt.bpp);
+   _out8(fmt.depth);
+   _out8(fmt.bigendian);
+   _out8(fmt.truecolour);
+   _out16(fmt.redmax);
+   _out16(fmt.greenmax);
+   _out16(fmt.bluemax);
+   _out8(fmt.redshift);
+   _out8(fmt.greenshift);
+   _out8(fmt.blueshift);
+   _out8(0);
+   _out8(0);
+   _out8(0);
+   _out32(strlen(name));
+   _out_bytes(name, strlen(name));
+   return _out_flush();
+}
+
+static void
+_print_stats(long usec)
+{
+   double secs = usec / 1000000.0;
+
+   fprintf(stderr, "%6.1f frames/s %6.1f updates/s %7.1f rects/s %8.2f MB/s",
+	 stats.frames / secs, stats.updates / secs, stats.rects / secs,
+	 stats.bytes / secs / 1048576.0);
+   if (stats.rtt_count)
+      fprintf(stderr, ", update to next request %.1f ms (max %.1f ms)",
+	    stats.rtt_sum / 1000.0 / stats.rtt_count, stats.rtt_max / 1000.0);
+   fprintf(stderr, "\n");
+   memset(&stats, 0, sizeof(stats));
+}
+
+/* Serves one client until it goes or the time is up. */
+static void
+_serve(int client)
+{
+   struct pollfd pfd;
+   long now, start, next_frame, next_stats, interval = 1000000L / settings.rate;
+   int timeout, one = 1;
+
+   sock = client;
+   setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+   width = settings.width;
+   height = settings.height;
+   fb = _alloc((size_t)width * height * sizeof(CARD32));
+   shadow = _alloc((size_t)width * height * sizeof(CARD32));
+   seed = 1;
+   workload->init();
+   _invalidate(0, 0, width, height);
+   if (!_handshake())
+   {
+      close(sock);
+      return;
+   }
+
+   start = _now();
+   next_frame = start + interval;
+   next_stats = start + STATS_INTERVAL_USEC;
+   pfd.fd = sock;
+   pfd.events = POLLIN;
+   while (1)
+   {
+      now = _now();
+      if (settings.time && now - start >= settings.time * 1000000L)
+	 break;
+      if (now >= next_stats)
+      {
+	 _print_stats(now - next_stats + STATS_INTERVAL_USEC);
+	 next_stats = now + STATS_INTERVAL_USEC;
+      }
+      if (now >= next_frame)
+      {
+	 frame++;
+	 stats.frames++;
+	 workload->step();
+	 /* a frame late is as good as it gets, do not catch up */
+	 next_frame += interval;
+	 if (next_frame < now)
+	    next_frame = now + interval;
+	 if (!_send_update())
+	    break;
+      }
+
+      timeout = (next_frame - now + 999) / 1000;
+      if (poll(&pfd, 1, timeout) < 0)
+      {
+	 if (errno == EINTR)
+	    continue;
+	 break;
+      }
+      if (pfd.revents)
+      {
+	 if (!_handle_client_message() || !_send_update())
+	    break;
+      }
+   }
+   close(sock);
+}
+
+static void
+_usage(char *name)
+{
+   fprintf(stderr, "\n"
+      "Usage: %s [<options>]\n"
+      "\n"
+      "A VNC server with made up screen contents, for measuring clients.\n"
+      "\n"
+      "  -d, --display N            "   "Display to serve, port 5900 + N (default 1).\n"
+      "  -g, --geometry WxH         "   "Size of the screen (default 1024x768).\n"
+      "  -w, --workload NAME        "   "What the screen shows: text, noise or drag\n"
+      "                             "   "(default text).\n"
+      "  -r, --rate FPS             "   "Frames drawn per second (default 30).\n"
+      "  -p, --password STRING      "   "Require VNC authentication.\n"
+      "  -t, --time SECONDS         "   "Disconnect clients after this time.\n"
+      "  -o, --once                 "   "Exit after the first client.\n"
+      "  -h, --help                 "   "Show this text and exit.\n"
+      "\n", name);
+   exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+   static struct option lopts[] = {
+      {"display",  1, NULL, 'd'},
+      {"geometry", 1, NULL, 'g'},
+      {"workload", 1, NULL, 'w'},
+      {"rate",     1, NULL, 'r'},
+      {"password", 1, NULL, 'p'},
+      {"time",     1, NULL, 't'},
+      {"once",     0, NULL, 'o'},
+      {"help",     0, NULL, 'h'},
+      {0, 0, 0, 0}
+   };
+   struct sockaddr_in s;
+   int optch, listener, client, one = 1;
+
+   while ((optch = getopt_long(argc, argv, "d:g:w:r:p:t:oh", lopts, NULL)) != -1)
+   {
+      switch (optch)
+      {
+	 case 'd':
+	    settings.display = atoi(optarg);
+	    break;
+	 case 'g':
+	    if (sscanf(optarg, "%dx%d", &settings.width, &settings.height) != 2
+		  || settings.width < TILE_SIZE || settings.height < TILE_SIZE
+		  || settings.width > 8192 || settings.height > 8192)
+	    {
+	       fprintf(stderr, "Invalid geometry: %s\n", optarg);
+	       exit(-2);
+	    }
+	    break;
+	 case 'w':
+	    settings.workload = optarg;
+	    break;
+	 case 'r':
+	    settings.rate = atoi(optarg);
+	    if (settings.rate <= 0 || settings.rate > 1000)
+	    {
+	       fprintf(stderr, "Invalid rate: %s\n", optarg);
+	       exit(-2);
+	    }
+	    break;
+	 case 'p':
+	    settings.password = optarg;
+	    break;
+	 case 't':
+	    settings.time = atoi(optarg);
+	    break;
+	 case 'o':
+	    settings.once = 1;
+	    break;
+	 default:
+	    _usage(argv[0]);
+      }
+   }
+   for (workload = workloads; workload->name; workload++)
+      if (!strcmp(workload->name, settings.workload))
+	 break;
+   if (!workload->name)
+   {
+      fprintf(stderr, "Unknown workload: %s\n", settings.workload);
+      exit(-2);
+   }
+
+   listener = socket(AF_INET, SOCK_STREAM, 0);
+   setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+   memset(&s, 0, sizeof(s));
+   s.sin_family = AF_INET;
+   s.sin_port = htons(5900 + settings.display);
+   s.sin_addr.s_addr = htonl(INADDR_ANY);
+   if (listener < 0 || bind(listener, (struct sockaddr *)&s, sizeof(s)) < 0
+	 || listen(listener, 5) < 0)
+   {
+      perror("listen");
+      exit(1);
+   }
+   fprintf(stderr, "Serving %s at %dx%d, %d frames/s on display %d\n",
+	 workload->name, settings.width, settings.height, settings.rate,
+	 settings.display);
+
+   /* no zombies */
+   signal(SIGCHLD, SIG_IGN);
+   while (1)
+   {
+      if ((client = accept(listener, NULL, NULL)) < 0)
+      {
+	 if (errno == EINTR)
+	    continue;
+	 perror("accept");
+	 exit(1);
+      }
+      if (settings.once)
+      {
+	 close(listener);
+	 _serve(client);
+	 return 0;
+      }
+      if (fork() == 0)
+      {
+	 close(listener);
+	 _serve(client);
+	 exit(0);
+      }
+      close(client);
+   }
+}
@@ -35,19 +35,29 @@
 #include "directvnc.h"
 #include "jpeg.h"
 #include "tight.h"
+#include "arena.h"
 
 /*
  * Variables for the ``tight'' encoding implementation.
  */
 #define RGB_TO_PIXEL(bpp,r,g,b)						\
-  (((CARD16)(r) & opt.client.redmax) << opt.client.redshift |	\
-   ((CARD16)(g) & opt.client.greenmax) << opt.client.greenshift |	\
-   ((CARD16)(b) & opt.client.bluemax) << opt.client.blueshift)
+  (((CARD##bpp)(r) & opt.client.redmax) << opt.client.redshift |	\
+   ((CARD##bpp)(g) & opt.client.greenmax) << opt.client.greenshift |	\
+   ((CARD##bpp)(b) & opt.client.bluemax) << opt.client.blueshift)
+
+#define RGB24_TO_PIXEL32(r,g,b)						\
+  (((CARD32)(r) & 0xFF) << opt.client.redshift |			\
+   ((CARD32)(g) & 0xFF) << opt.client.greenshift |			\
+   ((CARD32)(b) & 0xFF) << opt.client.blueshift)
 
 #define TIGHT_MIN_TO_COMPRESS 12
-/* Separate buffer for compressed data. */
-#define ZLIB_BUFFER_SIZE 512
-static char zlib_buffer[ZLIB_BUFFER_SIZE];
+/* Compressed data is inflated in portions of up to this many bytes, which
+ * are looked at in the receive buffer without copying them. */
+#define ZLIB_BUFFER_SIZE 8192
+/* Rects are inflated and drawn in bands of whole rows. A band buffer has
+ * room for at least this many rows of the rect, and at least BUFFER_SIZE
+ * bytes, so wide framebuffers are decoded in as few passes as narrow ones. */
+#define TIGHT_BAND_ROWS 32
 
 /* Four independent compression streams for zlib library. */
 static z_stream zlibStream[4];
@@ -59,14 +69,208 @@ static int zlibStreamActive[4] = {
 static int cutZeros;
 static int rectWidth, rectColors;
 static char tightPalette[256*4];
-static CARD8 tightPrevRow[2048*3*sizeof(CARD16)];
+/* gradient filter rows, rectWidth * 3 components each, in SCRATCH_TIGHT_ROWS */
+static CARD8 *tightPrevRow, *tightThisRow;
+/* all ones for every set bit of a byte, most significant bit first */
+static CARD32 tightMonoMask[256][8];
+
+/* The filters for the client pixel format, see SelectTightDecoders(). */
+struct tight_filters
+{
+  int bpp;
+  filterPtr copy, palette, gradient;
+};
+static const struct tight_filters *tightFilters;
+
+static void DrawTightRows (filterPtr filterFn, int x, int y, int w,
+			   int numRows, void *src, void *scratch);
 
 /* zlib stuff */
-static int raw_buffer_size = -1;
-static char *raw_buffer;
 static z_stream decompStream;
 static int decompStreamInited = 0;
 
+/*
+ * A Tight or Zlib rect whose zlib data is inflated portion by portion, as it
+ * comes in. left is 0 between rects.
+ */
+struct rect_inflate
+{
+  int left;			/* bytes of zlib data still to come */
+  z_streamp zs;
+  filterPtr filterFn;		/* Tight only */
+  int rowSize, bufferSize;
+  int rowsProcessed, extraBytes;
+  char *buffer;			/* scratch, inflated rows */
+  void *dst;			/* scratch, filtered pixels (Tight only) */
+};
+static struct rect_inflate tightInflate, zlibInflate;
+
+/*
+ * Looks at a compact length at offset n of what has arrived from the
+ * server. Returns the offset behind it and the length in *len, or where it
+ * would end so far and -1 in *len if it has not arrived completely.
+ */
+static unsigned int
+PeekCompactLen (unsigned int n, long *len)
+{
+  CARD8 *p, b;
+  int i;
+
+  *len = 0;
+  for (i = 0; i < 3; i++) {
+    if ((p = (CARD8 *)buffered_from_rfb_server(n + i + 1)) == NULL) {
+      *len = -1;
+      return n + i + 1;
+    }
+    b = p[n + i];
+    if (i == 2) {
+      *len |= (long)b << 14;
+      break;
+    }
+    *len |= (long)(b & 0x7F) << 7 * i;
+    if (!(b & 0x80))
+      break;
+  }
+  return n + i + 1;
+}
+
+/*
+ * Number of bytes the next part of a w x h Tight rect takes, as far as it can
+ * be told from what has arrived. The first part runs up to the zlib data,
+ * which follows in portions of up to ZLIB_BUFFER_SIZE bytes.
+ */
+unsigned int
+TightDataSize (int w, int h)
+{
+  CARD8 *p;
+  unsigned int n, pixel;
+  int comp_ctl, bitsPixel, rowSize;
+  long len;
+
+  if (tightInflate.left > 0)
+    return tightInflate.left < ZLIB_BUFFER_SIZE ?
+      tightInflate.left : ZLIB_BUFFER_SIZE;
+
+  if ((p = (CARD8 *)buffered_from_rfb_server(1)) == NULL)
+    return 1;
+  /* the lower 4 bits reset the zlib streams */
+  comp_ctl = p[0] >> 4;
+  pixel = cutZeros ? 3 : opt.client.bpp / 8;
+
+  if (comp_ctl == rfbTightFill)
+    return 1 + pixel;
+  if (comp_ctl == rfbTightJpeg) {
+    n = PeekCompactLen(1, &len);
+    return len < 0 ? n : n + len;
+  }
+  /* _handle_tight_encoded_message() complains about it */
+  if (comp_ctl > rfbTightMaxSubencoding)
+    return 1;
+
+  n = 1;
+  bitsPixel = cutZeros ? 24 : opt.client.bpp;
+  if (comp_ctl & rfbTightExplicitFilter) {
+    if ((p = (CARD8 *)buffered_from_rfb_server(2)) == NULL)
+      return 2;
+    n = 2;
+    if (p[1] == rfbTightFilterPalette) {
+      if ((p = (CARD8 *)buffered_from_rfb_server(3)) == NULL)
+	return 3;
+      n = 3 + (p[2] + 1) * pixel;
+      bitsPixel = p[2] == 1 ? 1 : 8;
+    }
+  }
+
+  rowSize = (w * bitsPixel + 7) / 8;
+  if (h * rowSize < TIGHT_MIN_TO_COMPRESS)
+    return n + h * rowSize;
+  return PeekCompactLen(n, &len);
+}
+
+/*
+ * Number of bytes the next part of a Zlib rect takes: its header, then the
+ * zlib data in portions of up to ZLIB_BUFFER_SIZE bytes.
+ */
+unsigned int
+ZlibDataSize (void)
+{
+  if (zlibInflate.left > 0)
+    return zlibInflate.left < ZLIB_BUFFER_SIZE ?
+      zlibInflate.left : ZLIB_BUFFER_SIZE;
+  return sz_rfbZlibHeader;
+}
+
+/*
+ * Inflates the next portion of the zlib data of a Tight rect and draws the
+ * rows that are complete.
+ */
+static int
+TightInflatePortion (rfbFramebufferUpdateRectHeader rectheader)
+{
+  struct rect_inflate *t = &tightInflate;
+  z_streamp zs = t->zs;
+  int err, portionLen, numRows;
+  char *src;
+
+  if (t->left > ZLIB_BUFFER_SIZE)
+    portionLen = ZLIB_BUFFER_SIZE;
+  else
+    portionLen = t->left;
+
+  /* inflate straight out of the receive buffer */
+  if ((src = peek_from_rfb_server(sock, portionLen)) == NULL)
+    return 0;
+
+  t->left -= portionLen;
+
+  zs->next_in = (Bytef *)src;
+  zs->avail_in = portionLen;
+
+  do {
+    zs->next_out = (Bytef *)&t->buffer[t->extraBytes];
+    zs->avail_out = t->bufferSize - t->extraBytes;
+
+    err = inflate(zs, Z_SYNC_FLUSH);
+    if (err == Z_BUF_ERROR)   /* Input exhausted -- no problem. */
+      break;
+    if (err != Z_OK && err != Z_STREAM_END) {
+      if (zs->msg != NULL) {
+	fprintf(stderr, "Inflate error: %s.\n", zs->msg);
+      } else {
+	fprintf(stderr, "Inflate error: %d.\n", err);
+      }
+      return 0;
+    }
+
+    numRows = (t->bufferSize - zs->avail_out) / t->rowSize;
+    if (t->rowsProcessed + numRows > rectheader.r.h) {
+      fprintf(stderr, "Tight inflate returned more data than the rect holds\n");
+      return 0;
+    }
+
+    DrawTightRows(t->filterFn, rectheader.r.x,
+		  rectheader.r.y + t->rowsProcessed,
+		  rectheader.r.w, numRows, t->buffer, t->dst);
+
+    t->extraBytes = t->bufferSize - zs->avail_out - numRows * t->rowSize;
+    if (t->extraBytes > 0)
+      memmove(t->buffer, &t->buffer[numRows * t->rowSize], t->extraBytes);
+
+    t->rowsProcessed += numRows;
+  }
+  while (zs->avail_out == 0);
+  skip_from_rfb_server(portionLen);
+
+  if (t->left > 0)
+    return RECT_MORE;
+
+  if (t->rowsProcessed != rectheader.r.h) {
+    fprintf(stderr, "Incorrect number of scan lines after decompression.\n");
+    return 0;
+  }
+  return RECT_DONE;
+}
+
 
 
 int
@@ -74,14 +278,20 @@ _handle_tight_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
 {
    CARD8 comp_ctl;
    CARD8 filter_id;
-   CARD16 fill_colour;
+   CARD8 fill_colour[4];
    int r=0, g=0, b=0;
    filterPtr filterFn;
    int err, stream_id, compressedLen, bitsPixel;
-   int bufferSize, rowSize, numRows, portionLen, rowsProcessed, extraBytes;
+   int bufferSize, rowSize;
+   int dstRowSize, bandRows;
    void *dst;
+   char *buffer;
    z_streamp zs;
 
+   /* the zlib data comes in portions after the rest */
+   if (tightInflate.left > 0)
+     return TightInflatePortion(rectheader);
+
    /* read the compression type */
    if (!read_from_rfb_server(sock, (char*)&comp_ctl, 1)) return 0;
 
@@ -98,14 +308,26 @@ _handle_tight_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
     comp_ctl >>= 1;
   }
 
+  /* JPEG rects are decoded in the background, put them on the screen
+   * before this rect is drawn over them */
+  if (comp_ctl != rfbTightJpeg)
+    JpegSync();
+
   /* Handle solid rectangles. */
    if (comp_ctl == rfbTightFill) {
 
-      if (!read_from_rfb_server(sock, (char*)&fill_colour, sizeof(fill_colour)))
-	 return 0;
-
-      rfb_get_rgb_from_data(&r, &g, &b, (char*)&fill_colour);
-      dfb_draw_rect_with_rgb(
+      if (cutZeros) {
+	 if (!read_from_rfb_server(sock, (char*)fill_colour, 3))
+	    return 0;
+	 r = fill_colour[0];
+	 g = fill_colour[1];
+	 b = fill_colour[2];
+      } else {
+	 if (!read_from_rfb_server(sock, (char*)fill_colour, opt.client.bpp / 8))
+	    return 0;
+	 rfb_get_rgb_from_data(&r, &g, &b, (char*)fill_colour);
+      }
+      display->fill(
 	    rectheader.r.x,
 	    rectheader.r.y,
 	    rectheader.r.w,
@@ -142,15 +364,15 @@ _handle_tight_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
 
     switch (filter_id) {
     case rfbTightFilterCopy:
-      filterFn = FilterCopy;
+      filterFn = tightFilters->copy;
       bitsPixel = InitFilterCopy(rectheader.r.w, rectheader.r.h);
       break;
     case rfbTightFilterPalette:
-      filterFn = FilterPalette;
+      filterFn = tightFilters->palette;
       bitsPixel = InitFilterPalette(rectheader.r.w, rectheader.r.h);
       break;
     case rfbTightFilterGradient:
-      filterFn = FilterGradient;
+      filterFn = tightFilters->gradient;
       bitsPixel = InitFilterGradient(rectheader.r.w, rectheader.r.h);
       break;
     default:
@@ -158,7 +380,7 @@ _handle_tight_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
       return 0;
     }
   } else {
-    filterFn = FilterCopy;
+    filterFn = tightFilters->copy;
     bitsPixel = InitFilterCopy(rectheader.r.w, rectheader.r.h);
   }
   if (bitsPixel == 0) {
@@ -169,20 +391,25 @@ _handle_tight_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
    /* Determine if the data should be decompressed or just copied. */
   rowSize = (rectheader.r.w * bitsPixel + 7) / 8;
  
+  /* Rows are inflated into the band buffer, and the filtered pixels go
+   * behind them when they cannot be written to the screen directly. */
+  dstRowSize = rectheader.r.w * (opt.client.bpp / 8);
+  bandRows = BUFFER_SIZE / (rowSize + dstRowSize + 1);
+  if (bandRows < TIGHT_BAND_ROWS)
+     bandRows = TIGHT_BAND_ROWS;
+  bufferSize = (bandRows * rowSize + 3) & ~3;
+  if (!(buffer = scratch_get(SCRATCH_DECODE,
+	      bufferSize + bandRows * dstRowSize + TIGHT_MIN_TO_COMPRESS * 4)))
+     return 0;
+
   /* rect is to small to be compressed reasonably, simply copy */
   if (rectheader.r.h * rowSize < TIGHT_MIN_TO_COMPRESS) {
     if (!read_from_rfb_server(sock, (char*)buffer, rectheader.r.h * rowSize))
       return 0;
 
     dst = (void *) &buffer[TIGHT_MIN_TO_COMPRESS * 4];
-    filterFn(rectheader.r.h, buffer, dst);
-    dfb_write_data_to_screen(
-	 rectheader.r.x, 
-	 rectheader.r.y, 
-	 rectheader.r.w, 
-	 rectheader.r.h, 
-	 dst
-	 );
+    DrawTightRows(filterFn, rectheader.r.x, rectheader.r.y, rectheader.r.w,
+		  rectheader.r.h, buffer, dst);
 
     return 1;
   }
@@ -210,73 +437,44 @@ _handle_tight_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
      zlibStreamActive[stream_id] = 1;
   }
 
-  /* Read, decode and draw actual pixel data in a loop. */
-  bufferSize = 640*480 * bitsPixel / (bitsPixel + opt.client.bpp) & 0xFFFFFFFC;
-  dst = &buffer[bufferSize];
-  if (rowSize > bufferSize) {
-     /* Should be impossible when BUFFER_SIZE >= 16384 */
-     fprintf(stderr, "Internal error: incorrect buffer size.\n");
-     return 0;
-  }
-
-  rowsProcessed = 0;
-  extraBytes = 0;
-
-  while (compressedLen > 0) {
-     if (compressedLen > ZLIB_BUFFER_SIZE)
-	portionLen = ZLIB_BUFFER_SIZE;
-     else
-	portionLen = compressedLen;
-
-     if (!read_from_rfb_server(sock, (char*)zlib_buffer, portionLen))
-	return 0;
-
-     compressedLen -= portionLen;
-
-     zs->next_in = (Bytef *)zlib_buffer;
-     zs->avail_in = portionLen;
-
-     do {
-	zs->next_out = (Bytef *)&buffer[extraBytes];
-	zs->avail_out = bufferSize - extraBytes;
-
-	err = inflate(zs, Z_SYNC_FLUSH);
-	if (err == Z_BUF_ERROR)   /* Input exhausted -- no problem. */
-	   break;
-	if (err != Z_OK && err != Z_STREAM_END) {
-	   if (zs->msg != NULL) {
-	      fprintf(stderr, "Inflate error: %s.\n", zs->msg);
-	   } else {
-	      fprintf(stderr, "Inflate error: %d.\n", err);
-	   }
-	   return 0;
-	}
-
-	numRows = (bufferSize - zs->avail_out) / rowSize;
+  /* The pixel data is inflated and drawn in bands, a portion of zlib data
+   * at a time. */
+  tightInflate.left = compressedLen;
+  tightInflate.zs = zs;
+  tightInflate.filterFn = filterFn;
+  tightInflate.rowSize = rowSize;
+  tightInflate.bufferSize = bufferSize;
+  tightInflate.rowsProcessed = 0;
+  tightInflate.extraBytes = 0;
+  tightInflate.buffer = buffer;
+  tightInflate.dst = &buffer[bufferSize];
+  return RECT_MORE;
+}
 
-	filterFn(numRows, buffer, dst);
+/*
+ * Runs the filter over numRows rows of filtered data in src. The pixels are
+ * written straight into the screen when it can take the rows as they are,
+ * otherwise they go to scratch first.
+ */
+static void
+DrawTightRows (filterPtr filterFn, int x, int y, int w, int numRows,
+	       void *src, void *scratch)
+{
+  char *dst;
+  int pitch;
 
-	extraBytes = bufferSize - zs->avail_out - numRows * rowSize;
-	if (extraBytes > 0)
-	   memcpy(buffer, &buffer[numRows * rowSize], extraBytes);
+  if (numRows <= 0)
+    return;
 
-        dfb_write_data_to_screen(
-	      rectheader.r.x, 
-	      rectheader.r.y + rowsProcessed, 
-	      rectheader.r.w, 
-	      numRows, 
-	      dst);
-	rowsProcessed += numRows;
-     }
-     while (zs->avail_out == 0);
+  dst = display->lock(x, y, w, numRows, &pitch);
+  if (dst) {
+    filterFn(numRows, src, dst, pitch);
+    display->unlock(x, y, w, numRows);
+    return;
   }
 
-  if (rowsProcessed != rectheader.r.h) {
-     fprintf(stderr, "Incorrect number of scan lines after decompression.\n");
-     return 0;
-  }
-  
-  return 1;
+  filterFn(numRows, src, scratch, w * (opt.client.bpp / 8));
+  display->write(x, y, w, numRows, scratch);
 }
 
 /*----------------------------------------------------------------------------
@@ -290,13 +488,24 @@ int
 InitFilterCopy (int rw, int rh)
 {
   rectWidth = rw;
-  return opt.client.bpp;
+  return cutZeros ? 24 : opt.client.bpp;
 }
 
-void
-FilterCopy (int numRows, void *src, void *dst)
+/* 32 bpp pixels of depth 24, sent as 3 byte RGB triplets (TPIXEL) */
+static void
+FilterCopy24 (int numRows, void *src, void *dst, int dstPitch)
 {
-   memcpy (dst, src, numRows * rectWidth * (opt.client.bpp / 8));
+  int x, y;
+  CARD8 *src8 = (CARD8 *)src;
+  CARD32 *dst32;
+
+  for (y = 0; y < numRows; y++) {
+    dst32 = (CARD32 *)((char *)dst + y * dstPitch);
+    for (x = 0; x < rectWidth; x++) {
+      dst32[x] = RGB24_TO_PIXEL32(src8[0], src8[1], src8[2]);
+      src8 += 3;
+    }
+  }
 }
 
 int
@@ -305,60 +514,58 @@ InitFilterGradient (int rw, int rh)
   int bits;
 
   bits = InitFilterCopy(rw, rh);
-  if (cutZeros)
-    memset(tightPrevRow, 0, rw * 3);
-  else
-    memset(tightPrevRow, 0, rw * 3 * sizeof(CARD16));
+  tightPrevRow = (CARD8 *)scratch_get(SCRATCH_TIGHT_ROWS,
+				      2 * rw * 3 * sizeof(CARD16));
+  if (!tightPrevRow)
+    return 0;
+  tightThisRow = tightPrevRow + rw * 3 * sizeof(CARD16);
+  memset(tightPrevRow, 0, rw * 3 * sizeof(CARD16));
 
   return bits;
 }
 
-void
-FilterGradient (int numRows, void* buffer, void *buffer2)
+static void
+FilterGradient24 (int numRows, void* buffer, void *buffer2, int dstPitch)
 {
   int x, y, c;
-  CARD16 *src = (CARD16 *)buffer;
-  CARD16 *dst = (CARD16 *)buffer2;
-  CARD16 *thatRow = (CARD16 *)tightPrevRow;
-  CARD16 thisRow[2048*3];
-  CARD16 pix[3];
-  CARD16 max[3];
-  int shift[3];
+  CARD8 *src = (CARD8 *)buffer;
+  CARD32 *dst;
+  CARD8 *thisRow;
+  CARD8 pix[3];
   int est[3];
 
-
-  max[0] = opt.client.redmax;
-  max[1] = opt.client.greenmax;
-  max[2] = opt.client.bluemax;
-
-  shift[0] = opt.client.redshift;
-  shift[1] = opt.client.greenshift;
-  shift[2] = opt.client.blueshift;
-
   for (y = 0; y < numRows; y++) {
+    dst = (CARD32 *)((char *)buffer2 + y * dstPitch);
 
-      /* First pixel in a row */
-      for (c = 0; c < 3; c++) {
-      pix[c] = (CARD16)(((src[y*rectWidth] >> shift[c]) + thatRow[c]) & max[c]);
+    thisRow = tightThisRow;
+
+    /* First pixel in a row */
+    for (c = 0; c < 3; c++) {
+      pix[c] = tightPrevRow[c] + src[y*rectWidth*3+c];
       thisRow[c] = pix[c];
     }
-    dst[y*rectWidth] = RGB_TO_PIXEL(opt.client.bpp, pix[0], pix[1], pix[2]);
+    dst[0] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
 
-      /* Remaining pixels of a row */
-      for (x = 1; x < rectWidth; x++) {
+    /* Remaining pixels of a row */
+    for (x = 1; x < rectWidth; x++) {
       for (c = 0; c < 3; c++) {
-	est[c] = (int)thatRow[x*3+c] + (int)pix[c] - (int)thatRow[(x-1)*3+c];
-	if (est[c] > (int)max[c]) {
-	  est[c] = (int)max[c];
-	} else if (est[c] < 0) {
-	  est[c] = 0;
+	est[c] = (int)tightPrevRow[x*3+c] + (int)pix[c] -
+		 (int)tightPrevRow[(x-1)*3+c];
+	if (est[c] > 0xFF) {
+	  est[c] = 0xFF;
+	} else if (est[c] < 0x00) {
+	  est[c] = 0x00;
 	}
-	pix[c] = (CARD16)(((src[y*rectWidth+x] >> shift[c]) + est[c]) & max[c]);
+	pix[c] = (CARD8)est[c] + src[(y*rectWidth+x)*3+c];
 	thisRow[x*3+c] = pix[c];
       }
-      dst[y*rectWidth+x] = RGB_TO_PIXEL(opt.client.bpp, pix[0], pix[1], pix[2]);
+      dst[x] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
     }
-    memcpy(thatRow, thisRow, rectWidth * 3 * sizeof(CARD16));
+
+    /* this row is the previous one of the next */
+    thisRow = tightPrevRow;
+    tightPrevRow = tightThisRow;
+    tightThisRow = thisRow;
   }
 }
 
@@ -366,6 +573,9 @@ int
 InitFilterPalette (int rw, int rh)
 {
   CARD8 numColors;
+  CARD8 *src = (CARD8 *)tightPalette;
+  CARD32 *palette32 = (CARD32 *)tightPalette;
+  int i, r, g, b;
   rectWidth = rw;
 
   if (!read_from_rfb_server(sock, (char*)&numColors, 1))
@@ -375,122 +585,106 @@ InitFilterPalette (int rw, int rh)
   if (++rectColors < 2)
     return 0;
 
-  if (!read_from_rfb_server(sock, (char*)&tightPalette, rectColors * (opt.client.bpp / 8)))
-    return 0;
-
-  return (rectColors == 2) ? 1 : 8;
-}
-
-void
-FilterPalette (int numRows, void *buffer, void *buffer2)
-{
-   /* FIXME works only in 16 bpp. The dst and palette pointers would need to
-    * be adjusted in size. Maybe after dinner ;) */
-  int x, y, b, w;
-  CARD8 *src = (CARD8 *)buffer;
-  CARD16 *dst = (CARD16 *)buffer2;
-  CARD16 *palette = (CARD16 *)tightPalette;
-
-  if (rectColors == 2) {
-    w = (rectWidth + 7) / 8;
-    for (y = 0; y < numRows; y++) {
-      for (x = 0; x < rectWidth / 8; x++) {
-	for (b = 7; b >= 0; b--)
-	  dst[y*rectWidth+x*8+7-b] = palette[src[y*w+x] >> b & 1];
-      }
-      for (b = 7; b >= 8 - rectWidth % 8; b--) {
-	dst[y*rectWidth+x*8+7-b] = palette[src[y*w+x] >> b & 1];
-      }
+  if (cutZeros) {
+    if (!read_from_rfb_server(sock, (char*)&tightPalette, rectColors * 3))
+      return 0;
+    /* expand the 3 byte entries into pixels in place, last one first */
+    for (i = rectColors - 1; i >= 0; i--) {
+      r = src[i*3];
+      g = src[i*3+1];
+      b = src[i*3+2];
+      palette32[i] = RGB24_TO_PIXEL32(r, g, b);
     }
   } else {
-    for (y = 0; y < numRows; y++)
-      for (x = 0; x < rectWidth; x++)
-	 dst[y*rectWidth+x] = palette[(int)src[y*rectWidth+x]];
+    if (!read_from_rfb_server(sock, (char*)&tightPalette, rectColors * (opt.client.bpp / 8)))
+      return 0;
   }
+
+  return (rectColors == 2) ? 1 : 8;
 }
 
+#define BPP 8
+#include "tightbpp.h"
+#undef BPP
+#define BPP 16
+#include "tightbpp.h"
+#undef BPP
+#define BPP 32
+#include "tightbpp.h"
+#undef BPP
+
+static const struct tight_filters tightFilterTable[] = {
+  {  8, FilterCopy8,  FilterPalette8,  FilterGradient8 },
+  { 16, FilterCopy16, FilterPalette16, FilterGradient16 },
+  { 32, FilterCopy32, FilterPalette32, FilterGradient32 },
+  /* 32 bpp pixels of depth 24 are sent as 3 byte RGB triplets (TPIXEL) */
+  { 24, FilterCopy24, FilterPalette32, FilterGradient24 },
+  { 0, NULL, NULL, NULL }
+};
+
+/*
+ * Picks the filters for the client pixel format. Called once the pixel
+ * format has been sent to the server.
+ */
 int
-_handle_zlib_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
+SelectTightDecoders (void)
 {
-  rfbZlibHeader hdr;
-  int remaining;
-  int inflateResult;
-  int toRead;
-
-  /* First make sure we have a large enough raw buffer to hold the
-   * decompressed data.  In practice, with a fixed BPP, fixed frame
-   * buffer size and the first update containing the entire frame
-   * buffer, this buffer allocation should only happen once, on the
-   * first update.
-   */
-  if ( raw_buffer_size < (( rectheader.r.w * rectheader.r.h ) 
-	                   * ( opt.client.bpp / 8 ))) {
+  const struct tight_filters *f;
+  int bpp = opt.client.bpp;
+  int i, b;
 
-    if ( raw_buffer != NULL ) {
+  for (i = 0; i < 256; i++)
+    for (b = 0; b < 8; b++)
+      tightMonoMask[i][b] = (i >> (7 - b) & 1) ? 0xFFFFFFFF : 0;
 
-      free( raw_buffer );
+  cutZeros = (opt.client.bpp == 32 && opt.client.depth == 24 &&
+	      opt.client.redmax == 0xFF && opt.client.greenmax == 0xFF &&
+	      opt.client.bluemax == 0xFF);
+  if (cutZeros)
+    bpp = 24;
 
+  for (f = tightFilterTable; f->bpp; f++) {
+    if (f->bpp == bpp) {
+      tightFilters = f;
+      return 1;
     }
-
-    raw_buffer_size = (( rectheader.r.w * rectheader.r.h ) 
-	                * ( opt.client.bpp / 8 ));
-    raw_buffer = (char*) malloc( raw_buffer_size );
-
   }
+  fprintf(stderr, "Tight encoding: %d bpp is not supported.\n", opt.client.bpp);
+  return 0;
+}
 
-  if (!read_from_rfb_server(sock, (char *)&hdr, sz_rfbZlibHeader))
-    return 0;
-
-  remaining = Swap32IfLE(hdr.nBytes);
-
-  /* Need to initialize the decompressor state. */
-  decompStream.next_in   = ( Bytef * )buffer;
-  decompStream.avail_in  = 0;
-  decompStream.next_out  = ( Bytef * )raw_buffer;
-  decompStream.avail_out = raw_buffer_size;
-  decompStream.data_type = Z_BINARY;
-
-  /* Initialize the decompression stream structures on the first invocation. */
-  if ( decompStreamInited == 0 ) {
-
-    inflateResult = inflateInit( &decompStream );
-
-    if ( inflateResult != Z_OK ) {
-      fprintf(stderr,
-              "inflateInit returned error: %d, msg: %s\n",
-              inflateResult,
-              decompStream.msg);
-      return 0;
-    }
-
-    decompStreamInited = 1;
+/*
+ * Inflates the next portion of the zlib data of a Zlib rect and draws the
+ * rows that are complete.
+ */
+static int
+ZlibInflatePortion (rfbFramebufferUpdateRectHeader rectheader)
+{
+  struct rect_inflate *t = &zlibInflate;
+  int portionLen, inflateResult, numRows;
+  char *src, *band = t->buffer;
 
-  }
+  if (t->left > ZLIB_BUFFER_SIZE)
+    portionLen = ZLIB_BUFFER_SIZE;
+  else
+    portionLen = t->left;
 
-  inflateResult = Z_OK;
+  /* inflate straight out of the receive buffer */
+  if ((src = peek_from_rfb_server(sock, portionLen)) == NULL)
+    return 0;
 
-  /* Process buffer full of data until no more to process, or
-   * some type of inflater error, or Z_STREAM_END.
-   */
-  while (( remaining > 0 ) &&
-         ( inflateResult == Z_OK )) {
-  
-    if ( remaining > BUFFER_SIZE ) {
-      toRead = BUFFER_SIZE;
-    }
-    else {
-      toRead = remaining;
-    }
+  t->left -= portionLen;
 
-    /* Fill the buffer, obtaining data from the server. */
-    if (!read_from_rfb_server(sock, buffer,toRead))
-      return 0;
+  decompStream.next_in  = ( Bytef * )src;
+  decompStream.avail_in = portionLen;
 
-    decompStream.next_in  = ( Bytef * )buffer;
-    decompStream.avail_in = toRead;
+  do {
+    decompStream.next_out  = ( Bytef * )&band[t->extraBytes];
+    decompStream.avail_out = t->bufferSize - t->extraBytes;
 
-    /* Need to uncompress buffer full. */
     inflateResult = inflate( &decompStream, Z_SYNC_FLUSH );
+    if ( inflateResult == Z_BUF_ERROR )   /* Input exhausted -- no problem. */
+      break;
 
     /* We never supply a dictionary for compression. */
     if ( inflateResult == Z_NEED_DICT ) {
@@ -505,41 +699,103 @@ _handle_zlib_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
       return 0;
     }
 
-    /* Result buffer allocated to be at least large enough.  We should
-     * never run out of space!
-     */
-    if (( decompStream.avail_in > 0 ) &&
-        ( decompStream.avail_out <= 0 )) {
-      fprintf(stderr,"zlib inflate ran out of space!\n");
+    numRows = t->rowSize ?
+      (t->bufferSize - decompStream.avail_out) / t->rowSize : 0;
+    if ( t->rowsProcessed + numRows > rectheader.r.h ) {
+      fprintf(stderr, "zlib inflate returned more data than the rect holds\n");
       return 0;
     }
 
-    remaining -= toRead;
+    /* Put the completed rows on the screen. */
+    if ( numRows > 0 ) {
+      display->write(
+	   rectheader.r.x, 
+	   rectheader.r.y + t->rowsProcessed, 
+	   rectheader.r.w, 
+	   numRows, 
+	   band
+	   );
+
+      t->extraBytes = t->bufferSize - decompStream.avail_out -
+	numRows * t->rowSize;
+      if ( t->extraBytes > 0 )
+        memcpy(band, &band[numRows * t->rowSize], t->extraBytes);
+    }
+    else
+      t->extraBytes = t->bufferSize - decompStream.avail_out;
 
-  } /* while ( remaining > 0 ) */
+    t->rowsProcessed += numRows;
+  }
+  while ( decompStream.avail_out == 0 && t->extraBytes < t->bufferSize );
+  skip_from_rfb_server(portionLen);
 
-  if ( inflateResult == Z_OK ) {
+  if ( t->left > 0 )
+    return RECT_MORE;
 
-    /* Put the uncompressed contents of the update on the screen. */
-    dfb_write_data_to_screen(
-	 rectheader.r.x, 
-	 rectheader.r.y, 
-	 rectheader.r.w, 
-	 rectheader.r.h, 
-	 raw_buffer
-	 );
+  if ( t->rowSize && t->rowsProcessed != rectheader.r.h ) {
+    fprintf(stderr, "Incorrect number of scan lines after decompression.\n");
+    return 0;
+  }
 
+  return RECT_DONE;
+}
 
-  }
-  else {
+int
+_handle_zlib_encoded_message(rfbFramebufferUpdateRectHeader rectheader)
+{
+  rfbZlibHeader hdr;
+  int inflateResult;
+  struct rect_inflate *t = &zlibInflate;
+
+  /* the zlib data comes in portions after the header */
+  if (t->left > 0)
+    return ZlibInflatePortion(rectheader);
+
+  /* The rect is inflated and drawn in bands of whole rows, so however large
+   * it is, only a band has to fit in memory. The scratch buffer only grows,
+   * once the widest rect has been seen it is not allocated again.
+   */
+  t->rowSize = rectheader.r.w * (opt.client.bpp / 8);
+  t->bufferSize = TIGHT_BAND_ROWS * t->rowSize;
+  if (t->bufferSize < BUFFER_SIZE)
+    t->bufferSize = BUFFER_SIZE;
+  if (!(t->buffer = scratch_get(SCRATCH_ZLIB, t->bufferSize)))
+    return 0;
 
-    fprintf(stderr,
-            "zlib inflate returned error: %d, msg: %s\n",
-            inflateResult,
-            decompStream.msg);
+  if (!read_from_rfb_server(sock, (char *)&hdr, sz_rfbZlibHeader))
     return 0;
 
+  /* Initialize the decompression stream structures on the first invocation. */
+  if ( decompStreamInited == 0 ) {
+
+    decompStream.next_in   = Z_NULL;
+    decompStream.avail_in  = 0;
+    decompStream.zalloc    = Z_NULL;
+    decompStream.zfree     = Z_NULL;
+    decompStream.opaque    = Z_NULL;
+    inflateResult = inflateInit( &decompStream );
+
+    if ( inflateResult != Z_OK ) {
+      fprintf(stderr,
+              "inflateInit returned error: %d, msg: %s\n",
+              inflateResult,
+              decompStream.msg);
+      return 0;
+    }
+
+    decompStreamInited = 1;
+
   }
 
-  return 1;
+  t->left = Swap32IfLE(hdr.nBytes);
+  t->rowsProcessed = 0;
+  t->extraBytes = 0;
+
+  if ( t->left > 0 )
+    return RECT_MORE;
+  if ( t->rowSize && rectheader.r.h ) {
+    fprintf(stderr, "Incorrect number of scan lines after decompression.\n");
+    return 0;
+  }
+  return RECT_DONE;
 }
@@ -20,16 +20,17 @@
 
 /* Type declarations for tight */
 
-typedef void (*filterPtr)(int, void *, void *);
+/* numRows rows of the rect from src into dst, dstPitch bytes per dst row */
+typedef void (*filterPtr)(int numRows, void *src, void *dst, int dstPitch);
 
 /* Prototypes for tight*/
 
 int InitFilterCopy (int rw, int rh);
 int InitFilterPalette (int rw, int rh);
 int InitFilterGradient (int rw, int rh);
-void FilterCopy (int numRows, void* srcBuffer, void *destBuffer);
-void FilterPalette (int numRows, void* srcBuffer, void *destBuffer);
-void FilterGradient (int numRows, void* srcBuffer, void *destBuffer);
+int SelectTightDecoders (void);
+unsigned int TightDataSize (int w, int h);
+unsigned int ZlibDataSize (void);
 
 int _handle_tight_encoded_message(rfbFramebufferUpdateRectHeader rectheader);
 int _handle_zlib_encoded_message(rfbFramebufferUpdateRectHeader rectheader);
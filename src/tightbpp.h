@@ -0,0 +1,154 @@
+/*
+ *  Copyright (C) 2000, 2001 Const Kaplinsky.  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, a copy can be downloaded from 
+ *  http://www.gnu.org/licenses/gpl.html, or obtained by writing to the
+ *  Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, 
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/* Type declarations for tight */
+
+/*
+ * tightbpp.h - the pixel size dependent part of the Tight decoder.
+ *
+ * This file is included from tight.c once for every BPP of 8, 16 and 32, so
+ * the filters work on pixels of their own size without checking
+ * opt.client.bpp for every pixel.
+ */
+
+#define CARDBPP CONCAT2E(CARD,BPP)
+#define FilterCopyBPP CONCAT2E(FilterCopy,BPP)
+#define FilterPaletteBPP CONCAT2E(FilterPalette,BPP)
+#define FilterGradientBPP CONCAT2E(FilterGradient,BPP)
+
+static void
+FilterCopyBPP (int numRows, void *src, void *dst, int dstPitch)
+{
+  int y, rowSize = rectWidth * (BPP / 8);
+
+  if (dstPitch == rowSize) {
+    memcpy (dst, src, numRows * rowSize);
+    return;
+  }
+  for (y = 0; y < numRows; y++)
+    memcpy ((char *)dst + y * dstPitch, (char *)src + y * rowSize, rowSize);
+}
+
+static void
+FilterGradientBPP (int numRows, void *buffer, void *buffer2, int dstPitch)
+{
+  int x, y, c;
+  CARDBPP *src = (CARDBPP *)buffer;
+  CARDBPP *dst;
+  CARD16 *thatRow = (CARD16 *)tightPrevRow;
+  CARD16 *thisRow = (CARD16 *)tightThisRow;
+  CARD16 *swap;
+  CARD16 pix[3];
+  CARD16 max[3];
+  int shift[3];
+  int est[3];
+
+  max[0] = opt.client.redmax;
+  max[1] = opt.client.greenmax;
+  max[2] = opt.client.bluemax;
+
+  shift[0] = opt.client.redshift;
+  shift[1] = opt.client.greenshift;
+  shift[2] = opt.client.blueshift;
+
+  for (y = 0; y < numRows; y++) {
+    dst = (CARDBPP *)((char *)buffer2 + y * dstPitch);
+
+    /* First pixel in a row */
+    for (c = 0; c < 3; c++) {
+      pix[c] = (CARD16)(((src[y*rectWidth] >> shift[c]) + thatRow[c]) & max[c]);
+      thisRow[c] = pix[c];
+    }
+    dst[0] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
+
+    /* Remaining pixels of a row */
+    for (x = 1; x < rectWidth; x++) {
+      for (c = 0; c < 3; c++) {
+	est[c] = (int)thatRow[x*3+c] + (int)pix[c] - (int)thatRow[(x-1)*3+c];
+	if (est[c] > (int)max[c]) {
+	  est[c] = (int)max[c];
+	} else if (est[c] < 0) {
+	  est[c] = 0;
+	}
+	pix[c] = (CARD16)(((src[y*rectWidth+x] >> shift[c]) + est[c]) & max[c]);
+	thisRow[x*3+c] = pix[c];
+      }
+      dst[x] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
+    }
+    swap = thatRow;
+    thatRow = thisRow;
+    thisRow = swap;
+  }
+  tightPrevRow = (CARD8 *)thatRow;
+  tightThisRow = (CARD8 *)thisRow;
+}
+
+/*
+ * Two colour rects (mostly text) are expanded a byte, i.e. eight pixels, at a
+ * time: tightMonoMask selects the bits that differ between background and
+ * foreground, so there is no branch and no shift per pixel.
+ */
+static void
+FilterPaletteBPP (int numRows, void *buffer, void *buffer2, int dstPitch)
+{
+  int x, y, b, w;
+  CARD8 *src = (CARD8 *)buffer;
+  CARDBPP *dst;
+  CARDBPP *palette = (CARDBPP *)tightPalette;
+  CARDBPP bg, diff;
+  CARD32 *m;
+
+  if (rectColors == 2) {
+    w = (rectWidth + 7) / 8;
+    bg = palette[0];
+    diff = palette[0] ^ palette[1];
+    for (y = 0; y < numRows; y++) {
+      dst = (CARDBPP *)((char *)buffer2 + y * dstPitch);
+      for (x = 0; x < rectWidth / 8; x++) {
+	m = tightMonoMask[src[y*w+x]];
+	dst[0] = bg ^ (diff & (CARDBPP)m[0]);
+	dst[1] = bg ^ (diff & (CARDBPP)m[1]);
+	dst[2] = bg ^ (diff & (CARDBPP)m[2]);
+	dst[3] = bg ^ (diff & (CARDBPP)m[3]);
+	dst[4] = bg ^ (diff & (CARDBPP)m[4]);
+	dst[5] = bg ^ (diff & (CARDBPP)m[5]);
+	dst[6] = bg ^ (diff & (CARDBPP)m[6]);
+	dst[7] = bg ^ (diff & (CARDBPP)m[7]);
+	dst += 8;
+      }
+      if (rectWidth % 8) {
+	m = tightMonoMask[src[y*w+x]];
+	for (b = 0; b < rectWidth % 8; b++)
+	  dst[b] = bg ^ (diff & (CARDBPP)m[b]);
+      }
+    }
+  } else {
+    for (y = 0; y < numRows; y++) {
+      dst = (CARDBPP *)((char *)buffer2 + y * dstPitch);
+      for (x = 0; x < rectWidth; x++)
+	 dst[x] = palette[(int)src[y*rectWidth+x]];
+    }
+  }
+}
+
+#undef CARDBPP
+#undef FilterCopyBPP
+#undef FilterPaletteBPP
+#undef FilterGradientBPP
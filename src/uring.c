@@ -0,0 +1,341 @@
+/*
+ * Copyright (C) 2001  Till Adam
+ * Authors: Till Adam <till@adam-lilienthal.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, a copy can be downloaded from
+ * http://www.gnu.org/licenses/gpl.html, or obtained by writing to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * uring.c - io_uring backend for the server connection.
+ *
+ * One multishot receive stays armed on the socket for the whole session.
+ * The kernel picks a buffer from a ring of provided buffers for every chunk
+ * it receives, so data is read as it arrives without a syscall per read, and
+ * waiting for data is waiting for a completion. uring_recv() copies chunks
+ * out and hands their buffers back to the kernel. Sends go through the same
+ * ring. The calls behave like read(), send() and poll() on a non-blocking
+ * socket, so sockets.c can use either backend the same way.
+ *
+ * This file does not depend on the rest of directvnc, the benchmark in
+ * uringbench.c uses it as well.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "uring.h"
+
+#ifdef HAVE_LIBURING
+
+#include <liburing.h>
+
+#define URING_ENTRIES 64
+#define URING_BUFS 64             /* a power of two */
+#define URING_BUF_SIZE 65536
+#define URING_BGID 1
+
+#define URING_RECV 1
+#define URING_SEND 2
+
+static struct io_uring ring;
+static struct io_uring_buf_ring *buf_ring = NULL;
+static char *bufs = NULL;
+static int ring_sock = -1;
+static int armed = 0;             /* the multishot receive is active */
+static int eof = 0;
+static int recv_error = 0;
+static int send_done, send_res;
+
+/* received chunks not handed out yet, each holds a provided buffer */
+static struct
+{
+   int bid;
+   int len;
+   int off;
+} chunks[URING_BUFS];
+static unsigned int chunk_head = 0, chunk_count = 0;
+
+static void
+_uring_recycle(int bid)
+{
+   io_uring_buf_ring_add(buf_ring, bufs + bid * URING_BUF_SIZE,
+	 URING_BUF_SIZE, bid, io_uring_buf_ring_mask(URING_BUFS), 0);
+   io_uring_buf_ring_advance(buf_ring, 1);
+}
+
+static int
+_uring_arm(void)
+{
+   struct io_uring_sqe *sqe;
+
+   if (armed || eof || recv_error)
+      return 1;
+   if (!(sqe = io_uring_get_sqe(&ring)))
+      return 0;
+   io_uring_prep_recv_multishot(sqe, ring_sock, NULL, 0, 0);
+   sqe->flags |= IOSQE_BUFFER_SELECT;
+   sqe->buf_group = URING_BGID;
+   io_uring_sqe_set_data64(sqe, URING_RECV);
+   armed = 1;
+   return io_uring_submit(&ring) >= 0;
+}
+
+/*
+ * Takes in all completions that are there.
+ */
+static void
+_uring_reap(void)
+{
+   struct io_uring_cqe *cqe;
+   unsigned int slot;
+
+   while (io_uring_peek_cqe(&ring, &cqe) == 0)
+   {
+      if (io_uring_cqe_get_data64(cqe) == URING_SEND)
+      {
+	 send_res = cqe->res;
+	 send_done = 1;
+      }
+      else
+      {
+	 if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+	 {
+	    slot = (chunk_head + chunk_count++) % URING_BUFS;
+	    chunks[slot].bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	    chunks[slot].len = cqe->res;
+	    chunks[slot].off = 0;
+	 }
+	 else if (cqe->res == 0)
+	    eof = 1;
+	 /* out of buffers is not an error, we re-arm once some are back */
+	 else if (cqe->res < 0 && cqe->res != -ENOBUFS)
+	    recv_error = -cqe->res;
+	 if (!(cqe->flags & IORING_CQE_F_MORE))
+	    armed = 0;
+      }
+      io_uring_cqe_seen(&ring, cqe);
+   }
+}
+
+/*
+ * Sets up the ring for sock. Returns 0 if io_uring or multishot receive with
+ * provided buffers is not available, the plain socket calls are used then.
+ */
+int
+uring_open(int sock)
+{
+   int i, ret;
+
+   if (io_uring_queue_init(URING_ENTRIES, &ring, 0) < 0)
+      return 0;
+   buf_ring = io_uring_setup_buf_ring(&ring, URING_BUFS, URING_BGID, 0, &ret);
+   bufs = malloc(URING_BUFS * URING_BUF_SIZE);
+   if (!buf_ring || !bufs)
+   {
+      if (buf_ring)
+	 io_uring_free_buf_ring(&ring, buf_ring, URING_BUFS, URING_BGID);
+      free(bufs);
+      io_uring_queue_exit(&ring);
+      buf_ring = NULL;
+      bufs = NULL;
+      return 0;
+   }
+   for (i = 0; i < URING_BUFS; i++)
+      _uring_recycle(i);
+
+   ring_sock = sock;
+   if (!_uring_arm())
+   {
+      uring_close();
+      return 0;
+   }
+   return 1;
+}
+
+void
+uring_close(void)
+{
+   if (ring_sock < 0)
+      return;
+   io_uring_free_buf_ring(&ring, buf_ring, URING_BUFS, URING_BGID);
+   io_uring_queue_exit(&ring);
+   free(bufs);
+   buf_ring = NULL;
+   bufs = NULL;
+   ring_sock = -1;
+   armed = eof = recv_error = 0;
+   chunk_head = chunk_count = 0;
+}
+
+int
+uring_active(void)
+{
+   return ring_sock >= 0;
+}
+
+/*
+ * Copies up to n received bytes into out. Returns their number, 0 at the
+ * end of the stream, or -1 with errno set to EAGAIN if nothing has arrived.
+ */
+ssize_t
+uring_recv(char *out, size_t n)
+{
+   size_t done = 0, len;
+
+   _uring_reap();
+   while (done < n && chunk_count)
+   {
+      len = chunks[chunk_head].len - chunks[chunk_head].off;
+      if (len > n - done)
+	 len = n - done;
+      memcpy(out + done, bufs + chunks[chunk_head].bid * URING_BUF_SIZE
+	    + chunks[chunk_head].off, len);
+      done += len;
+      chunks[chunk_head].off += len;
+      if (chunks[chunk_head].off == chunks[chunk_head].len)
+      {
+	 _uring_recycle(chunks[chunk_head].bid);
+	 chunk_head = (chunk_head + 1) % URING_BUFS;
+	 chunk_count--;
+      }
+   }
+   if (!_uring_arm())
+   {
+      errno = EIO;
+      return -1;
+   }
+
+   if (done)
+      return done;
+   if (eof)
+      return 0;
+   errno = recv_error ? recv_error : EAGAIN;
+   return -1;
+}
+
+/*
+ * Sends what the socket takes of n bytes without blocking. Returns the
+ * number of bytes sent, or -1 with errno set.
+ */
+ssize_t
+uring_send(const char *buf, size_t n)
+{
+   struct io_uring_sqe *sqe;
+   struct io_uring_cqe *cqe;
+
+   if (!(sqe = io_uring_get_sqe(&ring)))
+   {
+      errno = EAGAIN;
+      return -1;
+   }
+   io_uring_prep_send(sqe, ring_sock, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+   io_uring_sqe_set_data64(sqe, URING_SEND);
+   send_done = 0;
+   if (io_uring_submit(&ring) < 0)
+   {
+      errno = EIO;
+      return -1;
+   }
+   /* MSG_DONTWAIT makes this complete right away */
+   while (!send_done)
+   {
+      if (io_uring_wait_cqe(&ring, &cqe) < 0)
+      {
+	 errno = EIO;
+	 return -1;
+      }
+      _uring_reap();
+   }
+   if (send_res < 0)
+   {
+      errno = -send_res;
+      return -1;
+   }
+   return send_res;
+}
+
+/*
+ * Waits up to milliseconds for received data. Returns 1 if uring_recv() has
+ * something to say, 0 on timeout and -1 on error.
+ */
+int
+uring_wait(int milliseconds)
+{
+   struct io_uring_cqe *cqe;
+   struct __kernel_timespec ts;
+   int ret;
+
+   _uring_reap();
+   if (!chunk_count && !eof && !recv_error)
+   {
+      if (!_uring_arm())
+	 return -1;
+      ts.tv_sec = milliseconds / 1000;
+      ts.tv_nsec = (milliseconds % 1000) * 1000000L;
+      ret = io_uring_wait_cqe_timeout(&ring, &cqe, &ts);
+      if (ret == -ETIME || ret == -EINTR)
+	 return 0;
+      if (ret < 0)
+	 return -1;
+      _uring_reap();
+   }
+   return chunk_count || eof || recv_error;
+}
+
+#else /* HAVE_LIBURING */
+
+int
+uring_open(int sock)
+{
+   return 0;
+}
+
+void
+uring_close(void)
+{
+}
+
+int
+uring_active(void)
+{
+   return 0;
+}
+
+ssize_t
+uring_recv(char *out, size_t n)
+{
+   errno = ENOSYS;
+   return -1;
+}
+
+ssize_t
+uring_send(const char *buf, size_t n)
+{
+   errno = ENOSYS;
+   return -1;
+}
+
+int
+uring_wait(int milliseconds)
+{
+   return -1;
+}
+
+#endif /* HAVE_LIBURING */
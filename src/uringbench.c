@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2001  Till Adam
+ * Authors: Till Adam <till@adam-lilienthal.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, a copy can be downloaded from
+ * http://www.gnu.org/licenses/gpl.html, or obtained by writing to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * uringbench.c - compares the io_uring backend with plain socket calls.
+ *
+ * A child process stands in for the server on loopback and sends the given
+ * number of megabytes in writes of varying size, the way framebuffer updates
+ * come in. The parent receives them the way sockets.c does: non-blocking
+ * reads into a large buffer, waiting up to 10 ms whenever nothing is there,
+ * once with read() and select() and once through uring.c.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "uring.h"
+
+#define RECV_BUF_SIZE (256 * 1024)
+
+static long
+_now(void)
+{
+   struct timeval tv;
+
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+/*
+ * The stand-in server: accepts one connection and sends total bytes in
+ * writes between 64 bytes and 64 KB.
+ */
+static void
+_serve(int listener, long total)
+{
+   static char data[65536];
+   int sock, n;
+   unsigned int seed = 1;
+
+   memset(data, 0x5a, sizeof(data));
+   if ((sock = accept(listener, NULL, NULL)) < 0)
+      exit(1);
+   while (total > 0)
+   {
+      seed = seed * 1103515245 + 12345;
+      n = 64 + (seed >> 8) % (sizeof(data) - 64);
+      if (n > total)
+	 n = total;
+      if ((n = write(sock, data, n)) <= 0)
+	 exit(1);
+      total -= n;
+   }
+   close(sock);
+   exit(0);
+}
+
+static int
+_connect(int port)
+{
+   struct sockaddr_in s;
+   int sock;
+
+   sock = socket(AF_INET, SOCK_STREAM, 0);
+   memset(&s, 0, sizeof(s));
+   s.sin_family = AF_INET;
+   s.sin_port = htons(port);
+   s.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (sock < 0 || connect(sock, (struct sockaddr *)&s, sizeof(s)) < 0)
+   {
+      perror("connect");
+      exit(1);
+   }
+   fcntl(sock, F_SETFL, O_NONBLOCK);
+   return sock;
+}
+
+static int
+_plain_wait(int sock)
+{
+   fd_set fds;
+   struct timeval tv = { 0, 10000 };
+
+   FD_ZERO(&fds);
+   FD_SET(sock, &fds);
+   return select(sock + 1, &fds, NULL, NULL, &tv);
+}
+
+/*
+ * Receives everything the stand-in server sends with one backend and prints
+ * how long it took and how many calls it needed.
+ */
+static void
+_run(const char *name, int use_uring, long total)
+{
+   static char buf[RECV_BUF_SIZE];
+   struct sockaddr_in s;
+   socklen_t len = sizeof(s);
+   int listener, sock, status;
+   long received = 0, calls = 0, waits = 0, start, usec;
+   ssize_t n;
+   pid_t pid;
+
+   listener = socket(AF_INET, SOCK_STREAM, 0);
+   memset(&s, 0, sizeof(s));
+   s.sin_family = AF_INET;
+   s.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (listener < 0 || bind(listener, (struct sockaddr *)&s, sizeof(s)) < 0
+	 || listen(listener, 1) < 0
+	 || getsockname(listener, (struct sockaddr *)&s, &len) < 0)
+   {
+      perror("listen");
+      exit(1);
+   }
+   if ((pid = fork()) == 0)
+      _serve(listener, total);
+   close(listener);
+
+   sock = _connect(ntohs(s.sin_port));
+   if (use_uring && !uring_open(sock))
+   {
+      printf("%-8s not available\n", name);
+      close(sock);
+      kill(pid, SIGTERM);
+      waitpid(pid, &status, 0);
+      return;
+   }
+
+   start = _now();
+   while (1)
+   {
+      calls++;
+      n = use_uring ? uring_recv(buf, sizeof(buf)) : read(sock, buf, sizeof(buf));
+      if (n > 0)
+	 received += n;
+      else if (n == 0)
+	 break;
+      else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      {
+	 waits++;
+	 if ((use_uring ? uring_wait(10) : _plain_wait(sock)) < 0)
+	    break;
+      }
+      else
+      {
+	 perror("receive");
+	 break;
+      }
+   }
+   usec = _now() - start;
+
+   if (use_uring)
+      uring_close();
+   close(sock);
+   waitpid(pid, &status, 0);
+
+   printf("%-8s %8.1f MB/s  %8ld receive calls  %8ld waits  %ld bytes\n",
+	 name, usec ? received / (double)usec : 0.0, calls, waits, received);
+}
+
+int
+main(int argc, char **argv)
+{
+   long total = (argc > 1 ? atol(argv[1]) : 1024) * 1024 * 1024;
+
+   if (total <= 0)
+   {
+      fprintf(stderr, "usage: %s [MB]\n", argv[0]);
+      return 1;
+   }
+   _run("plain", 0, total);
+   _run("io_uring", 1, total);
+   return 0;
+}